@@ -0,0 +1,159 @@
+#include "arc.h"
+#include "raymath.h"
+#include <math.h>
+
+bool arc_of(const segments *t, size_t i, arc *a) {
+  if (!segments_arc(t, i))
+    return false;
+  float x0 = t->x0[i], y0 = t->y0[i], x1 = t->x1[i], y1 = t->y1[i];
+  bool cw = t->kind[i] == 2;
+  float ci = t->ai[i], cj = t->aj[i];
+  if (isnan(ci)) {
+    // the center from R, on the side that makes the short way round for
+    // a positive R and the long way for a negative one
+    float r = cj, dx = x1 - x0, dy = y1 - y0, d = hypotf(dx, dy);
+    if (d == 0 || r == 0)
+      return false;
+    float e = cw ^ (r < 0) ? -1 : 1, h2 = (r - d / 2) * (r + d / 2),
+          h = h2 > 0 ? sqrtf(h2) : 0;
+    ci = (x1 - x0) / 2 + e * h * -dy / d;
+    cj = (y1 - y0) / 2 + e * h * dx / d;
+  }
+  a->cx = x0 + ci;
+  a->cy = y0 + cj;
+  a->r = hypotf(ci, cj);
+  if (a->r == 0)
+    return false;
+  float sx = -ci, sy = -cj, ex = x1 - a->cx, ey = y1 - a->cy;
+  a->a0 = atan2f(sy, sx);
+  float sweep = atan2f(sx * ey - sy * ex, sx * ex + sy * ey);
+  if (sweep < 0)
+    sweep += 2 * PI;
+  if (x0 == x1 && y0 == y1)
+    sweep = 0;
+  if (cw)
+    sweep -= 2 * PI;
+  else if (sweep == 0)
+    sweep = 2 * PI;
+  a->sweep = sweep;
+  return true;
+}
+
+size_t arc_points(const segments *t, size_t i, float tol, Vector3 *out,
+                  size_t max) {
+  Vector3 p0 = {t->x0[i], t->y0[i], t->z0[i]},
+          p1 = {t->x1[i], t->y1[i], t->z1[i]};
+  arc a;
+  if (max < 3 || !arc_of(t, i, &a)) {
+    out[0] = p0;
+    out[1] = p1;
+    return 2;
+  }
+  // a chord spanning angle s is at most r (1 - cos(s / 2)) from the arc
+  float step = tol < a.r ? 2 * acosf(1 - tol / a.r) : PI;
+  float n = ceilf(fabsf(a.sweep) / step);
+  size_t k = n < 1 ? 1 : n > max - 1 ? max - 1 : (size_t)n;
+  for (size_t j = 0; j < k; j++) {
+    float s = (float)j / k, angle = a.a0 + s * a.sweep;
+    out[j] = (Vector3){a.cx + a.r * cosf(angle), a.cy + a.r * sinf(angle),
+                       p0.z + s * (p1.z - p0.z)};
+  }
+  out[0] = p0;
+  out[k] = p1;
+  return k + 1;
+}
+
+BoundingBox arc_box(const segments *t, size_t i) {
+  Vector3 p0 = {t->x0[i], t->y0[i], t->z0[i]},
+          p1 = {t->x1[i], t->y1[i], t->z1[i]};
+  BoundingBox b = {Vector3Min(p0, p1), Vector3Max(p0, p1)};
+  arc a;
+  if (!arc_of(t, i, &a))
+    return b;
+  // the points farthest along x and y that the arc passes
+  for (int q = 0; q < 4; q++) {
+    float angle = q * PI / 2,
+          d = a.sweep > 0 ? angle - a.a0 : a.a0 - angle;
+    d -= 2 * PI * floorf(d / (2 * PI));
+    if (d > fabsf(a.sweep))
+      continue;
+    Vector3 p = {a.cx + a.r * cosf(angle), a.cy + a.r * sinf(angle), p0.z};
+    b.min = Vector3Min(b.min, p);
+    b.max = Vector3Max(b.max, p);
+  }
+  return b;
+}
+
+#ifdef TESTING
+#include <assert.h>
+#include <stdio.h>
+
+static size_t push_arc(segments *t, Vector4 p0, Vector4 p1, int kind, float ai,
+                       float aj) {
+  segments_push(t, p0, p1, kind, 0, 0);
+  t->ai[t->n - 1] = ai;
+  t->aj[t->n - 1] = aj;
+  return t->n - 1;
+}
+
+static bool near(float a, float b) { return fabsf(a - b) < 1e-4f; }
+
+int main() {
+  segments t;
+  segments_init(&t);
+  Vector3 p[64];
+  arc a;
+
+  // counterclockwise quarter from (10, 0) to (0, 10) around the origin
+  size_t i = push_arc(&t, (Vector4){10, 0, 0, 0}, (Vector4){0, 10, 1, 1}, 3,
+                      -10, 0);
+  assert(arc_of(&t, i, &a) && near(a.r, 10) && near(a.sweep, PI / 2));
+  size_t n = arc_points(&t, i, 0.01f, p, 64);
+  assert(n > 3 && p[0].x == 10 && p[n - 1].y == 10 && p[n - 1].z == 1);
+  for (size_t k = 0; k + 1 < n; k++) {
+    // points on the circle, chords within the tolerance of it
+    assert(near(hypotf(p[k].x, p[k].y), 10));
+    Vector3 m = Vector3Scale(Vector3Add(p[k], p[k + 1]), 0.5f);
+    assert(10 - hypotf(m.x, m.y) <= 0.0101f);
+  }
+  BoundingBox b = arc_box(&t, i);
+  assert(near(b.min.x, 0) && near(b.max.x, 10) && near(b.max.y, 10));
+
+  // the same ends clockwise go three quarters the other way round
+  i = push_arc(&t, (Vector4){10, 0, 0, 0}, (Vector4){0, 10, 0, 0}, 2, -10, 0);
+  assert(arc_of(&t, i, &a) && near(a.sweep, -3 * PI / 2));
+  b = arc_box(&t, i);
+  assert(near(b.min.x, -10) && near(b.min.y, -10) && near(b.max.y, 10));
+
+  // R: positive is the short way, negative the long way
+  i = push_arc(&t, (Vector4){10, 0, 0, 0}, (Vector4){0, 10, 0, 0}, 3, NAN,
+               10);
+  assert(arc_of(&t, i, &a) && near(a.cx, 0) && near(a.cy, 0) &&
+         near(a.sweep, PI / 2));
+  i = push_arc(&t, (Vector4){10, 0, 0, 0}, (Vector4){0, 10, 0, 0}, 3, NAN,
+               -10);
+  assert(arc_of(&t, i, &a) && near(a.cx, 10) && near(a.cy, 10) &&
+         near(a.sweep, 3 * PI / 2));
+  // too short for the chord: a half circle
+  i = push_arc(&t, (Vector4){0, 0, 0, 0}, (Vector4){4, 0, 0, 0}, 2, NAN, 1);
+  assert(arc_of(&t, i, &a) && near(a.cx, 2) && near(a.r, 2));
+
+  // a full circle, and the point count limit
+  i = push_arc(&t, (Vector4){5, 0, 0, 0}, (Vector4){5, 0, 0, 0}, 3, -5, 0);
+  assert(arc_of(&t, i, &a) && near(a.sweep, 2 * PI));
+  assert(arc_points(&t, i, 1e-6f, p, 64) == 64);
+  b = arc_box(&t, i);
+  assert(near(b.min.x, -5) && near(b.max.y, 5) && near(b.min.y, -5));
+
+  // straight moves and arcs without a radius are lines
+  i = push_arc(&t, (Vector4){0}, (Vector4){1, 2, 3, 0}, 2, 0, 0);
+  assert(!arc_of(&t, i, &a) && arc_points(&t, i, 0.1f, p, 64) == 2);
+  segments_push(&t, (Vector4){0}, (Vector4){1, 2, 3, 0}, 1, 0, 0);
+  assert(!arc_of(&t, t.n - 1, &a));
+  b = arc_box(&t, t.n - 1);
+  assert(b.max.x == 1 && b.max.y == 2 && b.max.z == 3);
+
+  segments_free(&t);
+  printf("ok\n");
+}
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+#include "raylib.h"
+#include "segments.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/// the circle a G2/G3 move goes around in the XY plane, with Z and E
+/// changing evenly along it like a helix
+typedef struct {
+  float cx, cy, r;
+  float a0;    // angle of the start seen from the center
+  float sweep; // counterclockwise is positive, a full circle is 2 pi
+} arc;
+
+/// the circle of move i, or false for a straight move
+/// Like Marlin, R too short for the chord makes a half circle, and I J
+/// ending where it started make a full one. Without a radius it's a line.
+bool arc_of(const segments *t, size_t i, arc *a);
+
+/// points along move i from its start to its end, at most max >= 2, with
+/// chords no farther than tol from the arc
+/// Returns how many, 2 for straight moves.
+size_t arc_points(const segments *t, size_t i, float tol, Vector3 *out,
+                  size_t max);
+
+/// box around all of move i, arc or not
+BoundingBox arc_box(const segments *t, size_t i);
@@ -0,0 +1,349 @@
+#include "batch.h"
+#include "csv.h"
+#include "gcode.h"
+#include "layers.h"
+#include "prof.h"
+#include "segments.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static int by_name(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool gcode_name(const char *name) {
+  size_t n = strlen(name);
+  return n > 6 && 0 == strcmp(name + n - 6, ".gcode");
+}
+
+static void push(char ***files, size_t *n, size_t *cap, char *file) {
+  if (*n == *cap) {
+    *cap = 2 * *cap + 16;
+    *files = realloc(*files, *cap * sizeof(char *));
+  }
+  (*files)[(*n)++] = file;
+}
+
+size_t batch_files(char **args, size_t nargs, char ***files) {
+  size_t n = 0, cap = 0;
+  *files = NULL;
+  for (size_t k = 0; k < nargs; k++) {
+    struct stat st;
+    DIR *d = 0 == stat(args[k], &st) && S_ISDIR(st.st_mode)
+                 ? opendir(args[k])
+                 : NULL;
+    if (!d) {
+      push(files, &n, &cap, strdup(args[k]));
+      continue;
+    }
+    size_t first = n;
+    for (struct dirent *e; (e = readdir(d));) {
+      if (!gcode_name(e->d_name))
+        continue;
+      size_t len = strlen(args[k]) + strlen(e->d_name) + 2;
+      char *path = malloc(len);
+      snprintf(path, len, "%s/%s", args[k], e->d_name);
+      push(files, &n, &cap, path);
+    }
+    closedir(d);
+    qsort(*files + first, n - first, sizeof(char *), by_name);
+  }
+  return n;
+}
+
+void batch_files_free(char **files, size_t n) {
+  for (size_t k = 0; k < n; k++)
+    free(files[k]);
+  free(files);
+}
+
+char *batch_csv_path(const char *prefix, const char *file) {
+  const char *base = strrchr(file, '/');
+  base = base ? base + 1 : file;
+  size_t stem = strlen(base);
+  if (gcode_name(base))
+    stem -= 6;
+  size_t len = strlen(prefix) + stem + sizeof("_out.csv");
+  char *path = malloc(len);
+  snprintf(path, len, "%s%.*s_out.csv", prefix, (int)stem, base);
+  return path;
+}
+
+typedef struct {
+  char *path;
+  size_t k;
+} named;
+
+static int by_path(const void *a, const void *b) {
+  const named *x = a, *y = b;
+  int c = strcmp(x->path, y->path);
+  return c ? c : x->k < y->k ? -1 : x->k > y->k;
+}
+
+// the csv path of each file, with _2, _3... added to the stem of the second
+// and later files, in order, of those that would go to the same one
+static void csv_paths(char **files, size_t n, const char *prefix,
+                      batch_result *r) {
+  named *ns = malloc(n * sizeof(named) + 1);
+  for (size_t k = 0; k < n; k++)
+    ns[k] = (named){batch_csv_path(prefix, files[k]), k};
+  qsort(ns, n, sizeof(named), by_path);
+  for (size_t k = 0, same = 1; k < n; k++) {
+    same = k && 0 == strcmp(ns[k].path, ns[k - 1].path) ? same + 1 : 1;
+    if (same > 1) {
+      size_t len = strlen(ns[k].path) + 24, stem = len - 24 - 8;
+      char *path = malloc(len);
+      snprintf(path, len, "%.*s_%zu_out.csv", (int)stem, ns[k].path, same);
+      r[ns[k].k].csv = path;
+    } else {
+      r[ns[k].k].csv = ns[k].path;
+    }
+  }
+  for (size_t k = 0; k < n; k++)
+    if (r[ns[k].k].csv != ns[k].path)
+      free(ns[k].path);
+  free(ns);
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// parse file into t and write its csv, on nthreads threads
+static void one(const char *file, segments *t, layers *ls, int nthreads,
+                batch_result *r) {
+  PROF_SCOPE("batch_file");
+  double t0 = now();
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    perror(file);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  r->bytes = st.st_size;
+  char *text = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                 fd, 0)
+                          : NULL;
+  close(fd);
+  if (text == MAP_FAILED) {
+    perror(file);
+    return;
+  }
+  gcode_parse(t, text, text + st.st_size, &r->ps, nthreads);
+  layers_build(ls, t);
+  r->segments = t->n;
+  r->layers = ls->n;
+  double t1 = now();
+  r->ok = csv_write_now(r->csv, t, 0, t->n, NULL, 0, 0, nthreads);
+  r->parse_s = t1 - t0;
+  r->csv_s = now() - t1;
+  if (text)
+    munmap(text, st.st_size);
+}
+
+void batch_header(FILE *out) {
+  fprintf(out, "file,ok,bytes,segments,layers,min_x,min_y,min_z,max_x,max_y,"
+               "max_z,center_x,center_y,center_z,parse_ms,csv_ms,csv\n");
+}
+
+static void summary(FILE *out, const char *file, const batch_result *r) {
+  fprintf(out, "%s,%d,%zu,%zu,%zu,%g,%g,%g,%g,%g,%g,%g,%g,%g,%.3f,%.3f,%s\n",
+          file, r->ok, r->bytes, r->segments, r->layers, r->ps.min.x,
+          r->ps.min.y, r->ps.min.z, r->ps.max.x, r->ps.max.y, r->ps.max.z,
+          r->ps.center.x, r->ps.center.y, r->ps.center.z, r->parse_s * 1e3,
+          r->csv_s * 1e3, r->csv);
+}
+
+typedef struct {
+  char **files;
+  size_t n;
+  int nthreads; // for each file
+  FILE *out;
+  batch_result *results;
+  bool *done;
+  atomic_size_t next;
+  pthread_mutex_t lock;
+  size_t printed, failed;
+} pool;
+
+static void *worker(void *p) {
+  pool *w = p;
+  prof_thread_name("batch");
+  segments t;
+  segments_init(&t);
+  layers ls = {0};
+  size_t k;
+  while ((k = atomic_fetch_add(&w->next, 1)) < w->n) {
+    batch_result *r = &w->results[k];
+    one(w->files[k], &t, &ls, w->nthreads, r);
+
+    // lines come out in the order of the files
+    pthread_mutex_lock(&w->lock);
+    w->done[k] = true;
+    w->failed += !r->ok;
+    for (; w->printed < w->n && w->done[w->printed]; w->printed++)
+      if (w->out)
+        summary(w->out, w->files[w->printed], &w->results[w->printed]);
+    if (w->out)
+      fflush(w->out);
+    pthread_mutex_unlock(&w->lock);
+  }
+  segments_free(&t);
+  layers_free(&ls);
+  return NULL;
+}
+
+size_t batch_run(char **files, size_t n, int nworkers, const char *prefix,
+                 FILE *out, batch_result *results) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores <= 0)
+    cores = 1;
+  if (nworkers <= 0)
+    nworkers = cores;
+  if ((size_t)nworkers > n)
+    nworkers = n ? n : 1;
+  pool w = {.files = files,
+            .n = n,
+            // a few big files still get every core
+            .nthreads = cores > nworkers ? cores / nworkers : 1,
+            .out = out,
+            .results = calloc(n + 1, sizeof(batch_result)),
+            .done = calloc(n + 1, sizeof(bool)),
+            .lock = PTHREAD_MUTEX_INITIALIZER};
+  csv_paths(files, n, prefix, w.results);
+  atomic_store(&w.next, 0);
+  pthread_t th[nworkers];
+  int started = 1;
+  for (; started < nworkers; started++)
+    if (pthread_create(&th[started], NULL, worker, &w))
+      break;
+  worker(&w);
+  for (int i = 1; i < started; i++)
+    pthread_join(th[i], NULL);
+
+  for (size_t k = 0; k < n; k++) {
+    if (results)
+      results[k] = w.results[k];
+    else
+      free(w.results[k].csv);
+  }
+  free(w.results);
+  free(w.done);
+  return w.failed;
+}
+
+#ifdef TESTING
+#include "synth.h"
+#include <assert.h>
+#include <errno.h>
+
+int main() {
+  // three files in a directory, a missing one, and one by name
+  // not named test_batch, which is the test binary
+  int made = mkdir("test_batch.d", 0755);
+  assert(0 == made || errno == EEXIST);
+  char *names[] = {"test_batch.d/b.gcode", "test_batch.d/a.gcode",
+                   "test_batch.d/c.gcode", "test_batch.d/d.gcode"};
+  char *texts[4];
+  size_t lens[4];
+  for (int k = 0; k < 4; k++) {
+    synth_opts o = SYNTH_DEFAULTS;
+    o.layers = 3 + k;
+    o.seed = k;
+    texts[k] = synth_gcode(&o, &lens[k]);
+    FILE *h = fopen(names[k], "w");
+    assert(h);
+    fwrite(texts[k], 1, lens[k], h);
+    fclose(h);
+  }
+  FILE *h = fopen("test_batch.d/notes.txt", "w");
+  assert(h);
+  fclose(h);
+  rename(names[3], "test_batch_d.gcode");
+
+  char *args[] = {"test_batch.d", "no_such.gcode", "test_batch_d.gcode"};
+  char **files;
+  size_t n = batch_files(args, 3, &files);
+  assert(n == 5 && 0 == strcmp(files[0], "test_batch.d/a.gcode") &&
+         0 == strcmp(files[2], "test_batch.d/c.gcode") &&
+         0 == strcmp(files[3], "no_such.gcode"));
+
+  char *p = batch_csv_path("out/x_", "a/b.c/part.gcode");
+  assert(0 == strcmp(p, "out/x_part_out.csv"));
+  free(p);
+  // files of the same name in different places don't share a csv
+  batch_result rs[3];
+  char *same[] = {"b/part.gcode", "a/part.gcode", "part"};
+  csv_paths(same, 3, "", rs);
+  assert(0 == strcmp(rs[0].csv, "part_out.csv") &&
+         0 == strcmp(rs[1].csv, "part_2_out.csv") &&
+         0 == strcmp(rs[2].csv, "part_3_out.csv"));
+  for (int k = 0; k < 3; k++)
+    free(rs[k].csv);
+
+  // the same csv and stats as parsing each file on its own
+  batch_result r[5];
+  FILE *out = tmpfile();
+  assert(1 == batch_run(files, n, 2, "test_batch_", out, r));
+  assert(!r[3].ok && r[4].ok);
+  for (size_t k = 0; k < n; k++) {
+    if (k == 3)
+      continue;
+    int m = k == 0 ? 1 : k == 1 ? 0 : k == 2 ? 2 : 3;
+    segments t;
+    segments_init(&t);
+    stats ps;
+    gcode_parse(&t, texts[m], texts[m] + lens[m], &ps, 1);
+    assert(r[k].bytes == lens[m] && r[k].segments == t.n &&
+           r[k].layers == (size_t)(3 + m) &&
+           0 == memcmp(&r[k].ps.center, &ps.center, sizeof(Vector4)));
+    assert(csv_write_now("test_batch_expect.csv", &t, 0, t.n, NULL, 0, 0, 1));
+    FILE *a = fopen(r[k].csv, "r"), *b = fopen("test_batch_expect.csv", "r");
+    assert(a && b);
+    int ca, cb;
+    do {
+      ca = fgetc(a);
+      cb = fgetc(b);
+      assert(ca == cb);
+    } while (ca != EOF);
+    fclose(a);
+    fclose(b);
+    unlink(r[k].csv);
+    segments_free(&t);
+  }
+
+  // one line per file, in order
+  rewind(out);
+  char line[1024];
+  for (size_t k = 0; k < n; k++) {
+    assert(fgets(line, sizeof(line), out));
+    assert(0 == strncmp(line, files[k], strlen(files[k])));
+    free(r[k].csv);
+  }
+  assert(!fgets(line, sizeof(line), out));
+  fclose(out);
+
+  for (int k = 0; k < 3; k++)
+    unlink(names[k]);
+  for (int k = 0; k < 4; k++)
+    free(texts[k]);
+  unlink("test_batch_d.gcode");
+  unlink("test_batch.d/notes.txt");
+  unlink("test_batch_expect.csv");
+  rmdir("test_batch.d");
+  batch_files_free(files, n);
+  printf("ok\n");
+}
+#endif
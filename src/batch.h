@@ -0,0 +1,36 @@
+#pragma once
+#include "stats.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/// what --batch did with one file
+typedef struct {
+  char *csv; // where its segments went
+  bool ok;
+  size_t bytes, segments, layers;
+  stats ps;
+  double parse_s, csv_s; // parsing with the stats and layers, writing
+} batch_result;
+
+/// the files named by args: each directory is replaced by the .gcode files
+/// in it, in order. Returns how many went into *files, which the caller
+/// frees with batch_files_free().
+size_t batch_files(char **args, size_t nargs, char ***files);
+
+void batch_files_free(char **files, size_t n);
+
+/// the csv of file, prefix, its name without the directory and .gcode,
+/// and "_out.csv": CSV_PREFIX=out/ batch a/b.gcode writes out/b_out.csv
+char *batch_csv_path(const char *prefix, const char *file);
+
+/// parse files[0..n) and write their csv files, without a window, on
+/// nworkers threads or every core when 0
+/// A file's summary line goes to out, unless it is NULL, once it and those
+/// before it are done, and into results[k] unless that is NULL. Returns how
+/// many failed.
+size_t batch_run(char **files, size_t n, int nworkers, const char *prefix,
+                 FILE *out, batch_result *results);
+
+/// the header of the lines batch_run() prints
+void batch_header(FILE *out);
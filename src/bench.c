@@ -0,0 +1,557 @@
+// headless benchmarks, one JSON object per line on stdout
+//
+//   bench                      synthetic gcode, SYNTH_DEFAULTS but bigger
+//   bench layers per_layer     synthetic gcode of that size
+//   bench file.gcode           a real file
+//
+// BENCH_REPS=n runs every timing n times (default 5) and reports the
+// fastest. Nothing here opens a window.
+#ifdef BENCH
+#include "batch.h"
+#include "bvh.h"
+#include "csv.h"
+#include "diff.h"
+#include "gcode.h"
+#include "layers.h"
+#include "loader.h"
+#include "ooc.h"
+#include "packed.h"
+#include "raymath.h"
+#include "remap.h"
+#include "segments.h"
+#include "stats.h"
+#include "synth.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static int reps = 5;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// fastest of reps runs of f, in seconds
+static double best_of(void (*f)(void *ud), void *ud) {
+  double best = INFINITY;
+  for (int k = 0; k < reps; k++) {
+    double t0 = now();
+    f(ud);
+    double dt = now() - t0;
+    best = dt < best ? dt : best;
+  }
+  return best;
+}
+
+// one result: count things took seconds, so count / seconds unit
+static void result(const char *bench, double count, const char *unit,
+                   double seconds) {
+  printf("{\"bench\": \"%s\", \"seconds\": %.6g, \"count\": %.6g, "
+         "\"rate\": %.6g, \"unit\": \"%s\"}\n",
+         bench, seconds, count, count / seconds, unit);
+  fflush(stdout);
+}
+
+// xorshift for reproducible queries
+static uint32_t seed = 7;
+static float frand(float lo, float hi) {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return lo + (hi - lo) * (seed >> 8) / (float)(1 << 24);
+}
+
+typedef struct {
+  char *b, *e;
+  segments t;
+  stats st;
+  int nthreads;
+  layers ls;
+  bvh tree;
+  Ray *rays;
+  size_t nrays;
+  size_t *idx; // 0, 1, 2, ... for bvh_distances()
+  float *dist;
+  bvh_region region;
+  Vector3 (*pairs)[4];
+  size_t npairs;
+  segments ps, qs; // the pairs as rows of two tables
+  double sink; // results go here so nothing is optimized away
+} bench;
+
+static void parse(void *ud) {
+  bench *b = ud;
+  gcode_parse(&b->t, b->b, b->e, &b->st, b->nthreads);
+}
+
+static void sketch(void *ud) {
+  bench *b = ud;
+  stats_sketch s;
+  stats_sketch_init(&s);
+  stats_sketch_add(&s, b->t.x1, b->t.y1, b->t.z1, b->t.e1, b->t.n);
+  b->st = stats_of(&s);
+  stats_sketch_free(&s);
+}
+
+static void index_layers(void *ud) {
+  bench *b = ud;
+  layers_build(&b->ls, &b->t);
+}
+
+static void build_bvh(void *ud) {
+  bench *b = ud;
+  bvh_build(&b->tree, &b->t);
+}
+
+static void pick(void *ud) {
+  bench *b = ud;
+  for (size_t k = 0; k < b->nrays; k++)
+    b->sink += bvh_closest(&b->tree, &b->t, b->rays[k], 0, b->t.n, 0, NULL,
+                           NULL, NULL);
+}
+
+static void region_select(void *ud) {
+  bench *b = ud;
+  size_t *in;
+  b->sink += bvh_inside(&b->tree, &b->t, &b->region, 0, b->t.n, 0, &in);
+  free(in);
+}
+
+static void segment_distance_f1(void *ud) {
+  bench *b = ud;
+  for (size_t k = 0; k < b->npairs; k++) {
+    Vector3 *p = b->pairs[k];
+    b->sink += SegmentDistance(p[0], p[1], p[2], p[3]);
+  }
+}
+
+static void segment_distance_gauss(void *ud) {
+  bench *b = ud;
+  for (size_t k = 0; k < b->npairs; k++) {
+    Vector3 *p = b->pairs[k];
+    b->sink += SegmentDistanceGauss(p[0], p[1], p[2], p[3]);
+  }
+}
+
+static void segment_distance_batch(void *ud) {
+  bench *b = ud;
+  SegmentDistanceBatch(&b->ps, &b->qs, b->ps.n, b->dist);
+  b->sink += b->dist[0];
+}
+
+static void distance_to_ray(void *ud) {
+  bench *b = ud;
+  for (size_t k = 0; k < b->npairs; k++) {
+    Vector3 *p = b->pairs[k];
+    b->sink += DistanceToRay((Ray){p[0], p[1]}, p[2], p[3]);
+  }
+}
+
+// every segment against a few of the rays, without the tree
+#define SCAN_RAYS 10
+
+static void ray_distances(void *ud) {
+  bench *b = ud;
+  for (size_t k = 0; k < SCAN_RAYS && k < b->nrays; k++) {
+    bvh_distances(&b->t, b->rays[k], b->idx, b->t.n, b->dist);
+    b->sink += b->dist[k];
+  }
+}
+
+static void write_csv(void *ud) {
+  bench *b = ud;
+  csv_write("bench_out.csv", &b->t, 0, b->t.n, NULL, 0, 0);
+  csv_wait();
+}
+
+// what selected_refresh() does after a reload that changed a layer's worth
+// of lines in the middle of the file: reparse, refit, and remap a tenth of
+// the segments the edit replaced
+static void reload(bench *b) {
+  size_t n = b->e - b->b;
+  char *edited = malloc(n + 1);
+  memcpy(edited, b->b, n + 1);
+  // nudge the last digit of every X in a stretch, keeping the length
+  size_t lines = b->t.n / (b->ls.n ? b->ls.n : 1), changed = 0;
+  for (char *c = edited + n / 2; c < edited + n && changed < lines; c++)
+    if (*c == 'X') {
+      char *d = c + 1;
+      while (d < edited + n && (isdigit(*d) || *d == '.' || *d == '-'))
+        d++;
+      if (d > c + 1 && isdigit(d[-1])) {
+        d[-1] = d[-1] == '9' ? '8' : d[-1] + 1;
+        changed++;
+      }
+    }
+
+  double treparse = INFINITY, trefit = INFINITY, tremap = INFINITY,
+         ttotal = INFINITY;
+  size_t nrows = 0;
+  for (int k = 0; k < reps; k++) {
+    segments t, removed;
+    segments_init(&t);
+    segments_init(&removed);
+    segments_copy(&t, &b->t, 0, b->t.n);
+    bvh tree = {0};
+    bvh_build(&tree, &t);
+
+    double t0 = now();
+    gcode_splice sp =
+        gcode_reparse(&t, b->b, b->e, edited, edited + n, &removed, 0);
+    double t1 = now();
+    bvh_refit(&tree, &t, sp.from, sp.dirty);
+    double t2 = now();
+    nrows = removed.n / 10;
+    size_t *rows = malloc(nrows * sizeof(size_t) + 1),
+           *out = malloc(nrows * sizeof(size_t) + 1);
+    for (size_t r = 0; r < nrows; r++)
+      rows[r] = 10 * r;
+    remap(&removed, rows, nrows, &t, &tree, NULL, 0, out, 0);
+    double t3 = now();
+
+    treparse = fmin(treparse, t1 - t0);
+    trefit = fmin(trefit, t2 - t1);
+    tremap = fmin(tremap, t3 - t2);
+    ttotal = fmin(ttotal, t3 - t0);
+    free(rows);
+    free(out);
+    segments_free(&t);
+    segments_free(&removed);
+    bvh_free(&tree);
+  }
+  result("reload_reparse", changed, "lines/s", treparse);
+  result("reload_refit", changed, "lines/s", trefit);
+  result("reload_remap", nrows, "segments/s", tremap);
+  result("reload_total", 1, "reloads/s", ttotal);
+  free(edited);
+}
+
+// two versions of the file, the second with every tenth layer moved over a
+// little, as after changing a setting of some layers; and the file against
+// itself, which is only hashing
+typedef struct {
+  const segments *old, *t;
+  const layers *lo, *ln;
+  diff d;
+} diff_job;
+
+static void compare(void *ud) {
+  diff_job *j = ud;
+  diff_build(&j->d, j->old, j->lo, j->t, j->ln, 0);
+}
+
+static void diff_files(bench *b) {
+  segments t;
+  segments_init(&t);
+  segments_copy(&t, &b->t, 0, b->t.n);
+  for (size_t k = 0; k < b->ls.n; k += 10)
+    for (size_t i = b->ls.l[k].from; i < b->ls.l[k].to; i++)
+      t.x0[i] += 0.05f, t.x1[i] += 0.05f;
+  layers ls = {0};
+  layers_build(&ls, &t);
+  diff_job j = {&b->t, &b->t, &b->ls, &b->ls, {0}};
+  result("diff_same", 2 * b->t.n, "segments/s", best_of(compare, &j));
+  j.t = &t;
+  j.ln = &ls;
+  result("diff", 2 * b->t.n, "segments/s", best_of(compare, &j));
+  diff_free(&j.d);
+  layers_free(&ls);
+  segments_free(&t);
+}
+
+// what the viewer does while loading in the background: the first piece is
+// how soon there's something to draw, then every piece is appended and
+// refit like take_pieces() in main.c
+static void progressive_load(bench *b) {
+  double tfirst = INFINITY, ttotal = INFINITY;
+  struct stat st = {.st_size = b->e - b->b};
+  for (int k = 0; k < reps; k++) {
+    segments t;
+    segments_init(&t);
+    bvh tree = {0};
+    loader_piece p;
+    double t0 = now(), t1 = t0;
+    loader_start("bench.gcode", &st, b->b, false, false, NULL);
+    while (loader_take(&p, true)) {
+      if (!t.n)
+        t1 = now();
+      size_t from = t.n;
+      segments_splice(&t, t.n, 0, &p.t);
+      segments_free(&p.t);
+      bvh_refit(&tree, &t, from, t.n);
+    }
+    double t2 = now();
+    tfirst = fmin(tfirst, t1 - t0);
+    ttotal = fmin(ttotal, t2 - t0);
+    segments_free(&t);
+    bvh_free(&tree);
+  }
+  result("load_first_piece", 1, "pieces/s", tfirst);
+  result("load_progressive", (b->e - b->b) / 1e6, "MB/s", ttotal);
+}
+
+// the table packed, and read back a block at a time
+static void pack(bench *b) {
+  packed p;
+  packed_init(&p);
+  segments u;
+  segments_init(&u);
+  double tbuild = INFINITY, tdecode = INFINITY;
+  for (int k = 0; k < reps; k++) {
+    double t0 = now();
+    packed_build(&p, &b->t, 0, b->t.n);
+    double t1 = now();
+    for (size_t i = 0; i < p.nblocks; i++)
+      packed_block(&p, i, &u);
+    double t2 = now();
+    tbuild = fmin(tbuild, t1 - t0);
+    tdecode = fmin(tdecode, t2 - t1);
+  }
+  size_t columns = b->t.n * (10 * sizeof(float) + 2 + sizeof(size_t));
+  printf("{\"bench\": \"packed_size\", \"bytes\": %zu, \"columns\": %zu, "
+         "\"bytes_per_segment\": %.3g}\n",
+         packed_bytes(&p), columns, packed_bytes(&p) / (double)b->t.n);
+  result("packed_build", b->t.n, "segments/s", tbuild);
+  result("packed_decode", b->t.n, "segments/s", tdecode);
+  packed_free(&p);
+  segments_free(&u);
+}
+
+// out of core: packed while it loads, then a view of OOC_STEP_LAYERS
+// layers stepping up through the file like UP does, each step paging in
+// one layer and dropping one
+#define OOC_STEP_LAYERS 10
+static void out_of_core(bench *b) {
+  size_t n = b->e - b->b;
+  FILE *h = fopen("bench_ooc.gcode", "w");
+  if (!h || fwrite(b->b, 1, n, h) != n || fclose(h)) {
+    perror("bench_ooc.gcode");
+    return;
+  }
+  int fd = open("bench_ooc.gcode", O_RDONLY);
+  struct stat st;
+  fstat(fd, &st);
+  char *map = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  double tload = INFINITY, tstep = INFINITY;
+  size_t bytes = 0, steps = 0;
+  for (int k = 0; k < reps; k++) {
+    ooc o;
+    ooc_init(&o, SIZE_MAX);
+    loader_piece p;
+    double t0 = now();
+    loader_start("bench_ooc.gcode", &st, map, false, true, NULL);
+    while (loader_take(&p, true)) {
+      ooc_add(&o, p.layers, p.nlayers);
+      free(p.layers);
+    }
+    double t1 = now();
+    segments t;
+    segments_init(&t);
+    steps = 0;
+    for (size_t lo = 0; lo + OOC_STEP_LAYERS <= o.n; lo++, steps++)
+      ooc_page(&o, lo, lo + OOC_STEP_LAYERS, &t);
+    double t2 = now();
+    tload = fmin(tload, t1 - t0);
+    tstep = fmin(tstep, t2 - t1);
+    bytes = 0;
+    for (size_t j = 0; j < o.n; j++)
+      bytes += packed_bytes(&o.l[j].p);
+    segments_free(&t);
+    ooc_free(&o);
+  }
+  munmap(map, n);
+  unlink("bench_ooc.gcode");
+  printf("{\"bench\": \"ooc_size\", \"packed_bytes\": %zu, "
+         "\"bytes_per_segment\": %.3g}\n",
+         bytes, bytes / (b->t.n + 1.0));
+  result("ooc_load", n / 1e6, "MB/s", tload);
+  result("ooc_page_step", steps, "steps/s", tstep);
+}
+
+// --batch over copies of the input, a worker per core
+#define BATCH_FILES 8
+static void batch(void *ud) {
+  bench *b = ud;
+  char *files[BATCH_FILES];
+  for (int k = 0; k < BATCH_FILES; k++) {
+    files[k] = malloc(32);
+    snprintf(files[k], 32, "bench_batch_%d.gcode", k);
+  }
+  batch_run(files, BATCH_FILES, 0, "", NULL, NULL);
+  for (int k = 0; k < BATCH_FILES; k++)
+    free(files[k]);
+  b->sink += 1;
+}
+
+int main(int argc, char **argv) {
+  char *r = getenv("BENCH_REPS");
+  if (r && atoi(r) > 0)
+    reps = atoi(r);
+
+  bench b = {0};
+  segments_init(&b.t);
+  size_t n;
+  if (argc == 2) {
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+      perror(argv[1]);
+      return 1;
+    }
+    n = st.st_size;
+    b.b = malloc(n + 1);
+    if (!b.b || pread(fd, b.b, n, 0) != (ssize_t)n) {
+      perror(argv[1]);
+      return 1;
+    }
+    b.b[n] = '\0';
+    close(fd);
+  } else {
+    synth_opts o = SYNTH_DEFAULTS;
+    o.layers = argc > 2 ? atoi(argv[1]) : 200;
+    o.per_layer = argc > 2 ? strtoul(argv[2], NULL, 10) : 5000;
+    b.b = synth_gcode(&o, &n);
+  }
+  b.e = b.b + n;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  gcode_parse(&b.t, b.b, b.e, &b.st, 0);
+  layers_build(&b.ls, &b.t);
+  printf("{\"bench\": \"input\", \"bytes\": %zu, \"segments\": %zu, "
+         "\"layers\": %zu, \"cores\": %ld, \"reps\": %d}\n",
+         n, b.t.n, b.ls.n, cores, reps);
+
+  b.nthreads = 1;
+  result("parse_1_thread", n / 1e6, "MB/s", best_of(parse, &b));
+  b.nthreads = 0;
+  result("parse_all_threads", n / 1e6, "MB/s", best_of(parse, &b));
+  result("stats", b.t.n, "points/s", best_of(sketch, &b));
+  result("layers_build", b.t.n, "segments/s", best_of(index_layers, &b));
+  result("bvh_build", b.t.n, "segments/s", best_of(build_bvh, &b));
+  progressive_load(&b);
+  pack(&b);
+  out_of_core(&b);
+
+  // rays through random points of the toolpath from random directions,
+  // like clicking on it
+  b.nrays = 1000;
+  b.rays = malloc(b.nrays * sizeof(Ray));
+  for (size_t k = 0; k < b.nrays && b.t.n; k++) {
+    size_t i = (size_t)frand(0, b.t.n - 1);
+    Vector3 at = {b.t.x1[i], b.t.y1[i], b.t.z1[i]},
+            dir = Vector3Normalize(
+                (Vector3){frand(-1, 1), frand(-1, 1), frand(-1, 1)});
+    b.rays[k] = (Ray){Vector3Subtract(at, Vector3Scale(dir, 200)), dir};
+  }
+  result("pick", b.nrays, "picks/s", best_of(pick, &b));
+
+  // looking down on the print, a rectangle around the left half of it,
+  // and a diamond in that
+  Vector4 lo = b.st.min, hi = b.st.max;
+  Vector3 c = {(lo.x + hi.x) / 2, (lo.y + hi.y) / 2, hi.z + 10};
+  float half = fmaxf(hi.x - lo.x, hi.y - lo.y) / 2 + 1;
+  Matrix view = MatrixLookAt(c, Vector3Subtract(c, (Vector3){0, 0, 1}),
+                             (Vector3){0, 1, 0});
+  b.region.mvp = MatrixMultiply(
+      view, MatrixOrtho(-half, half, -half, half, 0.1, hi.z - lo.z + 20));
+  b.region.lo = (Vector2){-1, -1};
+  b.region.hi = (Vector2){0, 1};
+  result("region_select", b.t.n, "segments/s", best_of(region_select, &b));
+  Vector2 diamond[] = {{-1, 0}, {-0.5, -1}, {0, 0}, {-0.5, 1}};
+  b.region.poly = diamond;
+  b.region.npoly = 4;
+  result("lasso_select", b.t.n, "segments/s", best_of(region_select, &b));
+
+  b.idx = malloc(b.t.n * sizeof(size_t) + 1);
+  b.dist = malloc(b.t.n * sizeof(float) + 1);
+  for (size_t i = 0; i < b.t.n; i++)
+    b.idx[i] = i;
+  result("ray_distances", SCAN_RAYS * b.t.n, "segments/s",
+         best_of(ray_distances, &b));
+
+  reload(&b);
+  diff_files(&b);
+
+  double t = best_of(write_csv, &b);
+  struct stat st;
+  if (0 == stat("bench_out.csv", &st))
+    result("csv_write", st.st_size / 1e6, "MB/s", t);
+  unlink("bench_out.csv");
+
+  char name[64];
+  for (int k = 0; k < BATCH_FILES; k++) {
+    snprintf(name, sizeof(name), "bench_batch_%d.gcode", k);
+    FILE *h = fopen(name, "w");
+    if (h) {
+      fwrite(b.b, 1, n, h);
+      fclose(h);
+    }
+  }
+  result("batch", BATCH_FILES * n / 1e6, "MB/s", best_of(batch, &b));
+  for (int k = 0; k < BATCH_FILES; k++) {
+    snprintf(name, sizeof(name), "bench_batch_%d.gcode", k);
+    unlink(name);
+    snprintf(name, sizeof(name), "bench_batch_%d_out.csv", k);
+    unlink(name);
+  }
+
+  b.npairs = 1000000;
+  b.pairs = malloc(b.npairs * sizeof(b.pairs[0]));
+  for (size_t k = 0; k < b.npairs; k++)
+    for (int e = 0; e < 4; e++)
+      b.pairs[k][e] = (Vector3){frand(-10, 10), frand(-10, 10), frand(-1, 1)};
+  // f1, and the Gauss rule it can be swapped for, one pair at a time and
+  // then straight from segment tables
+  segment_distance = SEGMENT_DISTANCE_F1;
+  result("segment_distance", b.npairs, "calls/s",
+         best_of(segment_distance_f1, &b));
+  result("segment_distance_gauss", b.npairs, "calls/s",
+         best_of(segment_distance_gauss, &b));
+  segments_init(&b.ps);
+  segments_init(&b.qs);
+  double worst = 0;
+  for (size_t k = 0; k < b.npairs; k++) {
+    Vector3 *p = b.pairs[k];
+    segments_push(&b.ps, (Vector4){p[0].x, p[0].y, p[0].z, 0},
+                  (Vector4){p[1].x, p[1].y, p[1].z, 0}, 1, 0, 0);
+    segments_push(&b.qs, (Vector4){p[2].x, p[2].y, p[2].z, 0},
+                  (Vector4){p[3].x, p[3].y, p[3].z, 0}, 1, 0, 0);
+    worst = fmax(worst, fabs(SegmentDistanceGauss(p[0], p[1], p[2], p[3]) -
+                             SegmentDistanceF1(p[0], p[1], p[2], p[3])));
+  }
+  free(b.dist);
+  b.dist = malloc(b.npairs * sizeof(float));
+  result("segment_distance_batch", b.npairs, "calls/s",
+         best_of(segment_distance_batch, &b));
+  double error;
+  segment_distance_kind fastest = segment_distance_fastest(1e-3, &error);
+  printf("{\"bench\": \"segment_distance_gauss_error\", \"max_error\": "
+         "%.3g, \"fastest\": \"%s\"}\n",
+         worst, fastest == SEGMENT_DISTANCE_GAUSS ? "gauss" : "f1");
+  result("distance_to_ray", b.npairs, "calls/s", best_of(distance_to_ray, &b));
+
+  if (b.sink == 42) // never, but the compiler doesn't know
+    printf("\n");
+  segments_free(&b.t);
+  segments_free(&b.ps);
+  segments_free(&b.qs);
+  layers_free(&b.ls);
+  bvh_free(&b.tree);
+  free(b.rays);
+  free(b.idx);
+  free(b.dist);
+  free(b.pairs);
+  free(b.b);
+}
+#endif
@@ -0,0 +1,760 @@
+#include "bvh.h"
+#include "arc.h"
+#include "raymath.h"
+#include "segdistance.h"
+#include "simd.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void bvh_free(bvh *b) {
+  free(b->off);
+  free(b->box);
+  free(b->mask);
+  memset(b, 0, sizeof(*b));
+}
+
+// size the levels for n segments
+static void layout(bvh *b, size_t n) {
+  b->n = n;
+  b->levels = 0;
+  size_t leaves = (n + BVH_LEAF - 1) / BVH_LEAF, total = 0;
+  for (size_t k = leaves; k; k = k > 1 ? (k + 1) / 2 : 0) {
+    b->levels++;
+    total += k;
+  }
+  b->off = realloc(b->off, (b->levels + 1) * sizeof(size_t));
+  b->box = realloc(b->box, total * sizeof(BoundingBox));
+  b->mask = realloc(b->mask, total * sizeof(uint8_t));
+  if (b->levels && (!b->off || !b->box || !b->mask)) {
+    fprintf(stderr, "out of memory for the bvh of %zu segments\n", n);
+    exit(-1);
+  }
+  b->off[0] = 0;
+  size_t k = leaves;
+  for (int l = 1; l <= b->levels; l++) {
+    b->off[l] = b->off[l - 1] + k;
+    k = (k + 1) / 2;
+  }
+}
+
+void bvh_build(bvh *b, const segments *t) {
+  bvh_free(b);
+  layout(b, t->n);
+  bvh_refit(b, t, 0, t->n);
+}
+
+void bvh_refit(bvh *b, const segments *t, size_t from, size_t to) {
+  // leaves keep their place, but the levels above them move when the
+  // number of leaves changes
+  bool moved = false;
+  if (t->n != b->n) {
+    size_t leaves = (b->n + BVH_LEAF - 1) / BVH_LEAF;
+    layout(b, t->n);
+    moved = leaves != (t->n + BVH_LEAF - 1) / BVH_LEAF;
+    to = t->n;
+  }
+  if (!b->levels || from >= to)
+    return;
+
+  size_t lo = from / BVH_LEAF, hi = (to + BVH_LEAF - 1) / BVH_LEAF;
+  for (size_t i = lo; i < hi; i++) {
+    BoundingBox bb = {{INFINITY, INFINITY, INFINITY},
+                      {-INFINITY, -INFINITY, -INFINITY}};
+    uint8_t m = 0;
+    size_t end = (i + 1) * BVH_LEAF < t->n ? (i + 1) * BVH_LEAF : t->n;
+    for (size_t j = i * BVH_LEAF; j < end; j++) {
+      bb.min = Vector3Min(bb.min, (Vector3){t->x0[j], t->y0[j], t->z0[j]});
+      bb.min = Vector3Min(bb.min, (Vector3){t->x1[j], t->y1[j], t->z1[j]});
+      bb.max = Vector3Max(bb.max, (Vector3){t->x0[j], t->y0[j], t->z0[j]});
+      bb.max = Vector3Max(bb.max, (Vector3){t->x1[j], t->y1[j], t->z1[j]});
+      m |= segments_extrudes(t, j) ? BVH_EXTRUDE : BVH_TRAVEL;
+      if (segments_arc(t, j)) {
+        BoundingBox a = arc_box(t, j);
+        bb.min = Vector3Min(bb.min, a.min);
+        bb.max = Vector3Max(bb.max, a.max);
+      }
+    }
+    b->box[i] = bb;
+    b->mask[i] = m;
+  }
+
+  for (int l = 1; l < b->levels; l++) {
+    size_t below = b->off[l - 1], nbelow = b->off[l] - below, k = b->off[l];
+    lo = moved ? 0 : lo / 2;
+    hi = (hi + 1) / 2;
+    for (size_t i = lo; i < hi; i++) {
+      size_t c = below + 2 * i;
+      BoundingBox bb = b->box[c];
+      uint8_t m = b->mask[c];
+      if (2 * i + 1 < nbelow) {
+        bb.min = Vector3Min(bb.min, b->box[c + 1].min);
+        bb.max = Vector3Max(bb.max, b->box[c + 1].max);
+        m |= b->mask[c + 1];
+      }
+      b->box[k + i] = bb;
+      b->mask[k + i] = m;
+    }
+  }
+}
+
+/// distance between a ray and a line segment
+double DistanceToRay(Ray q, Vector3 f, Vector3 t) {
+  Quaternion mkq =
+      QuaternionFromVector3ToVector3(q.direction, (Vector3){1, 0, 0});
+  Vector3 ft = Vector3Subtract(f, t), qt = Vector3Subtract(q.position, t);
+  ft = Vector3RotateByQuaternion(ft, mkq);
+  qt = Vector3RotateByQuaternion(qt, mkq);
+  return f2(qt.x, qt.y, qt.z, ft.x, ft.y, ft.z);
+}
+
+// the ray's frame: where x, y and z go when the ray's direction is turned
+// to +x, and where the ray starts then
+typedef struct {
+  Vector3 x, y, z, p;
+} ray_frame;
+
+static ray_frame frame_of(Ray r) {
+  Quaternion q = QuaternionFromVector3ToVector3(Vector3Normalize(r.direction),
+                                                (Vector3){1, 0, 0});
+  ray_frame f = {Vector3RotateByQuaternion((Vector3){1, 0, 0}, q),
+                 Vector3RotateByQuaternion((Vector3){0, 1, 0}, q),
+                 Vector3RotateByQuaternion((Vector3){0, 0, 1}, q)};
+  f.p = Vector3RotateByQuaternion(r.position, q);
+  return f;
+}
+
+// f2() for BVH_LEAF segments at once, given by the columns of their ends,
+// into out. A leaf is a batch, so this is the whole inner loop of a pick.
+static VECTORIZED void ray_lanes(const ray_frame *f, const float *x0,
+                                 const float *y0, const float *z0,
+                                 const float *x1, const float *y1,
+                                 const float *z1, float *out) {
+  float a[BVH_LEAF], b[BVH_LEAF], c[BVH_LEAF], d[BVH_LEAF], e[BVH_LEAF],
+      g[BVH_LEAF];
+  for (int k = 0; k < BVH_LEAF; k++) {
+    // the ray's start and the segment's, relative to the segment's end
+    float tx = f->x.x * x1[k] + f->y.x * y1[k] + f->z.x * z1[k],
+          ty = f->x.y * x1[k] + f->y.y * y1[k] + f->z.y * z1[k],
+          tz = f->x.z * x1[k] + f->y.z * y1[k] + f->z.z * z1[k];
+    float dx = x0[k] - x1[k], dy = y0[k] - y1[k], dz = z0[k] - z1[k];
+    a[k] = f->p.x - tx;
+    b[k] = f->p.y - ty;
+    c[k] = f->p.z - tz;
+    d[k] = f->x.x * dx + f->y.x * dy + f->z.x * dz;
+    e[k] = f->x.y * dx + f->y.y * dy + f->z.y * dz;
+    g[k] = f->x.z * dx + f->y.z * dy + f->z.z * dz;
+  }
+  f2_batch(BVH_LEAF, a, b, c, d, e, g, out);
+}
+
+// the columns of up to BVH_LEAF segments, padded with the first
+typedef struct {
+  float x0[BVH_LEAF], y0[BVH_LEAF], z0[BVH_LEAF];
+  float x1[BVH_LEAF], y1[BVH_LEAF], z1[BVH_LEAF];
+} lanes;
+
+static void lanes_pad(lanes *l, size_t n) {
+  for (size_t k = n; k < BVH_LEAF; k++) {
+    l->x0[k] = l->x0[0], l->y0[k] = l->y0[0], l->z0[k] = l->z0[0];
+    l->x1[k] = l->x1[0], l->y1[k] = l->y1[0], l->z1[k] = l->z1[0];
+  }
+}
+
+static void lanes_run(const ray_frame *f, const lanes *l, float *out) {
+  ray_lanes(f, l->x0, l->y0, l->z0, l->x1, l->y1, l->z1, out);
+}
+
+// arcs are picked by the lines of a fine enough tessellation
+#define ARC_TOL 0.01f
+#define ARC_POINTS 64
+
+static float arc_to(const ray_frame *f, const segments *t, size_t j) {
+  Vector3 p[ARC_POINTS];
+  size_t n = arc_points(t, j, ARC_TOL, p, ARC_POINTS);
+  float best = INFINITY, d[BVH_LEAF];
+  for (size_t k = 0; k + 1 < n; k += BVH_LEAF) {
+    lanes l;
+    size_t m = n - 1 - k < BVH_LEAF ? n - 1 - k : BVH_LEAF;
+    for (size_t i = 0; i < m; i++) {
+      l.x0[i] = p[k + i].x, l.y0[i] = p[k + i].y, l.z0[i] = p[k + i].z;
+      l.x1[i] = p[k + i + 1].x, l.y1[i] = p[k + i + 1].y,
+      l.z1[i] = p[k + i + 1].z;
+    }
+    lanes_pad(&l, m);
+    lanes_run(f, &l, d);
+    for (size_t i = 0; i < m; i++)
+      best = d[i] < best ? d[i] : best;
+  }
+  return best;
+}
+
+// distances to segments [from, to) of t, at most BVH_LEAF of them
+static void leaf_distances(const ray_frame *f, const segments *t, size_t from,
+                           size_t to, float *out) {
+  if (to - from == BVH_LEAF) {
+    ray_lanes(f, t->x0 + from, t->y0 + from, t->z0 + from, t->x1 + from,
+              t->y1 + from, t->z1 + from, out);
+  } else {
+    lanes l;
+    for (size_t i = 0; i < to - from; i++) {
+      l.x0[i] = t->x0[from + i], l.y0[i] = t->y0[from + i],
+      l.z0[i] = t->z0[from + i];
+      l.x1[i] = t->x1[from + i], l.y1[i] = t->y1[from + i],
+      l.z1[i] = t->z1[from + i];
+    }
+    lanes_pad(&l, to - from);
+    lanes_run(f, &l, out);
+  }
+  for (size_t j = from; j < to; j++)
+    if (segments_arc(t, j))
+      out[j - from] = arc_to(f, t, j);
+}
+
+void bvh_distances(const segments *t, Ray r, const size_t *idx, size_t n,
+                   float *out) {
+  ray_frame f = frame_of(r);
+  for (size_t k = 0; k < n; k += BVH_LEAF) {
+    lanes l;
+    size_t m = n - k < BVH_LEAF ? n - k : BVH_LEAF;
+    for (size_t i = 0; i < m; i++) {
+      size_t j = idx[k + i];
+      l.x0[i] = t->x0[j], l.y0[i] = t->y0[j], l.z0[i] = t->z0[j];
+      l.x1[i] = t->x1[j], l.y1[i] = t->y1[j], l.z1[i] = t->z1[j];
+    }
+    float d[BVH_LEAF];
+    lanes_pad(&l, m);
+    lanes_run(&f, &l, d);
+    for (size_t i = 0; i < m; i++)
+      out[k + i] = segments_arc(t, idx[k + i]) ? arc_to(&f, t, idx[k + i])
+                                               : d[i];
+  }
+}
+
+typedef struct {
+  const bvh *b;
+  const segments *t;
+  Ray r;
+  Vector3 dir; // r.direction normalized
+  ray_frame f;
+  size_t from, to;
+  uint8_t skip;
+  bool (*keep)(size_t i, void *ud);
+  void *ud;
+  float best;
+  long ibest;
+} pick;
+
+// f2() is a squared distance to a point of the segment from the ray's line,
+// so it is at least the squared distance from that line to the node's
+// bounding sphere
+static float bound(const pick *p, BoundingBox bb) {
+  Vector3 c = Vector3Scale(Vector3Add(bb.min, bb.max), 0.5f);
+  float radius = 0.5f * Vector3Distance(bb.min, bb.max);
+  Vector3 oc = Vector3Subtract(c, p->r.position);
+  float d = Vector3Length(Vector3CrossProduct(oc, p->dir)) - radius;
+  return d > 0 ? d * d : 0;
+}
+
+static void visit(pick *p, int level, size_t i) {
+  const bvh *b = p->b;
+  if (level == 0) {
+    size_t end = (i + 1) * BVH_LEAF < p->to ? (i + 1) * BVH_LEAF : p->to;
+    size_t lo = i * BVH_LEAF > p->from ? i * BVH_LEAF : p->from;
+    float d[BVH_LEAF];
+    leaf_distances(&p->f, p->t, lo, end, d);
+    for (size_t j = lo; j < end; j++) {
+      uint8_t m = segments_extrudes(p->t, j) ? BVH_EXTRUDE : BVH_TRAVEL;
+      if (m & p->skip || (p->keep && !p->keep(j, p->ud)))
+        d[j - lo] = INFINITY;
+    }
+    // the leaf's least distance, then the first segment at it
+    float least = INFINITY;
+    for (size_t k = 0; k < end - lo; k++)
+      least = d[k] < least ? d[k] : least;
+    if (least > p->best || least == INFINITY)
+      return;
+    size_t k = 0;
+    while (d[k] != least)
+      k++;
+    if (least < p->best || (long)(lo + k) < p->ibest) {
+      p->best = least;
+      p->ibest = lo + k;
+    }
+    return;
+  }
+
+  // visit the nearer child first so the farther one is more often pruned
+  size_t below = b->off[level - 1], nbelow = b->off[level] - below;
+  size_t c[2] = {2 * i, 2 * i + 1};
+  float d[2] = {INFINITY, INFINITY};
+  for (int k = 0; k < 2; k++) {
+    // nodes cover runs of segments, so whole runs outside from..to go
+    size_t first = (c[k] << (level - 1)) * BVH_LEAF,
+           last = ((c[k] + 1) << (level - 1)) * BVH_LEAF;
+    if (c[k] < nbelow && b->mask[below + c[k]] & ~p->skip &&
+        first < p->to && last > p->from)
+      d[k] = bound(p, b->box[below + c[k]]);
+  }
+  int first = d[1] < d[0];
+  for (int k = 0; k < 2; k++) {
+    int kk = k ^ first;
+    if (d[kk] <= p->best)
+      visit(p, level - 1, c[kk]);
+  }
+}
+
+long bvh_closest(const bvh *b, const segments *t, Ray r, size_t from,
+                 size_t to, uint8_t skip, bool (*keep)(size_t i, void *ud),
+                 void *ud, float *distance) {
+  pick p = {.b = b,
+            .t = t,
+            .r = r,
+            .dir = Vector3Normalize(r.direction),
+            .f = frame_of(r),
+            .from = from,
+            .to = to < b->n ? to : b->n,
+            .skip = skip,
+            .keep = keep,
+            .ud = ud,
+            .best = INFINITY,
+            .ibest = -1};
+  if (b->levels && p.from < p.to) {
+    int top = b->levels - 1;
+    if (b->mask[b->off[top]] & ~skip)
+      visit(&p, top, 0);
+  }
+  if (distance)
+    *distance = p.best;
+  return p.ibest;
+}
+
+typedef struct {
+  const bvh *b;
+  Vector3 p;
+  double (*dist)(size_t i, void *ud);
+  void *ud;
+  double best;
+  long ibest;
+} near;
+
+static float box_distance(Vector3 p, BoundingBox bb) {
+  Vector3 c = Vector3Clamp(p, bb.min, bb.max);
+  return Vector3Distance(p, c);
+}
+
+static void visit_near(near *q, int level, size_t i) {
+  const bvh *b = q->b;
+  if (level == 0) {
+    size_t end = (i + 1) * BVH_LEAF < b->n ? (i + 1) * BVH_LEAF : b->n;
+    for (size_t j = i * BVH_LEAF; j < end; j++) {
+      double d = q->dist(j, q->ud);
+      if (d < q->best || (d == q->best && (long)j < q->ibest)) {
+        q->best = d;
+        q->ibest = j;
+      }
+    }
+    return;
+  }
+
+  size_t below = b->off[level - 1], nbelow = b->off[level] - below;
+  size_t c[2] = {2 * i, 2 * i + 1};
+  float d[2] = {INFINITY, INFINITY};
+  for (int k = 0; k < 2; k++)
+    if (c[k] < nbelow)
+      d[k] = box_distance(q->p, b->box[below + c[k]]);
+  int first = d[1] < d[0];
+  for (int k = 0; k < 2; k++) {
+    int kk = k ^ first;
+    if (d[kk] < q->best)
+      visit_near(q, level - 1, c[kk]);
+  }
+}
+
+long bvh_nearest(const bvh *b, Vector3 p, double (*dist)(size_t i, void *ud),
+                 void *ud, double *distance) {
+  near q = {.b = b,
+            .p = p,
+            .dist = dist,
+            .ud = ud,
+            .best = INFINITY,
+            .ibest = -1};
+  if (b->levels)
+    visit_near(&q, b->levels - 1, 0);
+  if (distance)
+    *distance = q.best;
+  return q.ibest;
+}
+
+typedef struct {
+  const bvh *b;
+  const segments *t;
+  const bvh_region *r;
+  // in world coordinates, inside where dot(xyz, p) + w >= 0
+  Vector4 planes[6];
+  size_t from, to;
+  uint8_t skip;
+  size_t *out, n, cap;
+} region_query;
+
+static float plane_at(Vector4 p, Vector3 v) {
+  return p.x * v.x + p.y * v.y + p.z * v.z + p.w;
+}
+
+// -1 when bb is outside a plane, 1 when inside all of them, else 0
+static int box_side(const region_query *q, BoundingBox bb) {
+  int side = 1;
+  for (int k = 0; k < 6; k++) {
+    Vector4 p = q->planes[k];
+    // the corners farthest in and farthest out
+    Vector3 in = {p.x > 0 ? bb.max.x : bb.min.x, p.y > 0 ? bb.max.y : bb.min.y,
+                  p.z > 0 ? bb.max.z : bb.min.z},
+            out = {p.x > 0 ? bb.min.x : bb.max.x,
+                   p.y > 0 ? bb.min.y : bb.max.y,
+                   p.z > 0 ? bb.min.z : bb.max.z};
+    if (plane_at(p, in) < 0)
+      return -1;
+    if (plane_at(p, out) < 0)
+      side = 0;
+  }
+  return side;
+}
+
+static Vector2 project(Matrix m, Vector3 p) {
+  float x = m.m0 * p.x + m.m4 * p.y + m.m8 * p.z + m.m12,
+        y = m.m1 * p.x + m.m5 * p.y + m.m9 * p.z + m.m13,
+        w = m.m3 * p.x + m.m7 * p.y + m.m11 * p.z + m.m15;
+  return (Vector2){x / w, y / w};
+}
+
+static float cross2(Vector2 o, Vector2 a, Vector2 b) {
+  return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+}
+
+// whether a..c crosses the polygon: starts inside it, even-odd, or crosses
+// one of its edges
+static bool polygon_crosses(const Vector2 *poly, size_t n, Vector2 a,
+                            Vector2 c) {
+  bool inside = false;
+  for (size_t k = 0, l = n - 1; k < n; l = k++) {
+    Vector2 p = poly[l], q = poly[k];
+    if ((p.y > a.y) != (q.y > a.y) &&
+        a.x < p.x + (a.y - p.y) * (q.x - p.x) / (q.y - p.y))
+      inside = !inside;
+    float d1 = cross2(p, q, a), d2 = cross2(p, q, c), d3 = cross2(a, c, p),
+          d4 = cross2(a, c, q);
+    if (((d1 < 0) != (d2 < 0)) && ((d3 < 0) != (d4 < 0)))
+      return true;
+  }
+  return inside;
+}
+
+// whether the straight move from a to c is partly in the region: clipped to
+// the frustum, then what's left against the polygon
+static bool chord_inside(const region_query *q, Vector3 a, Vector3 c) {
+  float t0 = 0, t1 = 1;
+  for (int k = 0; k < 6; k++) {
+    float da = plane_at(q->planes[k], a), dc = plane_at(q->planes[k], c);
+    if (da < 0 && dc < 0)
+      return false;
+    if (da < 0)
+      t0 = fmaxf(t0, da / (da - dc));
+    else if (dc < 0)
+      t1 = fminf(t1, da / (da - dc));
+  }
+  if (t0 > t1)
+    return false;
+  if (!q->r->poly)
+    return true;
+  return polygon_crosses(q->r->poly, q->r->npoly,
+                         project(q->r->mvp, Vector3Lerp(a, c, t0)),
+                         project(q->r->mvp, Vector3Lerp(a, c, t1)));
+}
+
+static bool segment_inside(const region_query *q, size_t j) {
+  const segments *t = q->t;
+  Vector3 p[32];
+  size_t np = 2;
+  if (segments_arc(t, j)) {
+    np = arc_points(t, j, 1e-2f, p, 32);
+  } else {
+    p[0] = (Vector3){t->x0[j], t->y0[j], t->z0[j]};
+    p[1] = (Vector3){t->x1[j], t->y1[j], t->z1[j]};
+  }
+  for (size_t e = 0; e + 1 < np; e++)
+    if (chord_inside(q, p[e], p[e + 1]))
+      return true;
+  return false;
+}
+
+static void take(region_query *q, size_t j) {
+  if (q->n == q->cap) {
+    q->cap = q->cap ? 2 * q->cap : 1024;
+    q->out = realloc(q->out, q->cap * sizeof(size_t));
+    if (!q->out) {
+      fprintf(stderr, "out of memory for %zu segments\n", q->cap);
+      exit(-1);
+    }
+  }
+  q->out[q->n++] = j;
+}
+
+static void visit_region(region_query *q, int level, size_t i) {
+  const bvh *b = q->b;
+  size_t first = (i << level) * BVH_LEAF, last = ((i + 1) << level) * BVH_LEAF;
+  first = first > q->from ? first : q->from;
+  last = last < q->to ? last : q->to;
+  size_t node = b->off[level] + i;
+  if (first >= last || !(b->mask[node] & ~q->skip))
+    return;
+  int side = box_side(q, b->box[node]);
+  if (side < 0)
+    return;
+  bool whole = side > 0 && !q->r->poly;
+  if (level == 0 || whole) {
+    for (size_t j = first; j < last; j++) {
+      uint8_t m = segments_extrudes(q->t, j) ? BVH_EXTRUDE : BVH_TRAVEL;
+      if (!(m & q->skip) && (whole || segment_inside(q, j)))
+        take(q, j);
+    }
+    return;
+  }
+  // children in order, so the segments come out in order
+  size_t nbelow = b->off[level] - b->off[level - 1];
+  for (size_t c = 2 * i; c < 2 * i + 2 && c < nbelow; c++)
+    visit_region(q, level - 1, c);
+}
+
+size_t bvh_inside(const bvh *b, const segments *t, const bvh_region *r,
+                  size_t from, size_t to, uint8_t skip, size_t **out) {
+  region_query q = {.b = b,
+                    .t = t,
+                    .r = r,
+                    .from = from,
+                    .to = to < b->n ? to : b->n,
+                    .skip = skip};
+  // rows of clip space, where the rectangle is lo.x w <= x <= hi.x w and
+  // likewise for y, and -w <= z <= w is between the near and far planes
+  Matrix m = r->mvp;
+  Vector4 x = {m.m0, m.m4, m.m8, m.m12}, y = {m.m1, m.m5, m.m9, m.m13},
+          z = {m.m2, m.m6, m.m10, m.m14}, w = {m.m3, m.m7, m.m11, m.m15};
+  q.planes[0] = Vector4Subtract(x, Vector4Scale(w, r->lo.x));
+  q.planes[1] = Vector4Subtract(Vector4Scale(w, r->hi.x), x);
+  q.planes[2] = Vector4Subtract(y, Vector4Scale(w, r->lo.y));
+  q.planes[3] = Vector4Subtract(Vector4Scale(w, r->hi.y), y);
+  q.planes[4] = Vector4Add(w, z);
+  q.planes[5] = Vector4Subtract(w, z);
+  if (b->levels && q.from < q.to && (!r->poly || r->npoly >= 3))
+    visit_region(&q, b->levels - 1, 0);
+  *out = q.out;
+  return q.n;
+}
+
+#ifdef TESTING
+#include <assert.h>
+
+static float frand(float lo, float hi) {
+  return lo + (hi - lo) * (float)rand() / RAND_MAX;
+}
+
+static bool odd(size_t i, void *ud) { return i % 2; }
+
+// distance from the point ud to the middle of segment i, for odd i
+static double to_middle(size_t i, void *ud) {
+  const segments *t = ((void **)ud)[0];
+  const Vector3 *p = ((void **)ud)[1];
+  Vector3 m = {(t->x0[i] + t->x1[i]) / 2, (t->y0[i] + t->y1[i]) / 2,
+               (t->z0[i] + t->z1[i]) / 2};
+  return i % 2 ? Vector3Distance(*p, m) : INFINITY;
+}
+
+int main() {
+  segments t;
+  segments_init(&t);
+  srand(5);
+  // a random walk that extrudes most of the time, with the odd long travel
+  // and arcs that bulge out of the box around their ends
+  Vector4 p = {0, 0, 0, 0};
+  for (int i = 0; i < 20000; i++) {
+    Vector4 q = p;
+    float step = rand() % 50 ? 1 : 40;
+    q.x += frand(-step, step);
+    q.y += frand(-step, step);
+    q.z += rand() % 100 ? 0 : 0.2f;
+    q.w += rand() % 5 ? 0.1f : 0;
+    bool arc = rand() % 10 == 0;
+    segments_push(&t, p, q, arc ? 2 + rand() % 2 : 1, 0, 0);
+    if (arc) {
+      t.ai[t.n - 1] = frand(-5, 5);
+      t.aj[t.n - 1] = frand(-5, 5);
+    }
+    p = q;
+  }
+
+  bvh b = {0};
+  bvh_build(&b, &t);
+  assert(b.off[0] == 0 && b.off[1] == (t.n + BVH_LEAF - 1) / BVH_LEAF);
+  assert(b.off[b.levels] - b.off[b.levels - 1] == 1);
+
+  // same minimum as scanning everything
+  size_t *idx = malloc(t.n * sizeof(size_t));
+  float *dist = malloc(t.n * sizeof(float));
+  for (int k = 0; k < 300; k++) {
+    Ray r = {{frand(-100, 100), frand(-100, 100), frand(-100, 100)},
+             Vector3Normalize(
+                 (Vector3){frand(-1, 1), frand(-1, 1), frand(-1, 1)})};
+    uint8_t skip = k % 3 == 0 ? BVH_TRAVEL : k % 3 == 1 ? BVH_EXTRUDE : 0;
+    bool (*keep)(size_t, void *) = k % 4 == 0 ? odd : NULL;
+    // sometimes only a stretch of segments, like a few layers
+    size_t from = k % 5 ? 0 : rand() % t.n,
+           to = k % 5 ? t.n : from + rand() % 3000;
+    size_t n = 0;
+    for (size_t j = from; j < to && j < t.n; j++) {
+      uint8_t m = segments_extrudes(&t, j) ? BVH_EXTRUDE : BVH_TRAVEL;
+      if (!(m & skip || (keep && !keep(j, NULL))))
+        idx[n++] = j;
+    }
+    bvh_distances(&t, r, idx, n, dist);
+    float best = INFINITY;
+    long ibest = -1;
+    for (size_t k = 0; k < n; k++)
+      if (dist[k] < best) {
+        best = dist[k];
+        ibest = idx[k];
+      }
+    float d;
+    long i = bvh_closest(&b, &t, r, from, to, skip, keep, NULL, &d);
+    assert(i == ibest && d == best);
+
+    // in float, but within a thousandth of the double kernel's distance,
+    // which doesn't do arcs
+    for (size_t k = 0; k < n; k++)
+      if (!segments_arc(&t, idx[k])) {
+        size_t j = idx[k];
+        double e = DistanceToRay(r, (Vector3){t.x0[j], t.y0[j], t.z0[j]},
+                                 (Vector3){t.x1[j], t.y1[j], t.z1[j]});
+        assert(fabs(sqrt(dist[k]) - sqrt(e)) <= 1e-3 * (1 + sqrt(e)));
+      }
+  }
+  free(idx);
+  free(dist);
+
+  // nearest middle point, the same as scanning everything
+  for (int k = 0; k < 300; k++) {
+    Vector3 p = {frand(-100, 100), frand(-100, 100), frand(-1, 3)};
+    void *ud[2] = {&t, &p};
+    double best = INFINITY, d;
+    long ibest = -1;
+    for (size_t j = 0; j < t.n; j++)
+      if (to_middle(j, ud) < best) {
+        best = to_middle(j, ud);
+        ibest = j;
+      }
+    assert(bvh_nearest(&b, p, to_middle, ud, &d) == ibest && d == best);
+  }
+
+  // looking down on it, a region takes the segments with a point in it, and
+  // none that are away from it
+  Matrix mvp = MatrixMultiply(
+      MatrixLookAt((Vector3){0, 0, 60}, (Vector3){0}, (Vector3){0, 1, 0}),
+      MatrixOrtho(-150, 150, -150, 150, 0.01, 1000));
+  bool *picked = malloc(t.n);
+  for (int k = 0; k < 60; k++) {
+    size_t at = rand() % t.n;
+    Vector2 c = project(mvp, (Vector3){t.x0[at], t.y0[at], t.z0[at]}),
+            poly[12];
+    float rx = frand(0, 0.2f), ry = frand(0, 0.2f);
+    // a star, sometimes, rather than the rectangle around it
+    for (int e = 0; e < 12; e++) {
+      float a = e * PI / 6, f = e % 2 ? 1 : 0.4f;
+      poly[e] = (Vector2){c.x + f * rx * cosf(a), c.y + f * ry * sinf(a)};
+    }
+    bool star = k % 2;
+    bvh_region r = {mvp, {c.x - rx, c.y - ry}, {c.x + rx, c.y + ry},
+                    star ? poly : NULL, 12};
+    uint8_t skip = k % 3 == 0 ? BVH_TRAVEL : 0;
+    size_t from = k % 5 ? 0 : rand() % t.n,
+           to = k % 5 ? t.n : from + rand() % 3000, *in;
+    size_t n = bvh_inside(&b, &t, &r, from, to, skip, &in);
+    memset(picked, 0, t.n);
+    for (size_t m = 0; m < n; m++) {
+      assert(in[m] >= from && in[m] < to && (m == 0 || in[m] > in[m - 1]));
+      picked[in[m]] = true;
+    }
+    for (size_t j = 0; j < t.n; j++) {
+      uint8_t kind = segments_extrudes(&t, j) ? BVH_EXTRUDE : BVH_TRAVEL;
+      if (j < from || j >= to || kind & skip) {
+        assert(!picked[j]);
+        continue;
+      }
+      // the least distance outside and inside, along the move
+      Vector3 p[32];
+      size_t np = arc_points(&t, j, 1e-2f, p, 32);
+      float out = INFINITY, in = INFINITY;
+      for (size_t e = 0; e + 1 < np; e++)
+        for (int s = 0; s <= 64; s++) {
+          Vector2 q = project(mvp, Vector3Lerp(p[e], p[e + 1], s / 64.0f));
+          float d = fmaxf(fmaxf(r.lo.x - q.x, q.x - r.hi.x),
+                          fmaxf(r.lo.y - q.y, q.y - r.hi.y));
+          if (star && d <= 0) {
+            // to the closest edge, negative inside
+            float e2 = INFINITY;
+            for (int v = 0; v < 12; v++) {
+              Vector2 a = poly[v], b = poly[(v + 1) % 12];
+              Vector2 ab = Vector2Subtract(b, a);
+              float u = Clamp(Vector2DotProduct(Vector2Subtract(q, a), ab) /
+                                  Vector2DotProduct(ab, ab),
+                              0, 1);
+              e2 = fminf(e2, Vector2Distance(q, Vector2Add(a, Vector2Scale(
+                                                                 ab, u))));
+            }
+            d = polygon_crosses(poly, 12, q, q) ? -e2 : e2;
+          }
+          out = fminf(out, d);
+          in = fminf(in, -d);
+        }
+      if (out < -1e-3f)
+        assert(picked[j]);
+      if (out > 1e-2f)
+        assert(!picked[j]);
+    }
+    free(in);
+  }
+  free(picked);
+
+  // refitting after an edit gives the same tree as building it again
+  for (int k = 0; k < 20; k++) {
+    size_t from = rand() % t.n, nold = rand() % 50, nnew = rand() % 50;
+    if (from + nold > t.n)
+      nold = t.n - from;
+    segments ins;
+    segments_init(&ins);
+    for (size_t i = 0; i < nnew; i++)
+      segments_push(&ins, (Vector4){frand(-9, 9), 0, 0, 0},
+                    (Vector4){0, frand(-9, 9), 0, k % 2}, 1, 0, 0);
+    segments_splice(&t, from, nold, &ins);
+    segments_free(&ins);
+    bvh_refit(&b, &t, from, from + nnew);
+    bvh c = {0};
+    bvh_build(&c, &t);
+    assert(b.n == c.n && b.levels == c.levels);
+    assert(0 == memcmp(b.off, c.off, (b.levels + 1) * sizeof(size_t)));
+    assert(0 == memcmp(b.box, c.box, c.off[c.levels] * sizeof(BoundingBox)));
+    assert(0 == memcmp(b.mask, c.mask, c.off[c.levels]));
+    bvh_free(&c);
+  }
+
+  // nothing left after skipping everything, and an empty table
+  assert(bvh_closest(&b, &t, (Ray){{0}, {1, 0, 0}}, 0, t.n,
+                     BVH_TRAVEL | BVH_EXTRUDE, NULL, NULL, NULL) == -1);
+  assert(bvh_closest(&b, &t, (Ray){{0}, {1, 0, 0}}, 10, 10, 0, NULL, NULL,
+                     NULL) == -1);
+  segments_free(&t);
+  bvh_build(&b, &t);
+  assert(bvh_closest(&b, &t, (Ray){{0}, {1, 0, 0}}, 0, t.n, 0, NULL, NULL,
+                     NULL) == -1);
+  bvh_free(&b);
+  printf("ok\n");
+}
+#endif
@@ -0,0 +1,74 @@
+#pragma once
+#include "raylib.h"
+#include "segments.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BVH_LEAF 8
+
+// node masks: which kinds of moves are below a node
+#define BVH_TRAVEL 1
+#define BVH_EXTRUDE 2
+
+/// bounding volume hierarchy over runs of consecutive segments
+/// Consecutive moves are close together, so instead of sorting, leaves are
+/// BVH_LEAF segments in file order and every level above merges pairs.
+/// Node i of level l covers segments from (i << l) * BVH_LEAF
+/// up to ((i + 1) << l) * BVH_LEAF.
+typedef struct {
+  size_t n; // segments
+  int levels;
+  size_t *off; // first node of each level, leaves are level 0
+  BoundingBox *box;
+  uint8_t *mask;
+} bvh;
+
+void bvh_build(bvh *b, const segments *t);
+
+/// update b after segments [from, to) of t changed
+/// When the number of segments changed, everything from `from` on is redone.
+void bvh_refit(bvh *b, const segments *t, size_t from, size_t to);
+
+void bvh_free(bvh *b);
+
+/// distance between a ray and a line segment
+double DistanceToRay(Ray q, Vector3 f, Vector3 t);
+
+/// squared distances from r to the segments idx[0..n) of t, into out
+/// Like DistanceToRay(), but in float, with arcs, and turning into the ray's
+/// frame once for all of them, BVH_LEAF segments at a time.
+void bvh_distances(const segments *t, Ray r, const size_t *idx, size_t n,
+                   float *out);
+
+/// index of the segment i in [from, to) of t closest to r, or -1
+/// skip is a node mask of moves to ignore, and keep(i, ud) can reject more
+long bvh_closest(const bvh *b, const segments *t, Ray r, size_t from,
+                 size_t to, uint8_t skip, bool (*keep)(size_t i, void *ud),
+                 void *ud, float *distance);
+
+/// index of the segment i with the least dist(i, ud), or -1
+/// dist(i, ud) must be at least the distance from p to the middle of segment
+/// i, or INFINITY to skip it. Nodes that can only tie are skipped, so of
+/// equally distant segments any one may be returned.
+long bvh_nearest(const bvh *b, Vector3 p, double (*dist)(size_t i, void *ud),
+                 void *ud, double *distance);
+
+/// a region of the screen: the rectangle lo..hi, or the polygon poly[0..npoly)
+/// inside it when poly isn't NULL, in normalized device coordinates of mvp,
+/// the model view projection, -1..1 from the bottom left
+typedef struct {
+  Matrix mvp;
+  Vector2 lo, hi;
+  const Vector2 *poly;
+  size_t npoly;
+} bvh_region;
+
+/// the segments i in [from, to) of t that are partly in r and in view, in
+/// order, into a malloc()ed *out. Returns how many.
+/// The rectangle is a frustum of six planes, so nodes entirely inside it
+/// are taken whole and nodes outside it are skipped, and only the segments
+/// of nodes across it, or inside the box around a polygon, are looked at.
+/// skip is a node mask of moves to ignore.
+size_t bvh_inside(const bvh *b, const segments *t, const bvh_region *r,
+                  size_t from, size_t to, uint8_t skip, size_t **out);
@@ -0,0 +1,321 @@
+#include "cache.h"
+#include "prof.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "gcodegcv"
+// arrays start on cache lines
+#define CACHE_ALIGN 64
+// the segment columns, then the bvh's off, box and mask
+#define NARRAYS 16
+
+/// the start of a cache file, followed by the arrays
+/// Offsets and lengths are in bytes from the start of the file.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;      // 0x01020304 in the byte order it was written in
+  uint32_t size_bytes;  // sizeof(size_t)
+  uint32_t header_size; // sizeof(header)
+  uint64_t size;        // of the gcode file
+  int64_t mtime_sec, mtime_nsec;
+  uint64_t hash;
+  uint64_t n;      // segments
+  int64_t levels;  // of the bvh
+  uint64_t nodes;  // of the bvh
+  stats ps;
+  uint64_t off[NARRAYS], len[NARRAYS];
+} header;
+
+uint64_t cache_hash(const char *p, size_t n) {
+  // four independent lanes of multiply and xorshift keep up with memory
+  const uint64_t k = 0x9E3779B97F4A7C15;
+  uint64_t h[4] = {1, 2, 3, 4}, v, r = n;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32)
+    for (int l = 0; l < 4; l++) {
+      memcpy(&v, p + i + 8 * l, 8);
+      h[l] = (h[l] ^ v) * k;
+      h[l] ^= h[l] >> 31;
+    }
+  for (; i < n; i++)
+    h[0] = ((h[0] ^ (uint8_t)p[i]) * k) ^ (h[0] >> 31);
+  for (int l = 0; l < 4; l++) {
+    r = (r ^ h[l]) * k;
+    r ^= r >> 31;
+  }
+  return r;
+}
+
+// the arrays of t and b in file order, with their lengths in bytes
+static void arrays(const segments *t, const bvh *b, const void *a[NARRAYS],
+                   uint64_t len[NARRAYS]) {
+  size_t nodes = b->levels ? b->off[b->levels] : 0;
+  const void *p[NARRAYS] = {t->x0,   t->y0,   t->z0,  t->e0,   t->x1,  t->y1,
+                            t->z1,   t->e1,   t->ai,  t->aj,   t->kind, t->axes,
+                            t->line, b->off,  b->box, b->mask};
+  uint64_t l[NARRAYS] = {0};
+  for (int k = 0; k < 10; k++)
+    l[k] = t->n * sizeof(float);
+  l[10] = l[11] = t->n;
+  l[12] = t->n * sizeof(size_t);
+  l[13] = (b->levels + 1) * sizeof(size_t);
+  l[14] = nodes * sizeof(BoundingBox);
+  l[15] = nodes;
+  for (int k = 0; k < NARRAYS; k++) {
+    a[k] = p[k];
+    len[k] = l[k];
+  }
+}
+
+static char *cache_path(const char *file) {
+  size_t n = strlen(file) + 5;
+  char *path = malloc(n);
+  if (path)
+    snprintf(path, n, "%s.gcv", file);
+  return path;
+}
+
+bool cache_load(const char *file, const struct stat *st, const char *text,
+                segments *t, bvh *b, stats *ps) {
+  char *path = cache_path(file);
+  int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+  free(path);
+  if (fd < 0)
+    return false;
+
+  header h;
+  struct stat cst;
+  bool ok = 0 == fstat(fd, &cst) && cst.st_size >= (off_t)sizeof(h) &&
+            pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+            0 == memcmp(h.magic, CACHE_MAGIC, 8) &&
+            h.version == CACHE_VERSION && h.endian == 0x01020304 &&
+            h.size_bytes == sizeof(size_t) && h.header_size == sizeof(h) &&
+            h.size == (uint64_t)st->st_size &&
+            h.mtime_sec == st->st_mtim.tv_sec &&
+            h.mtime_nsec == st->st_mtim.tv_nsec && h.levels >= 0 &&
+            h.levels < 64;
+
+  // the arrays are where they should be and as long as they should be
+  segments want;
+  segments_init(&want);
+  want.n = h.n;
+  bvh wantb = {.levels = ok ? h.levels : 0};
+  size_t offs[65] = {0};
+  offs[wantb.levels] = h.nodes;
+  wantb.off = offs;
+  const void *unused[NARRAYS];
+  uint64_t len[NARRAYS];
+  arrays(&want, &wantb, unused, len);
+  for (int k = 0; ok && k < NARRAYS; k++)
+    ok = h.len[k] == len[k] && h.off[k] % CACHE_ALIGN == 0 &&
+         h.off[k] <= (uint64_t)cst.st_size &&
+         h.len[k] <= (uint64_t)cst.st_size - h.off[k];
+
+  // same size and mtime but edited anyway
+  ok = ok && cache_hash(text, st->st_size) == h.hash;
+
+  char *m = ok ? mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      fd, 0)
+               : MAP_FAILED;
+  close(fd);
+  if (m == MAP_FAILED)
+    return false;
+
+  segments_free(t);
+  t->n = t->cap = h.n;
+  t->map = m;
+  t->maplen = cst.st_size;
+  float **cols[] = {&t->x0, &t->y0, &t->z0, &t->e0, &t->x1,
+                    &t->y1, &t->z1, &t->e1, &t->ai, &t->aj};
+  for (int k = 0; k < 10; k++)
+    *cols[k] = (float *)(m + h.off[k]);
+  t->kind = (uint8_t *)(m + h.off[10]);
+  t->axes = (uint8_t *)(m + h.off[11]);
+  t->line = (size_t *)(m + h.off[12]);
+
+  // the bvh is small next to the segments, and gets refit in place
+  bvh_free(b);
+  b->n = h.n;
+  b->levels = h.levels;
+  b->off = malloc(h.len[13]);
+  b->box = malloc(h.len[14] + 1);
+  b->mask = malloc(h.len[15] + 1);
+  if (!b->off || !b->box || !b->mask) {
+    fprintf(stderr, "out of memory loading the bvh of %s\n", file);
+    exit(-1);
+  }
+  memcpy(b->off, m + h.off[13], h.len[13]);
+  memcpy(b->box, m + h.off[14], h.len[14]);
+  memcpy(b->mask, m + h.off[15], h.len[15]);
+
+  *ps = h.ps;
+  return true;
+}
+
+static bool write_all(int fd, const void *p, size_t n) {
+  while (n) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    p = (const char *)p + w;
+    n -= w;
+  }
+  return true;
+}
+
+typedef struct {
+  char *file;
+  struct stat st;
+  const char *text;
+  const segments *t;
+  const bvh *b;
+  stats ps;
+} job;
+
+static void *save(void *p) {
+  job *j = p;
+  prof_thread_name("cache");
+  PROF_SCOPE("cache_save");
+  header h = {.version = CACHE_VERSION,
+              .endian = 0x01020304,
+              .size_bytes = sizeof(size_t),
+              .header_size = sizeof(header),
+              .size = j->st.st_size,
+              .mtime_sec = j->st.st_mtim.tv_sec,
+              .mtime_nsec = j->st.st_mtim.tv_nsec,
+              .hash = cache_hash(j->text, j->st.st_size),
+              .n = j->t->n,
+              .levels = j->b->levels,
+              .nodes = j->b->levels ? j->b->off[j->b->levels] : 0};
+  memcpy(h.magic, CACHE_MAGIC, 8);
+  h.ps = j->ps;
+  const void *a[NARRAYS];
+  arrays(j->t, j->b, a, h.len);
+  uint64_t at = (sizeof(h) + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+  for (int k = 0; k < NARRAYS; k++) {
+    h.off[k] = at;
+    at = (at + h.len[k] + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+  }
+
+  // written next to it and renamed, so a cache is never half there
+  char *path = cache_path(j->file), *tmp = path ? cache_path(path) : NULL;
+  int fd = tmp ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+               : -1;
+  if (fd >= 0) {
+    static const char zeros[CACHE_ALIGN];
+    bool ok = write_all(fd, &h, sizeof(h));
+    uint64_t pos = sizeof(h);
+    for (int k = 0; ok && k < NARRAYS; k++) {
+      ok = write_all(fd, zeros, h.off[k] - pos) && write_all(fd, a[k], h.len[k]);
+      pos = h.off[k] + h.len[k];
+    }
+    if (close(fd) || !ok || rename(tmp, path))
+      unlink(tmp);
+  }
+  free(path);
+  free(tmp);
+  free(j->file);
+  free(j);
+  return NULL;
+}
+
+static pthread_t saver;
+static bool saving;
+
+void cache_save(const char *file, const struct stat *st, const char *text,
+                const segments *t, const bvh *b, const stats *ps) {
+  cache_wait();
+  job *j = malloc(sizeof(job));
+  if (!j || !(j->file = strdup(file))) {
+    free(j);
+    return;
+  }
+  j->st = *st;
+  j->text = text;
+  j->t = t;
+  j->b = b;
+  j->ps = *ps;
+  saving = 0 == pthread_create(&saver, NULL, save, j);
+  if (!saving)
+    save(j);
+}
+
+void cache_wait() {
+  if (saving)
+    pthread_join(saver, NULL);
+  saving = false;
+}
+
+#ifdef TESTING
+#include <assert.h>
+
+static bool same(const segments *a, const segments *b) {
+  return a->n == b->n && 0 == memcmp(a->x0, b->x0, a->n * 4) &&
+         0 == memcmp(a->e1, b->e1, a->n * 4) &&
+         0 == memcmp(a->aj, b->aj, a->n * 4) &&
+         0 == memcmp(a->axes, b->axes, a->n) &&
+         0 == memcmp(a->line, b->line, a->n * sizeof(size_t));
+}
+
+int main() {
+  const char *file = "test_cache.gcode";
+  char text[] = "G1 X1 Y2\nG1 X3\n";
+  FILE *h = fopen(file, "w");
+  fputs(text, h);
+  fclose(h);
+  struct stat st;
+  stat(file, &st);
+
+  segments t, u;
+  segments_init(&t);
+  segments_init(&u);
+  for (int i = 0; i < 1000; i++)
+    segments_push(&t, (Vector4){i, 0, 0.2f, i}, (Vector4){i + 1, 1, 0.2f, i},
+                  i % 2, i % 16, 9 * i);
+  t.aj[3] = 1;
+  bvh b = {0}, c = {0};
+  bvh_build(&b, &t);
+  stats ps = {1000, {1, 2, 3, 4}, {5, 6, 7, 8}}, back;
+
+  // nothing to load yet
+  unlink("test_cache.gcode.gcv");
+  assert(!cache_load(file, &st, text, &u, &c, &back));
+
+  cache_save(file, &st, text, &t, &b, &ps);
+  cache_wait();
+  assert(cache_load(file, &st, text, &u, &c, &back));
+  assert(same(&t, &u) && u.map);
+  assert(c.n == b.n && c.levels == b.levels &&
+         0 == memcmp(c.box, b.box, b.off[b.levels] * sizeof(BoundingBox)));
+  assert(0 == memcmp(&ps, &back, sizeof(back)));
+
+  // a mapped table still grows and splices
+  segments_splice(&u, 10, 5, &t);
+  assert(!u.map && u.n == 1995 && u.line[10] == 0 && u.line[1010] == 9 * 15);
+
+  // another size, mtime or content is a miss
+  struct stat other = st;
+  other.st_mtim.tv_nsec++;
+  assert(!cache_load(file, &other, text, &u, &c, &back));
+  text[4] = '7';
+  assert(!cache_load(file, &st, text, &u, &c, &back));
+  assert(u.n == 1995);
+
+  unlink(file);
+  unlink("test_cache.gcode.gcv");
+  segments_free(&t);
+  segments_free(&u);
+  bvh_free(&b);
+  bvh_free(&c);
+  printf("ok\n");
+}
+#endif
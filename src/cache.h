@@ -0,0 +1,35 @@
+#pragma once
+#include "bvh.h"
+#include "raylib.h"
+#include "segments.h"
+#include "stats.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/// bump when the layout of the cache or of what's in it changes
+#define CACHE_VERSION 3
+
+/// what parsing file.gcode produces, in file.gcode.gcv
+/// The cache is good for a file with the size, mtime and content hash it
+/// was saved with. The segment columns are mapped rather than read, so
+/// loading a big file is mostly page faults later on.
+
+/// hash of the n bytes at p, to notice an edit that kept size and mtime
+uint64_t cache_hash(const char *p, size_t n);
+
+/// fill t, b and ps from the cache of file
+/// text..text + st->st_size is file, as described by st
+/// Returns false, changing nothing, without a good cache.
+bool cache_load(const char *file, const struct stat *st, const char *text,
+                segments *t, bvh *b, stats *ps);
+
+/// write the cache of file from a background thread
+/// t and b must not change until cache_wait(). Failing to write it, say
+/// in a read only directory, isn't an error.
+void cache_save(const char *file, const struct stat *st, const char *text,
+                const segments *t, const bvh *b, const stats *ps);
+
+/// wait for cache_save()
+void cache_wait();
@@ -0,0 +1,535 @@
+#include "csv.h"
+#include "prof.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// rows formatted by one thread at a time
+#define CSV_BLOCK (1 << 16)
+// longest row: ten "%f" of FLT_MAX are under 50 bytes each, with a label
+#define CSV_ROWMAX 640
+// labels are cut to one byte less
+#define CSV_LABELMAX 32
+
+static const char digit_pairs[] = "00010203040506070809"
+                                  "10111213141516171819"
+                                  "20212223242526272829"
+                                  "30313233343536373839"
+                                  "40414243444546474849"
+                                  "50515253545556575859"
+                                  "60616263646566676869"
+                                  "70717273747576777879"
+                                  "80818283848586878889"
+                                  "90919293949596979899";
+
+static char *put_uint(char *p, uint64_t v) {
+  char b[20], *e = b + sizeof(b), *s = e;
+  while (v >= 100) {
+    s -= 2;
+    memcpy(s, digit_pairs + 2 * (v % 100), 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    s -= 2;
+    memcpy(s, digit_pairs + 2 * v, 2);
+  } else {
+    *--s = '0' + v;
+  }
+  memcpy(p, s, e - s);
+  return p + (e - s);
+}
+
+static char *put_int(char *p, long v) {
+  if (v < 0) {
+    *p++ = '-';
+    return put_uint(p, -(uint64_t)v);
+  }
+  return put_uint(p, v);
+}
+
+// "%f" of v: a float times 10^6 is exact in a double, so rounding that to an
+// integer in the current rounding mode, like printf does, gives its digits
+static char *put_float(char *p, float v) {
+  double d = (double)v * 1e6;
+  if (!(fabs(d) < 1e18)) // inf, nan or too many digits for a uint64_t
+    return p + sprintf(p, "%f", v);
+  if (signbit(v)) {
+    *p++ = '-';
+    d = -d;
+  }
+  uint64_t q = nearbyint(d);
+  uint32_t f = q % 1000000;
+  p = put_uint(p, q / 1000000);
+  *p++ = '.';
+  memcpy(p, digit_pairs + 2 * (f / 10000), 2);
+  memcpy(p + 2, digit_pairs + 2 * (f / 100 % 100), 2);
+  memcpy(p + 4, digit_pairs + 2 * (f % 100), 2);
+  return p + 6;
+}
+
+typedef struct job {
+  char *path;
+  const segments *t;
+  size_t base;     // row i is i - base of t
+  csv_fetch fetch; // or t comes a batch at a time from fetch(ud)
+  void *ud;
+  size_t from, to; // rows
+  csv_mark *marks; // sorted by i
+  size_t nmarks;
+  uint8_t skip;
+  // rows of t can instead start with labels[kind[r]] and end with value[r]
+  const uint8_t *kind;
+  const char *const *labels;
+  const float *value;
+  char *header;
+  struct job *next;
+} job;
+
+typedef struct {
+  char *buf;
+  size_t len, cap;
+} block;
+
+typedef struct {
+  const job *j;
+  block *blocks;
+  size_t first, nblocks; // blocks of this batch
+  atomic_size_t next;
+} batch;
+
+// first mark at or after row i
+static size_t mark_at(const job *j, size_t i) {
+  size_t lo = 0, hi = j->nmarks;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (j->marks[mid].i < i)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static bool same_bits(float a, float b) { return 0 == memcmp(&a, &b, 4); }
+
+static void format_block(const job *j, size_t first, block *k) {
+  const segments *t = j->t;
+  size_t base = j->base;
+  size_t end = first + CSV_BLOCK < j->to ? first + CSV_BLOCK : j->to;
+  size_t m = mark_at(j, first);
+  // the x2,y2,z2,e2 text of the previous row, if it was written
+  size_t prev = SIZE_MAX, prevlen = 0;
+  k->len = 0;
+  for (size_t i = first; i < end; i++) {
+    long isel = -1;
+    for (; m < j->nmarks && j->marks[m].i <= i; m++)
+      if (j->marks[m].i == i)
+        isel = j->marks[m].isel;
+    bool extrudes = segments_extrudes(t, i - base);
+    if (j->skip & (isel >= 0 ? CSV_SKIP_MARKED : CSV_SKIP_UNMARKED) ||
+        j->skip & (extrudes ? CSV_SKIP_EXTRUDE : CSV_SKIP_TRAVEL)) {
+      prev = SIZE_MAX;
+      continue;
+    }
+
+    if (k->cap - k->len < CSV_ROWMAX) {
+      k->cap = 2 * k->cap + CSV_ROWMAX;
+      k->buf = realloc(k->buf, k->cap);
+      if (!k->buf) {
+        fprintf(stderr, "out of memory formatting %s\n", j->path);
+        exit(-1);
+      }
+    }
+    char *p = k->buf + k->len;
+    size_t r = i - base;
+    if (j->kind) {
+      const char *label = j->labels[j->kind[r]];
+      size_t n = strnlen(label, CSV_LABELMAX - 1);
+      memcpy(p, label, n);
+      p += n;
+      *p++ = ',';
+    }
+    // a move usually starts where the previous one ended, so the start
+    // columns are the end columns of the row before
+    if (prev != SIZE_MAX && same_bits(t->x0[r], t->x1[r - 1]) &&
+        same_bits(t->y0[r], t->y1[r - 1]) &&
+        same_bits(t->z0[r], t->z1[r - 1]) &&
+        same_bits(t->e0[r], t->e1[r - 1])) {
+      memcpy(p, k->buf + prev, prevlen);
+      p += prevlen;
+    } else {
+      p = put_float(p, t->x0[r]);
+      *p++ = ',';
+      p = put_float(p, t->y0[r]);
+      *p++ = ',';
+      p = put_float(p, t->z0[r]);
+      *p++ = ',';
+      p = put_float(p, t->e0[r]);
+    }
+    *p++ = ',';
+    prev = p - k->buf;
+    p = put_float(p, t->x1[r]);
+    *p++ = ',';
+    p = put_float(p, t->y1[r]);
+    *p++ = ',';
+    p = put_float(p, t->z1[r]);
+    *p++ = ',';
+    p = put_float(p, t->e1[r]);
+    prevlen = p - k->buf - prev;
+    *p++ = ',';
+    p = j->value ? put_float(p, j->value[r]) : put_int(p, isel);
+    *p++ = '\n';
+    k->len = p - k->buf;
+  }
+}
+
+static void *format_worker(void *p) {
+  batch *r = p;
+  PROF_SCOPE("csv_format");
+  size_t b;
+  while ((b = atomic_fetch_add(&r->next, 1)) < r->nblocks)
+    format_block(r->j, r->j->from + (r->first + b) * CSV_BLOCK,
+                 &r->blocks[b]);
+  return NULL;
+}
+
+static bool write_all(int fd, const char *p, size_t n) {
+  while (n) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    p += w;
+    n -= w;
+  }
+  return true;
+}
+
+// format blocks on nthreads threads, or every core when 0, a batch at a
+// time, and write each batch in order with a few big writes
+static bool run(const job *j, long nthreads) {
+  PROF_SCOPE("csv_write");
+  size_t n = strlen(j->path) + 5;
+  char *tmp = malloc(n);
+  snprintf(tmp, n, "%s.tmp", j->path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "can't write %s: %s\n", tmp, strerror(errno));
+    free(tmp);
+    return false;
+  }
+
+  const char *header = j->header ? j->header : "x,y,z,e,x2,y2,z2,e2,isel\n";
+  bool ok = write_all(fd, header, strlen(header));
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+  size_t nblocks = (j->to - j->from + CSV_BLOCK - 1) / CSV_BLOCK;
+  block *blocks = calloc(nthreads, sizeof(block));
+  // fetched rows, for a table that isn't all there
+  job part = *j;
+  segments rows;
+  segments_init(&rows);
+  for (size_t first = 0; ok && first < nblocks; first += nthreads) {
+    batch r = {.j = &part, .blocks = blocks, .first = first};
+    r.nblocks = nblocks - first < (size_t)nthreads ? nblocks - first
+                                                   : (size_t)nthreads;
+    if (j->fetch) {
+      size_t lo = j->from + first * CSV_BLOCK, hi = lo + r.nblocks * CSV_BLOCK;
+      hi = hi < j->to ? hi : j->to;
+      PROF_SCOPE("csv_fetch");
+      j->fetch(lo, hi, &rows, j->ud);
+      part.t = &rows;
+      part.base = lo;
+    }
+    atomic_store(&r.next, 0);
+    pthread_t th[r.nblocks];
+    for (size_t i = 1; i < r.nblocks; i++)
+      pthread_create(&th[i], NULL, format_worker, &r);
+    format_worker(&r);
+    for (size_t i = 1; i < r.nblocks; i++)
+      pthread_join(th[i], NULL);
+    for (size_t b = 0; ok && b < r.nblocks; b++)
+      ok = write_all(fd, blocks[b].buf, blocks[b].len);
+  }
+  for (long b = 0; b < nthreads; b++)
+    free(blocks[b].buf);
+  free(blocks);
+  segments_free(&rows);
+
+  if (close(fd) || !ok || rename(tmp, j->path)) {
+    fprintf(stderr, "can't write %s: %s\n", j->path, strerror(errno));
+    unlink(tmp);
+    ok = false;
+  }
+  free(tmp);
+  return ok;
+}
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER,
+                      idle = PTHREAD_COND_INITIALIZER;
+static job *queue;
+static bool started, busy;
+
+static void job_free(job *j) {
+  free(j->path);
+  free(j->marks);
+  free(j->header);
+  free(j);
+}
+
+static void *writer(void *arg) {
+  prof_thread_name("csv");
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!queue) {
+      busy = false;
+      pthread_cond_broadcast(&idle);
+      pthread_cond_wait(&queued, &lock);
+    }
+    job *j = queue;
+    queue = j->next;
+    busy = true;
+    pthread_mutex_unlock(&lock);
+    run(j, 0);
+    job_free(j);
+    pthread_mutex_lock(&lock);
+  }
+  return NULL;
+}
+
+static int by_row(const void *a, const void *b) {
+  const csv_mark *x = a, *y = b;
+  return x->i < y->i ? -1 : x->i > y->i;
+}
+
+static job *job_new(const char *path, const segments *t, size_t from,
+                    size_t to, const csv_mark *marks, size_t nmarks,
+                    uint8_t skip) {
+  job *j = calloc(1, sizeof(job));
+  j->path = strdup(path);
+  j->t = t;
+  j->to = !t || to < t->n ? to : t->n;
+  j->from = from < j->to ? from : j->to;
+  j->marks = malloc(nmarks * sizeof(csv_mark) + 1);
+  if (!j->path || !j->marks) {
+    fprintf(stderr, "out of memory writing %s\n", path);
+    exit(-1);
+  }
+  if (nmarks)
+    memcpy(j->marks, marks, nmarks * sizeof(csv_mark));
+  // a region of them is selected in order, so often there's nothing to sort
+  size_t k = 1;
+  while (k < nmarks && marks[k - 1].i <= marks[k].i)
+    k++;
+  if (k < nmarks)
+    qsort(j->marks, nmarks, sizeof(csv_mark), by_row);
+  j->nmarks = nmarks;
+  j->skip = skip;
+  return j;
+}
+
+bool csv_write_now(const char *path, const segments *t, size_t from,
+                   size_t to, const csv_mark *marks, size_t nmarks,
+                   uint8_t skip, int nthreads) {
+  job *j = job_new(path, t, from, to, marks, nmarks, skip);
+  bool ok = run(j, nthreads);
+  job_free(j);
+  return ok;
+}
+
+bool csv_write_labeled(const char *path, const segments *t,
+                       const uint8_t *kind, const char *const *labels,
+                       const float *value, const char *first,
+                       const char *last, int nthreads) {
+  job *j = job_new(path, t, 0, t->n, NULL, 0, 0);
+  j->kind = kind;
+  j->labels = labels;
+  j->value = value;
+  size_t n = strlen(first) + strlen(last) + 32;
+  j->header = malloc(n);
+  if (!j->header) {
+    fprintf(stderr, "out of memory writing %s\n", path);
+    exit(-1);
+  }
+  snprintf(j->header, n, "%s,x,y,z,e,x2,y2,z2,e2,%s\n", first, last);
+  bool ok = run(j, nthreads);
+  job_free(j);
+  return ok;
+}
+
+// queue j for the writer thread
+static void submit(job *j) {
+  const char *path = j->path;
+  pthread_mutex_lock(&lock);
+  if (!started) {
+    pthread_t th;
+    started = 0 == pthread_create(&th, NULL, writer, NULL);
+    if (started)
+      pthread_detach(th);
+  }
+  if (!started) {
+    // no thread, write it right away
+    pthread_mutex_unlock(&lock);
+    run(j, 0);
+    job_free(j);
+    return;
+  }
+  job **q = &queue;
+  while (*q && strcmp((*q)->path, path))
+    q = &(*q)->next;
+  if (*q) {
+    j->next = (*q)->next;
+    job_free(*q);
+  }
+  *q = j;
+  busy = true;
+  pthread_cond_signal(&queued);
+  pthread_mutex_unlock(&lock);
+}
+
+void csv_write(const char *path, const segments *t, size_t from, size_t to,
+               const csv_mark *marks, size_t nmarks, uint8_t skip) {
+  submit(job_new(path, t, from, to, marks, nmarks, skip));
+}
+
+void csv_write_fetch(const char *path, csv_fetch fetch, void *ud, size_t from,
+                     size_t to, const csv_mark *marks, size_t nmarks,
+                     uint8_t skip) {
+  job *j = job_new(path, NULL, from, to, marks, nmarks, skip);
+  j->fetch = fetch;
+  j->ud = ud;
+  submit(j);
+}
+
+void csv_wait() {
+  pthread_mutex_lock(&lock);
+  while (queue || busy)
+    pthread_cond_wait(&idle, &lock);
+  pthread_mutex_unlock(&lock);
+}
+
+#ifdef TESTING
+#include <assert.h>
+
+static void fetch(size_t from, size_t to, segments *out, void *ud) {
+  segments_copy(out, ud, from, to - from);
+}
+
+int main() {
+  // the same text as printf for random bit patterns, round numbers and
+  // halfway cases
+  srand(11);
+  for (int k = 0; k < 1000000; k++) {
+    uint32_t u = (uint32_t)rand() << 16 ^ (uint32_t)rand();
+    float v;
+    memcpy(&v, &u, 4);
+    if (k % 3 == 1)
+      v = (rand() % 2000000 - 1000000) / 1000.0f;
+    if (k % 3 == 2)
+      v = (rand() % 20000 - 10000) / 64.0f + 0.0000005f;
+    char a[64], b[64];
+    *put_float(a, v) = '\0';
+    sprintf(b, "%f", v);
+    assert(0 == strcmp(a, b));
+    *put_int(a, u % 3 ? (long)u : -(long)u) = '\0';
+    sprintf(b, "%ld", u % 3 ? (long)u : -(long)u);
+    assert(0 == strcmp(a, b));
+  }
+
+  // a whole file is what fprintf gives
+  segments t;
+  segments_init(&t);
+  Vector4 p = {0, 0, 0, 0};
+  for (int i = 0; i < 3 * CSV_BLOCK + 5; i++) {
+    Vector4 q = {p.x + (rand() % 100 - 50) * 0.013f, -p.y + 0.5f,
+                 0.2f * (i / 997), p.w + (i % 7 ? 0.05f : -0.5f)};
+    if (i % 101 == 0)
+      p.x += 1; // a gap
+    segments_push(&t, p, q, 1, 0, 0);
+    p = q;
+  }
+  csv_mark marks[] = {{5, 2}, {70000, 0}, {3, 1}};
+  const char *path = "test_csv.csv", *expect = "test_csv_expect.csv";
+  for (uint8_t skip = 0; skip < 16; skip++) {
+    // some of the time only rows across a block boundary
+    size_t from = skip % 4 >= 2 ? 4 : 0, to = skip % 4 >= 2 ? 70001 : t.n;
+    if (skip % 2) {
+      // or right away, on a few threads
+      assert(csv_write_now(path, &t, from, to, marks, 3, skip, skip % 3));
+    } else if (skip % 4 == 2) {
+      // or a few blocks at a time from elsewhere
+      csv_write_fetch(path, fetch, &t, from, to, marks, 3, skip);
+    } else {
+      csv_write(path, &t, from, to, marks, 3, skip);
+      csv_write(path, &t, from, to, marks, 3, skip); // replaces the first
+    }
+    FILE *h = fopen(expect, "w");
+    fprintf(h, "x,y,z,e,x2,y2,z2,e2,isel\n");
+    for (size_t i = from; i < to; i++) {
+      int isel = i == 5 ? 2 : i == 70000 ? 0 : i == 3 ? 1 : -1;
+      bool ext = segments_extrudes(&t, i);
+      if (skip & (isel >= 0 ? CSV_SKIP_MARKED : CSV_SKIP_UNMARKED) ||
+          skip & (ext ? CSV_SKIP_EXTRUDE : CSV_SKIP_TRAVEL))
+        continue;
+      fprintf(h, "%f,%f,%f,%f,%f,%f,%f,%f,%d\n", t.x0[i], t.y0[i], t.z0[i],
+              t.e0[i], t.x1[i], t.y1[i], t.z1[i], t.e1[i], isel);
+    }
+    fclose(h);
+    csv_wait();
+
+    FILE *a = fopen(path, "r"), *b = fopen(expect, "r");
+    int ca, cb;
+    do {
+      ca = fgetc(a);
+      cb = fgetc(b);
+      assert(ca == cb);
+    } while (ca != EOF);
+    fclose(a);
+    fclose(b);
+  }
+  assert(!csv_write_now("no/such/dir.csv", &t, 0, t.n, NULL, 0, 0, 1));
+
+  // a label first and a number last instead of isel
+  static const char *labels[] = {"one", "two"};
+  uint8_t *kind = malloc(t.n);
+  float *value = malloc(t.n * sizeof(float));
+  for (size_t i = 0; i < t.n; i++) {
+    kind[i] = i % 3 == 0;
+    value[i] = (rand() % 20000 - 10000) / 7.0f;
+  }
+  assert(csv_write_labeled(path, &t, kind, labels, value, "kind", "v", 3));
+  FILE *h = fopen(expect, "w");
+  fprintf(h, "kind,x,y,z,e,x2,y2,z2,e2,v\n");
+  for (size_t i = 0; i < t.n; i++)
+    fprintf(h, "%s,%f,%f,%f,%f,%f,%f,%f,%f,%f\n", labels[kind[i]], t.x0[i],
+            t.y0[i], t.z0[i], t.e0[i], t.x1[i], t.y1[i], t.z1[i], t.e1[i],
+            value[i]);
+  fclose(h);
+  FILE *a = fopen(path, "r"), *b = fopen(expect, "r");
+  int ca, cb;
+  do {
+    ca = fgetc(a);
+    cb = fgetc(b);
+    assert(ca == cb);
+  } while (ca != EOF);
+  fclose(a);
+  fclose(b);
+  free(kind);
+  free(value);
+  unlink(path);
+  unlink(expect);
+  segments_free(&t);
+  printf("ok\n");
+}
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+#include "segments.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// rows csv_write() leaves out
+#define CSV_SKIP_MARKED 1
+#define CSV_SKIP_UNMARKED 2
+#define CSV_SKIP_TRAVEL 4
+#define CSV_SKIP_EXTRUDE 8
+
+/// a marked row and the number in its isel column
+typedef struct {
+  size_t i;
+  long isel;
+} csv_mark;
+
+/// write rows [from, to) of t to path on a background thread
+/// Columns are x,y,z,e,x2,y2,z2,e2,isel formatted like "%f" and "%d", isel
+/// is -1 except in the nmarks rows in marks. The file is written next to
+/// path and renamed over it, so readers never see half of it. t must not
+/// change until csv_wait(). A write to the same path that hasn't started
+/// yet is dropped for this one.
+void csv_write(const char *path, const segments *t, size_t from, size_t to,
+               const csv_mark *marks, size_t nmarks, uint8_t skip);
+
+/// csv_write() on this thread, formatting on nthreads threads, or every
+/// core when 0. Returns false when the file couldn't be written.
+bool csv_write_now(const char *path, const segments *t, size_t from,
+                   size_t to, const csv_mark *marks, size_t nmarks,
+                   uint8_t skip, int nthreads);
+
+/// csv_write_now() of every row of t with a first column of labels[kind[i]],
+/// cut to 31 bytes, and a last one of value[i] formatted like "%f" instead
+/// of isel. first and last name them in the header.
+bool csv_write_labeled(const char *path, const segments *t,
+                       const uint8_t *kind, const char *const *labels,
+                       const float *value, const char *first,
+                       const char *last, int nthreads);
+
+/// fill out with rows [from, to) of a table that isn't all in memory
+typedef void (*csv_fetch)(size_t from, size_t to, segments *out, void *ud);
+
+/// csv_write() of the rows fetch(ud) gives, a few blocks of them at a time
+/// What fetch() reads must not change until csv_wait().
+void csv_write_fetch(const char *path, csv_fetch fetch, void *ud, size_t from,
+                     size_t to, const csv_mark *marks, size_t nmarks,
+                     uint8_t skip);
+
+/// wait until every csv_write() so far is on disk
+void csv_wait();
@@ -0,0 +1,637 @@
+#include "diff.h"
+#include "bvh.h"
+#include "csv.h"
+#include "prof.h"
+#include "remap.h"
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint64_t mix(uint64_t h, uint64_t v) {
+  h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+  return h * 0xff51afd7ed558ccdull;
+}
+
+static uint64_t rounded(float v) {
+  // NaN arc radii all hash the same
+  return v == v ? (uint64_t)llroundf(v / DIFF_EPS) : 1ull << 63;
+}
+
+uint64_t diff_hash(const segments *t, size_t from, size_t to) {
+  uint64_t h = 0;
+  for (size_t i = from; i < to; i++) {
+    h = mix(h, rounded(t->x0[i]));
+    h = mix(h, rounded(t->y0[i]));
+    h = mix(h, rounded(t->z0[i]));
+    h = mix(h, rounded(t->x1[i]));
+    h = mix(h, rounded(t->y1[i]));
+    h = mix(h, rounded(t->z1[i]));
+    h = mix(h, rounded(t->e1[i] - t->e0[i]));
+    h = mix(h, t->kind[i]);
+    if (segments_arc(t, i)) {
+      h = mix(h, rounded(t->ai[i]));
+      h = mix(h, rounded(t->aj[i]));
+    }
+  }
+  return mix(h, to - from);
+}
+
+static void push(diff *d, diff_change c) {
+  if (d->n == d->cap) {
+    d->cap = 2 * d->cap + 256;
+    d->c = realloc(d->c, d->cap * sizeof(diff_change));
+    if (!d->c) {
+      fprintf(stderr, "out of memory for %zu changes\n", d->cap);
+      exit(-1);
+    }
+  }
+  d->c[d->n++] = c;
+}
+
+// where a hash goes in a table of cap, a power of 2
+static size_t slot(uint64_t h, size_t cap) { return (h ^ h >> 32) & (cap - 1); }
+
+// a layer of each file to compare, REMAP_NONE when one has no such layer
+typedef struct {
+  size_t old, new, layer;
+} pair;
+
+typedef struct {
+  const segments *old, *t;
+  const layers *lo, *ln;
+  uint64_t *hash; // of every layer of old, then of t
+  pair *pairs;
+  diff *parts; // a diff per pair
+  size_t n;
+  atomic_size_t next;
+} job;
+
+static void *hasher(void *p) {
+  job *j = p;
+  PROF_SCOPE("diff_hash");
+  size_t k, nold = j->lo->n;
+  while ((k = atomic_fetch_add(&j->next, 1)) < nold + j->ln->n) {
+    bool old = k < nold;
+    const layer *l = old ? &j->lo->l[k] : &j->ln->l[k - nold];
+    j->hash[k] = diff_hash(old ? j->old : j->t, l->from, l->to);
+  }
+  return NULL;
+}
+
+// whether the moves extrude about the same, with some room for the float
+// precision of absolute extrusion far into a file
+static bool same_extrusion(const segments *p, size_t i, const segments *q,
+                           size_t k) {
+  float a = p->e1[i] - p->e0[i], b = q->e1[k] - q->e0[k];
+  float e = fmaxf(fabsf(p->e1[i]), fabsf(q->e1[k]));
+  return fabsf(a - b) <= DIFF_EPS + 4 * FLT_EPSILON * e;
+}
+
+static void compare(const job *j, const pair *p, diff *d) {
+  const layer *o = p->old != REMAP_NONE ? &j->lo->l[p->old] : NULL,
+              *l = p->new != REMAP_NONE ? &j->ln->l[p->new] : NULL;
+  diff_change c = {REMAP_NONE, REMAP_NONE, p->layer, 0, DIFF_ADDED};
+  if (!o || !l) {
+    c.kind = o ? DIFF_REMOVED : DIFF_ADDED;
+    for (size_t i = o ? o->from : l->from; i < (o ? o->to : l->to); i++) {
+      *(o ? &c.old : &c.new) = i;
+      push(d, c);
+    }
+    return;
+  }
+
+  // moves that are the same in both are paired up by their hashes first,
+  // so only the rest need looking for
+  size_t nold = o->to - o->from, n = l->to - l->from, cap = 16;
+  while (cap < 2 * n)
+    cap *= 2;
+  uint64_t *hash = malloc(n * sizeof(uint64_t) + 1);
+  size_t *table = calloc(cap, sizeof(size_t)); // new row + 1, or 0
+  size_t *rows = malloc(nold * sizeof(size_t) + 1),
+         *out = malloc(nold * sizeof(size_t) + 1), nrows = 0;
+  // the new rows paired up already
+  size_t *reserved = malloc(n * sizeof(size_t) + 1), nreserved = 0;
+  bool *taken = calloc(n + 1, 1);
+  if (!hash || !table || !rows || !out || !reserved || !taken) {
+    fprintf(stderr, "out of memory comparing layers of %zu segments\n", n);
+    exit(-1);
+  }
+  for (size_t i = 0; i < n; i++) {
+    hash[i] = diff_hash(j->t, l->from + i, l->from + i + 1);
+    size_t h = slot(hash[i], cap);
+    while (table[h])
+      h = (h + 1) & (cap - 1);
+    table[h] = i + 1;
+  }
+  for (size_t r = o->from; r < o->to; r++) {
+    uint64_t want = diff_hash(j->old, r, r + 1);
+    size_t h = slot(want, cap);
+    for (; table[h]; h = (h + 1) & (cap - 1))
+      if (!taken[table[h] - 1] && hash[table[h] - 1] == want)
+        break;
+    if (table[h])
+      taken[reserved[nreserved++] = table[h] - 1] = true;
+    else
+      rows[nrows++] = r;
+  }
+
+  // then the closest move of the new layer, on its own, to each old one
+  segments t;
+  segments_init(&t);
+  bvh b = {0};
+  if (nrows) {
+    segments_copy(&t, j->t, l->from, n);
+    bvh_build(&b, &t);
+    remap(j->old, rows, nrows, &t, &b, reserved, nreserved, out, 1);
+  }
+  for (size_t k = 0; k < nrows; k++) {
+    c = (diff_change){rows[k], REMAP_NONE, p->layer, 0, DIFF_REMOVED};
+    size_t i = out[k];
+    if (i != REMAP_NONE) {
+      Vector4 s[2] = {segments_start(&t, i), segments_end(&t, i)},
+              q[2] = {segments_start(j->old, c.old),
+                      segments_end(j->old, c.old)};
+      c.distance = SegmentDistance4(s, q);
+      taken[i] = true;
+      bool same_e = same_extrusion(&t, i, j->old, c.old);
+      if (c.distance <= DIFF_EPS && same_e)
+        continue;
+      if (c.distance <= DIFF_MOVE_MAX) {
+        c.new = l->from + i;
+        c.kind = DIFF_MOVED;
+      } else {
+        c.distance = 0;
+        taken[i] = false;
+      }
+    }
+    push(d, c);
+  }
+  for (size_t i = 0; i < n; i++)
+    if (!taken[i])
+      push(d,
+           (diff_change){REMAP_NONE, l->from + i, p->layer, 0, DIFF_ADDED});
+
+  free(hash);
+  free(table);
+  free(rows);
+  free(out);
+  free(reserved);
+  free(taken);
+  bvh_free(&b);
+  segments_free(&t);
+}
+
+static void *comparer(void *p) {
+  job *j = p;
+  PROF_SCOPE("diff_compare");
+  size_t k;
+  while ((k = atomic_fetch_add(&j->next, 1)) < j->n)
+    compare(j, &j->pairs[k], &j->parts[k]);
+  return NULL;
+}
+
+// run f on nthreads threads, this one included
+static void run(void *(*f)(void *), job *j, int nthreads) {
+  atomic_store(&j->next, 0);
+  pthread_t th[nthreads > 1 ? nthreads - 1 : 1];
+  for (int i = 0; i < nthreads - 1; i++)
+    pthread_create(&th[i], NULL, f, j);
+  f(j);
+  for (int i = 0; i < nthreads - 1; i++)
+    pthread_join(th[i], NULL);
+}
+
+typedef struct {
+  float z;
+  size_t k;
+} height;
+
+static int by_z(const void *a, const void *b) {
+  const height *x = a, *y = b;
+  if (x->z != y->z)
+    return x->z < y->z ? -1 : 1;
+  return x->k < y->k ? -1 : x->k > y->k;
+}
+
+static int by_layer(const void *a, const void *b) {
+  const pair *x = a, *y = b;
+  if (x->layer != y->layer)
+    return x->layer < y->layer ? -1 : 1;
+  // a layer's own pair, then those of old layers shown with it
+  if ((x->new == REMAP_NONE) != (y->new == REMAP_NONE))
+    return x->new == REMAP_NONE ? 1 : -1;
+  return x->old < y->old ? -1 : x->old > y->old;
+}
+
+// the layer of ln nearest in height to z
+static size_t nearest(const layers *ln, float z) {
+  size_t best = 0;
+  for (size_t k = 1; k < ln->n; k++)
+    if (fabsf(ln->l[k].z - z) < fabsf(ln->l[best].z - z))
+      best = k;
+  return best;
+}
+
+void diff_build(diff *d, const segments *old, const layers *lo,
+                const segments *t, const layers *ln, int nthreads) {
+  PROF_SCOPE("diff");
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+  d->n = d->same_layers = d->changed_layers = 0;
+  d->added = d->removed = d->moved = 0;
+  size_t nold = lo->n;
+  job j = {.old = old, .t = t, .lo = lo, .ln = ln};
+  size_t cap = 16;
+  while (cap < 2 * nold)
+    cap *= 2;
+  j.hash = malloc((nold + ln->n) * sizeof(uint64_t) + 1);
+  j.pairs = malloc((ln->n + nold) * sizeof(pair) + 1);
+  size_t *table = calloc(cap, sizeof(size_t)); // old layer + 1, or 0
+  bool *used = calloc(nold + 1, 1), *same = calloc(ln->n + 1, 1);
+  height *left = malloc(nold * sizeof(height) + 1);
+  if (!j.hash || !j.pairs || !table || !used || !same || !left) {
+    fprintf(stderr, "out of memory comparing %zu layers\n", nold + ln->n);
+    exit(-1);
+  }
+  run(hasher, &j, nthreads);
+
+  // the old layers by hash, to find one the same as each new one, which
+  // is then used up
+  for (size_t k = 0; k < nold; k++) {
+    size_t h = slot(j.hash[k], cap);
+    while (table[h])
+      h = (h + 1) & (cap - 1);
+    table[h] = k + 1;
+  }
+  for (size_t k = 0; k < ln->n; k++) {
+    uint64_t want = j.hash[nold + k];
+    for (size_t h = slot(want, cap); table[h]; h = (h + 1) & (cap - 1)) {
+      size_t o = table[h] - 1;
+      if (!used[o] && j.hash[o] == want) {
+        used[o] = same[k] = true;
+        d->same_layers++;
+        break;
+      }
+    }
+  }
+
+  // the rest pair up by height, in order
+  size_t nleft = 0;
+  for (size_t k = 0; k < nold; k++)
+    if (!used[k])
+      left[nleft++] = (height){lo->l[k].z, k};
+  qsort(left, nleft, sizeof(height), by_z);
+  for (size_t k = 0; k < ln->n; k++) {
+    if (same[k])
+      continue;
+    float z = ln->l[k].z;
+    // the first old layer at least this high, and then the first one of
+    // those not used up
+    size_t a = 0, b = nleft;
+    while (a < b) {
+      size_t m = a + (b - a) / 2;
+      if (left[m].z < z - LAYERS_EPS)
+        a = m + 1;
+      else
+        b = m;
+    }
+    for (; a < nleft && used[left[a].k]; a++)
+      ;
+    pair p = {REMAP_NONE, k, k};
+    if (a < nleft && left[a].z <= z + LAYERS_EPS) {
+      p.old = left[a].k;
+      used[p.old] = true;
+    }
+    j.pairs[j.n++] = p;
+  }
+  for (size_t k = 0; k < nleft; k++)
+    if (!used[left[k].k])
+      j.pairs[j.n++] = (pair){left[k].k, REMAP_NONE,
+                              ln->n ? nearest(ln, left[k].z) : 0};
+  d->changed_layers = j.n;
+  qsort(j.pairs, j.n, sizeof(pair), by_layer);
+
+  j.parts = calloc(j.n + 1, sizeof(diff));
+  if (!j.parts) {
+    fprintf(stderr, "out of memory comparing %zu layers\n", j.n);
+    exit(-1);
+  }
+  if ((size_t)nthreads > j.n)
+    nthreads = j.n ? j.n : 1;
+  run(comparer, &j, nthreads);
+
+  for (size_t k = 0; k < j.n; k++) {
+    for (size_t i = 0; i < j.parts[k].n; i++) {
+      diff_change c = j.parts[k].c[i];
+      push(d, c);
+      d->added += c.kind == DIFF_ADDED;
+      d->removed += c.kind == DIFF_REMOVED;
+      d->moved += c.kind == DIFF_MOVED;
+    }
+    free(j.parts[k].c);
+  }
+  free(j.parts);
+  free(j.pairs);
+  free(left);
+  free(same);
+  free(used);
+  free(table);
+  free(j.hash);
+}
+
+void diff_free(diff *d) {
+  free(d->c);
+  *d = (diff){0};
+}
+
+void diff_layers(const diff *d, size_t lo, size_t hi, size_t *from,
+                 size_t *to) {
+  size_t a = 0, b = d->n;
+  while (a < b) {
+    size_t m = a + (b - a) / 2;
+    if (d->c[m].layer < lo)
+      a = m + 1;
+    else
+      b = m;
+  }
+  *from = a;
+  for (b = d->n; a < b;) {
+    size_t m = a + (b - a) / 2;
+    if (d->c[m].layer < hi)
+      a = m + 1;
+    else
+      b = m;
+  }
+  *to = a;
+}
+
+bool diff_write_csv(const char *path, const diff *d, const segments *old,
+                    const segments *t) {
+  PROF_SCOPE("diff_csv");
+  static const char *kinds[] = {"added", "removed", "moved"};
+  // the segments in the order of the changes, written like any others
+  segments rows;
+  segments_init(&rows);
+  segments_reserve(&rows, d->n);
+  uint8_t *kind = malloc(d->n + 1);
+  float *distance = malloc(d->n * sizeof(float) + 1);
+  if (!kind || !distance) {
+    fprintf(stderr, "out of memory for %zu changes\n", d->n);
+    exit(-1);
+  }
+  for (size_t k = 0; k < d->n; k++) {
+    const diff_change *c = &d->c[k];
+    const segments *s = c->kind == DIFF_REMOVED ? old : t;
+    size_t i = c->kind == DIFF_REMOVED ? c->old : c->new;
+    segments_push(&rows, segments_start(s, i), segments_end(s, i), s->kind[i],
+                  s->axes[i], s->line[i]);
+    kind[k] = c->kind;
+    distance[k] = c->distance;
+  }
+  bool ok = csv_write_labeled(path, &rows, kind, kinds, distance, "kind",
+                              "distance", 0);
+  segments_free(&rows);
+  free(kind);
+  free(distance);
+  return ok;
+}
+
+// what diff_start() was given, and the diff it makes
+static struct {
+  const segments *old, *t;
+  const layers *lo, *ln;
+  char *path;
+  void (*ready)(void);
+  diff d;
+} bg;
+static pthread_t differ;
+static bool started, pending; // a thread to join, a diff not taken
+static atomic_bool done;
+
+static void *differ_run(void *arg) {
+  prof_thread_name("diff");
+  diff_build(&bg.d, bg.old, bg.lo, bg.t, bg.ln, 0);
+  diff_write_csv(bg.path, &bg.d, bg.old, bg.t);
+  atomic_store(&done, true);
+  if (bg.ready)
+    bg.ready();
+  return NULL;
+}
+
+void diff_start(const segments *old, const layers *lo, const segments *t,
+                const layers *ln, const char *path, void (*ready)(void)) {
+  diff_wait();
+  diff_free(&bg.d);
+  free(bg.path);
+  bg.old = old;
+  bg.lo = lo;
+  bg.t = t;
+  bg.ln = ln;
+  bg.path = strdup(path);
+  bg.ready = ready;
+  if (!bg.path) {
+    fprintf(stderr, "out of memory writing %s\n", path);
+    exit(-1);
+  }
+  atomic_store(&done, false);
+  pending = true;
+  started = 0 == pthread_create(&differ, NULL, differ_run, NULL);
+  if (!started)
+    differ_run(NULL);
+}
+
+bool diff_take(diff *d) {
+  if (!pending || !atomic_load(&done))
+    return false;
+  diff_wait();
+  diff_free(d);
+  *d = bg.d;
+  bg.d = (diff){0};
+  pending = false;
+  return true;
+}
+
+void diff_wait() {
+  if (started)
+    pthread_join(differ, NULL);
+  started = false;
+}
+
+#ifdef TESTING
+#include "gcode.h"
+#include "synth.h"
+#include <assert.h>
+
+static bool same_changes(const diff *a, const diff *b) {
+  if (a->n != b->n)
+    return false;
+  for (size_t k = 0; k < a->n; k++) {
+    const diff_change *x = &a->c[k], *y = &b->c[k];
+    if (x->old != y->old || x->new != y->new || x->layer != y->layer ||
+        x->kind != y->kind || x->distance != y->distance)
+      return false;
+  }
+  return true;
+}
+
+int main() {
+  synth_opts o = SYNTH_DEFAULTS;
+  o.layers = 80;
+  o.per_layer = 500;
+  o.arcs = 10;
+  size_t len;
+  char *text = synth_gcode(&o, &len);
+  segments a, b;
+  segments_init(&a);
+  segments_init(&b);
+  stats st;
+  gcode_parse(&a, text, text + len, &st, 0);
+  layers la = {0}, lb = {0};
+  layers_build(&la, &a);
+  assert(la.n == 80);
+
+  // a file against itself is the same everywhere
+  diff d = {0}, e = {0};
+  diff_build(&d, &a, &la, &a, &la, 4);
+  assert(d.n == 0 && d.same_layers == la.n && d.changed_layers == 0);
+
+  // a file like a with a few changes, from the top down so that the
+  // layers of a still say where they are in b
+  segments_copy(&b, &a, 0, a.n);
+  // layer 60 is gone
+  segments none;
+  segments_init(&none);
+  segments_splice(&b, la.l[60].from, la.l[60].to - la.l[60].from, &none);
+  // one move of layer 50 extrudes more
+  size_t more = la.l[50].from + 10;
+  while (!segments_extrudes(&b, more))
+    more++;
+  b.e1[more] += 0.1f;
+  // and everything above 40 is extruded 5 mm further into the spool, which
+  // changes nothing
+  for (size_t i = la.l[41].from; i < b.n; i++)
+    b.e0[i] += 5, b.e1[i] += 5;
+  // three extrusions far away are added to layer 30
+  segments ins;
+  segments_init(&ins);
+  float z = la.l[30].z;
+  for (int k = 0; k < 3; k++)
+    segments_push(&ins, (Vector4){500 + k, 500, z, k},
+                  (Vector4){501 + k, 500, z, k + 1}, 1, 0, 0);
+  segments_splice(&b, la.l[30].to, 0, &ins);
+  // five moves in the middle of layer 20 are removed
+  size_t cut = la.l[20].from + 100;
+  segments_splice(&b, cut, 5, &none);
+  // and layer 10 moves over 0.1 mm
+  for (size_t i = la.l[10].from; i < la.l[10].to; i++)
+    b.x0[i] += 0.1f, b.x1[i] += 0.1f;
+  layers_build(&lb, &b);
+  assert(lb.n == 79);
+
+  diff_build(&d, &a, &la, &b, &lb, 4);
+  size_t n10 = la.l[10].to - la.l[10].from, n60 = la.l[60].to - la.l[60].from;
+  assert(d.changed_layers == 5 && d.same_layers == 75);
+  assert(d.added == 3 && d.removed == 5 + n60 && d.moved == n10 + 1);
+  assert(d.n == d.added + d.removed + d.moved);
+  for (size_t k = 0; k < d.n; k++) {
+    const diff_change *c = &d.c[k];
+    assert(k == 0 || d.c[k - 1].layer <= c->layer);
+    assert((c->old == REMAP_NONE) == (c->kind == DIFF_ADDED));
+    assert((c->new == REMAP_NONE) == (c->kind == DIFF_REMOVED));
+    if (c->kind == DIFF_ADDED)
+      assert(c->layer == 30 && b.x0[c->new] >= 500);
+    if (c->kind == DIFF_REMOVED)
+      assert(c->old >= la.l[60].from ? c->old < la.l[60].to
+                                     : c->old >= cut && c->old < cut + 5);
+    if (c->kind == DIFF_MOVED && c->old == more)
+      // three moves were added below it and five removed
+      assert(c->new == more - 2 && c->distance == 0);
+    else if (c->kind == DIFF_MOVED)
+      assert(c->layer == 10 && fabsf(c->distance - 0.1f) < 1e-3f);
+  }
+
+  // the same on one thread
+  diff_build(&e, &a, &la, &b, &lb, 1);
+  assert(same_changes(&d, &e));
+
+  // the changes of a few layers
+  size_t from, to;
+  diff_layers(&d, 10, 30, &from, &to);
+  assert(to - from == n10 + 5);
+  for (size_t k = 0; k < d.n; k++)
+    assert((k >= from && k < to) == (d.c[k].layer >= 10 && d.c[k].layer < 30));
+
+  // and the csv has a row for each, as printf would write it
+  const char *path = "test_diff.csv", *expect = "test_diff_expect.csv";
+  assert(diff_write_csv(path, &d, &a, &b));
+  FILE *h = fopen(expect, "w");
+  assert(h);
+  fprintf(h, "kind,x,y,z,e,x2,y2,z2,e2,distance\n");
+  static const char *kinds[] = {"added", "removed", "moved"};
+  for (size_t k = 0; k < d.n; k++) {
+    const diff_change *c = &d.c[k];
+    const segments *s = c->kind == DIFF_REMOVED ? &a : &b;
+    size_t i = c->kind == DIFF_REMOVED ? c->old : c->new;
+    fprintf(h, "%s,%f,%f,%f,%f,%f,%f,%f,%f,%f\n", kinds[c->kind], s->x0[i],
+            s->y0[i], s->z0[i], s->e0[i], s->x1[i], s->y1[i], s->z1[i],
+            s->e1[i], c->distance);
+  }
+  fclose(h);
+  FILE *x = fopen(path, "r"), *y = fopen(expect, "r");
+  assert(x && y);
+  int cx, cy;
+  do {
+    cx = fgetc(x);
+    cy = fgetc(y);
+    assert(cx == cy);
+  } while (cx != EOF);
+  fclose(x);
+  fclose(y);
+  unlink(path);
+  assert(!diff_write_csv("no/such/dir.csv", &d, &a, &b));
+
+  // in the background, the same diff and csv, taken once
+  diff_start(&a, &la, &b, &lb, path, NULL);
+  diff_wait();
+  assert(diff_take(&e) && same_changes(&d, &e) && !diff_take(&e));
+  x = fopen(path, "r");
+  y = fopen(expect, "r");
+  assert(x && y);
+  do {
+    cx = fgetc(x);
+    cy = fgetc(y);
+    assert(cx == cy);
+  } while (cx != EOF);
+  fclose(x);
+  fclose(y);
+  unlink(path);
+  unlink(expect);
+
+  // a file with nothing in it lost everything
+  segments empty;
+  segments_init(&empty);
+  layers le = {0};
+  diff_build(&d, &a, &la, &empty, &le, 0);
+  assert(d.removed == a.n && d.n == a.n && d.same_layers == 0);
+
+  diff_free(&d);
+  diff_free(&e);
+  layers_free(&la);
+  layers_free(&lb);
+  layers_free(&le);
+  segments_free(&a);
+  segments_free(&b);
+  segments_free(&ins);
+  segments_free(&none);
+  segments_free(&empty);
+  free(text);
+  printf("ok\n");
+}
+#endif
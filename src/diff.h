@@ -0,0 +1,76 @@
+#pragma once
+#include "layers.h"
+#include "segments.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// segments closer than this, in mm of SegmentDistance(), are the same
+#define DIFF_EPS 1e-3f
+/// and closer than this one moved, instead of one being removed and the
+/// other added
+#define DIFF_MOVE_MAX 1.0f
+
+typedef enum {
+  DIFF_ADDED,   // in the new file only
+  DIFF_REMOVED, // in the old file only
+  DIFF_MOVED,   // a little off from where it was, or extruding differently
+} diff_kind;
+
+/// a segment that differs
+typedef struct {
+  size_t old, new; // rows of the two files, REMAP_NONE when not in one
+  size_t layer;    // of the new file it's shown with
+  float distance;  // how far a moved segment moved
+  uint8_t kind;
+} diff_change;
+
+/// what changed from one file to another, ordered by layer
+typedef struct {
+  diff_change *c;
+  size_t n, cap;
+  size_t same_layers, changed_layers;
+  size_t added, removed, moved;
+} diff;
+
+/// a hash of segments [from, to) of t that is the same for the same moves
+/// Coordinates are rounded to DIFF_EPS, and extrusion counts as how much
+/// each move extrudes, so layers after one that extrudes more still match.
+/// Where the moves are in the file doesn't count.
+uint64_t diff_hash(const segments *t, size_t from, size_t to);
+
+/// the changes from old, with layers lo, to t, with layers ln, into d
+/// Layers with the same hash as one of the other file are the same. The
+/// others are paired up by height, and their segments matched up with
+/// remap(), a pair of layers per thread, on nthreads threads or every core
+/// when 0. Layers without a pair are all added or removed.
+void diff_build(diff *d, const segments *old, const layers *lo,
+                const segments *t, const layers *ln, int nthreads);
+
+void diff_free(diff *d);
+
+/// the changes [from, to) of d that are in layers [lo, hi)
+void diff_layers(const diff *d, size_t lo, size_t hi, size_t *from,
+                 size_t *to);
+
+/// write d to path as csv: a row per change with columns
+/// kind,x,y,z,e,x2,y2,z2,e2,distance, the new segment except when
+/// removed, formatted by csv_write_labeled(). Returns false when it
+/// couldn't be written.
+bool diff_write_csv(const char *path, const diff *d, const segments *old,
+                    const segments *t);
+
+/// diff_build() and diff_write_csv() to path on a thread, calling ready()
+/// from it when done, unless it is NULL
+/// old, lo, t and ln must not change until diff_wait(). One at a time: a
+/// diff still running is waited for and one not taken dropped.
+void diff_start(const segments *old, const layers *lo, const segments *t,
+                const layers *ln, const char *path, void (*ready)(void));
+
+/// move the diff of the last diff_start() into d, freeing what d had, once
+/// it's done. Returns false, changing nothing, before that or when it was
+/// already taken.
+bool diff_take(diff *d);
+
+/// wait for diff_start() to be done
+void diff_wait();
@@ -0,0 +1,873 @@
+#include "gcode.h"
+#include "prof.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+size_t gcode_chunk_bytes = 4 << 20;
+
+static inline int isspace_ascii(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+void advance_ps_reset(gcode_cursor *g, char *b, char *e) {
+  memset(g, 0, sizeof(*g));
+  g->c = g->c0 = b;
+  g->cend = e;
+  for (int a = 0; a < 4; a++)
+    g->known[a] = true;
+}
+
+// Numbers in gcode are [+-]digits[.digits], which is cheap to convert
+// exactly. Anything else (exponents, hex, inf, leading spaces, very long
+// mantissas) goes to strtof()/strtod(), so results always match them.
+
+static inline bool isdigit_ascii(char ch) { return ch >= '0' && ch <= '9'; }
+
+// the next 8 bytes are all digits
+static inline bool swar_eight_digits(uint64_t v) {
+  return ((v & 0xF0F0F0F0F0F0F0F0) |
+          (((v + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) ==
+         0x3333333333333333;
+}
+
+static inline uint32_t swar_parse_eight_digits(uint64_t v) {
+  v -= 0x3030303030303030;
+  v = (v * 10) + (v >> 8);
+  v = (((v & 0x000000FF000000FF) * (100 + (1000000ULL << 32))) +
+       (((v >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32)))) >>
+      32;
+  return (uint32_t)v;
+}
+
+// accumulate the digits at p (before lim) into *m
+static inline char *scan_digits(char *p, char *lim, uint64_t *m, int *nd) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t v;
+  while (lim - p >= 8 && *nd <= 11 &&
+         (memcpy(&v, p, 8), swar_eight_digits(v))) {
+    *m = *m * 100000000 + swar_parse_eight_digits(v);
+    *nd += 8;
+    p += 8;
+  }
+#endif
+  for (; p < lim && isdigit_ascii(*p); p++, (*nd)++)
+    *m = *m * 10 + (*p - '0');
+  return p;
+}
+
+static const double pow10_exact[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                     1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                     1e18, 1e19, 1e20, 1e21, 1e22};
+
+/// strtof() for the numbers of axis words, reading no further than lim
+static inline float scan_float(char *s, char *lim, char **end) {
+  char *p = s;
+  bool neg = p < lim && *p == '-';
+  if (p < lim && (*p == '-' || *p == '+'))
+    p++;
+  uint64_t m = 0;
+  int nd = 0, frac = 0;
+  p = scan_digits(p, lim, &m, &nd);
+  if (p < lim && *p == '.') {
+    char *f = ++p;
+    p = scan_digits(p, lim, &m, &nd);
+    frac = p - f;
+  }
+  if (nd == 0 || nd > 19 || m >= (1ULL << 53) || frac > 22 ||
+      (p < lim && (*p == 'e' || *p == 'E' || *p == 'x' || *p == 'X')))
+    return strtof(s, end);
+
+  // both operands are exact, so d is the correctly rounded quotient; it
+  // rounds to the same float as the decimal unless it landed on a midpoint
+  double d = (double)m / pow10_exact[frac];
+  uint64_t bits;
+  memcpy(&bits, &d, 8);
+  if (m && (bits & ((1ULL << 29) - 1)) == (1ULL << 28))
+    return strtof(s, end);
+
+  *end = p;
+  float f = d;
+  return neg ? -f : f;
+}
+
+/// (int)strtod() for the numbers after G and M
+static inline int scan_command(char *s, char *lim, char **end) {
+  char *p = s;
+  int v = 0, nd = 0;
+  for (; p < lim && isdigit_ascii(*p) && nd < 9; p++, nd++)
+    v = v * 10 + (*p - '0');
+  if (p < lim && *p == '.')
+    for (p++; p < lim && isdigit_ascii(*p); p++)
+      nd++;
+  if (nd == 0 || (p < lim && (isdigit_ascii(*p) || *p == 'e' || *p == 'E' ||
+                              *p == 'x' || *p == 'X')))
+    return (int)strtod(s, end);
+  *end = p;
+  return v;
+}
+
+static inline void set_mode(gcode_cursor *g, int a, bool r) {
+  g->rel[a] = r;
+  g->mode_set[a] = true;
+}
+
+static inline void move_axis(gcode_cursor *g, int a, float f) {
+  g->words |= 1 << a;
+  if (!g->mode_set[a])
+    g->guessed[a] = true;
+  if (g->rel[a]) {
+    g->at[a] += f;
+  } else {
+    g->at[a] = f;
+    g->known[a] = true;
+  }
+}
+
+bool advance_ps(gcode_cursor *g) {
+  g->ps[0] = g->ps[1];
+  char *c = g->c, *c0 = g->c0, *cend = g->cend;
+
+  if (c >= cend)
+    return false;
+
+  while (c < cend) {
+    if (*c == '\n' || c == c0) {
+      char *q = (c == c0) ? c : c + 1;
+
+      // find end of line (glibc memchr is vectorized)
+      char *line_end = memchr(q, '\n', cend - q);
+      if (!line_end)
+        line_end = cend;
+
+      // semicolon is the comment or end of line
+      char *semicolon = memchr(q, ';', line_end - q);
+      if (!semicolon)
+        semicolon = line_end;
+
+      // command at start of line?
+      if (q < semicolon && (q[0] == 'G' || q[0] == 'M')) {
+        char cmd = q[0];
+        char *num_end;
+        int gval = scan_command(q + 1, semicolon, &num_end);
+        if (num_end != (q + 1)) {
+
+          if (cmd == 'G') {
+            switch (gval) {
+              // clang-format off
+              case 90: // G90: all absolute
+                for (int a = 0; a < 4; a++)
+                  set_mode(g, a, false);
+                c = line_end;
+                continue;
+              case 91: // G91: all relative
+                for (int a = 0; a < 4; a++)
+                  set_mode(g, a, true);
+                c = line_end;
+                continue;
+            case 0: case 1: // G0 move G1: extrude move
+            case 2: case 3: { // G2 clockwise G3 counterclockwise arc
+              // clang-format on
+
+              char *s = num_end; // after the numeric part of "G1"
+              g->words = 0;
+              // I and J are always relative to the start, R is a radius
+              float ij[2] = {0, 0}, radius = 0;
+              bool has_ij = false, has_r = false;
+              while (s < semicolon) {
+                while (s < semicolon && isspace_ascii(*s))
+                  ++s;
+                if (s >= semicolon)
+                  break;
+
+                char axis = *s;
+                int a = axis == 'X'   ? 0
+                        : axis == 'Y' ? 1
+                        : axis == 'Z' ? 2
+                        : axis == 'E' ? 3
+                        : gval < 2    ? -1
+                        : axis == 'I' ? 4
+                        : axis == 'J' ? 5
+                        : axis == 'R' ? 6
+                                      : -1;
+                if (a >= 0) {
+                  char *num_start = s + 1;
+                  char *num_end_f;
+                  float f = scan_float(num_start, semicolon, &num_end_f);
+                  if (num_end_f != num_start) {
+                    if (a < 4)
+                      move_axis(g, a, f);
+                    else if (a < 6)
+                      ij[a - 4] = f, has_ij = true;
+                    else
+                      radius = f, has_r = true;
+                    s = num_end_f;
+                    continue;
+                  }
+                }
+                // skip unknown token
+                while (s < semicolon && !isspace_ascii(*s))
+                  ++s;
+              }
+              g->arc[0] = has_r && !has_ij ? NAN : ij[0];
+              g->arc[1] = has_r && !has_ij ? radius : ij[1];
+
+              g->ps[1] = (Vector4){g->at[0], g->at[1], g->at[2], g->at[3]};
+              g->line = q;
+              g->kind = gval;
+              g->c = line_end; // advance cursor to end of parsed line
+              return true;
+            }
+            default:
+              break;
+            }
+          } else if (cmd == 'M') {
+            switch (gval) {
+            case 82: // M82: E absolute
+              set_mode(g, 3, false);
+              c = line_end;
+              continue;
+            case 83: // M83: E relative
+              set_mode(g, 3, true);
+              c = line_end;
+              continue;
+            default:
+              break;
+            }
+          }
+        }
+      }
+
+      // not a recognized command; skip line
+      c = line_end;
+      continue;
+    }
+    ++c;
+  }
+  g->c = cend; // no more commands
+  return false;
+}
+
+typedef struct {
+  char *b, *e;
+  bool entry_rel[4];
+  double entry[4];
+  gcode_cursor g;        // state at the end of the chunk
+  size_t first_known[4]; // segments before this one are relative to entry
+  size_t first_set[4];   // segments before this one have the entry modes
+  bool fix_rel[4];       // entry_rel[i] was guessed wrong but unused
+  segments t;
+  size_t off; // index of the first segment in the whole table
+} chunk;
+
+static void parse_chunk(chunk *k, char *file) {
+  gcode_cursor *g = &k->g;
+  advance_ps_reset(g, k->b, k->e);
+  for (int a = 0; a < 4; a++) {
+    g->known[a] = false;
+    g->rel[a] = k->entry_rel[a];
+    k->first_known[a] = k->first_set[a] = SIZE_MAX;
+  }
+  k->t.n = 0;
+  while (advance_ps(g)) {
+    uint8_t axes = g->words << 4;
+    for (int a = 0; a < 4; a++) {
+      if (k->first_known[a] == SIZE_MAX && g->known[a])
+        k->first_known[a] = k->t.n;
+      if (k->first_set[a] == SIZE_MAX && g->mode_set[a])
+        k->first_set[a] = k->t.n;
+      axes |= g->rel[a] << a;
+    }
+    segments_push(&k->t, g->ps[0], g->ps[1], g->kind, axes, g->line - file);
+    if (g->kind >= 2) {
+      k->t.ai[k->t.n - 1] = g->arc[0];
+      k->t.aj[k->t.n - 1] = g->arc[1];
+    }
+  }
+}
+
+typedef struct {
+  chunk *ks;
+  size_t nk;
+  char *file;
+  segments *out;
+  atomic_size_t next;
+  bool fixup;
+  stats_sketch *sketch; // one per thread, or NULL
+  atomic_int slot;
+} parse_job;
+
+// add the entry position to what was parsed relative to it
+// and copy the chunk into its place in the whole table
+static void fixup_chunk(parse_job *j, chunk *k, stats_sketch *sk) {
+  segments *s = &k->t, *o = j->out;
+  float *ends[4] = {s->x1, s->y1, s->z1, s->e1};
+  for (int a = 0; a < 4; a++)
+    for (size_t i = 0; i < k->first_known[a] && i < s->n; i++)
+      ends[a][i] = k->entry[a] + ends[a][i];
+  for (int a = 0; a < 4; a++)
+    if (k->fix_rel[a])
+      for (size_t i = 0; i < k->first_set[a] && i < s->n; i++)
+        s->axes[i] ^= 1 << a;
+  if (sk)
+    stats_sketch_add(sk, s->x1, s->y1, s->z1, s->e1, s->n);
+
+  size_t n = s->n, off = k->off;
+  if (n) {
+    memcpy(o->x1 + off, s->x1, n * sizeof(float));
+    memcpy(o->y1 + off, s->y1, n * sizeof(float));
+    memcpy(o->z1 + off, s->z1, n * sizeof(float));
+    memcpy(o->e1 + off, s->e1, n * sizeof(float));
+    memcpy(o->ai + off, s->ai, n * sizeof(float));
+    memcpy(o->aj + off, s->aj, n * sizeof(float));
+    memcpy(o->kind + off, s->kind, n * sizeof(uint8_t));
+    memcpy(o->axes + off, s->axes, n * sizeof(uint8_t));
+    memcpy(o->line + off, s->line, n * sizeof(size_t));
+    // every move starts where the previous one ended
+    o->x0[off] = k->entry[0];
+    o->y0[off] = k->entry[1];
+    o->z0[off] = k->entry[2];
+    o->e0[off] = k->entry[3];
+    memcpy(o->x0 + off + 1, s->x1, (n - 1) * sizeof(float));
+    memcpy(o->y0 + off + 1, s->y1, (n - 1) * sizeof(float));
+    memcpy(o->z0 + off + 1, s->z1, (n - 1) * sizeof(float));
+    memcpy(o->e0 + off + 1, s->e1, (n - 1) * sizeof(float));
+  }
+  segments_free(s);
+}
+
+static void *parse_worker(void *p) {
+  parse_job *j = p;
+  stats_sketch *sk = j->fixup && j->sketch
+                         ? &j->sketch[atomic_fetch_add(&j->slot, 1)]
+                         : NULL;
+  PROF_SCOPE(j->fixup ? "parse_fixup" : "parse_chunks");
+  size_t i;
+  while ((i = atomic_fetch_add(&j->next, 1)) < j->nk) {
+    if (j->fixup)
+      fixup_chunk(j, &j->ks[i], sk);
+    else
+      parse_chunk(&j->ks[i], j->file);
+  }
+  return NULL;
+}
+
+static void parse_run(parse_job *j, size_t first, bool fixup, int nthreads) {
+  j->fixup = fixup;
+  atomic_store(&j->next, first);
+  if ((size_t)nthreads > j->nk - first)
+    nthreads = j->nk - first;
+  pthread_t th[nthreads > 1 ? nthreads - 1 : 1];
+  for (int i = 0; i < nthreads - 1; i++)
+    pthread_create(&th[i], NULL, parse_worker, j);
+  parse_worker(j);
+  for (int i = 0; i < nthreads - 1; i++)
+    pthread_join(th[i], NULL);
+}
+
+// Split at newlines and parse the chunks in parallel. Chunks after the first
+// guess that they start in the modes the first chunk ended in, and the few
+// whose axis words depended on a wrong guess are parsed again once the
+// real modes are known. Positions are then stitched with a prefix scan over
+// the chunk exits.
+// The statistics of the end points are summed up while the chunks are
+// copied into place.
+// b..e is part of file, entered at position at in modes r. at and r are
+// updated to the state at e. Unless sk is NULL, the end points are added
+// to it.
+static void parse_range(segments *t, char *file, char *b, char *e, double at[4],
+                        bool r[4], stats_sketch *sk, int nthreads) {
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+
+  size_t nk = 0, maxk = (e - b) / gcode_chunk_bytes + 1;
+  chunk *ks = calloc(maxk, sizeof(chunk));
+  for (char *p = b; p < e; nk++) {
+    char *q = e;
+    if ((size_t)(e - p) > gcode_chunk_bytes) {
+      q = memchr(p + gcode_chunk_bytes, '\n', e - p - gcode_chunk_bytes);
+      q = q ? q + 1 : e;
+    }
+    ks[nk].b = p;
+    ks[nk].e = q;
+    p = q;
+  }
+
+  parse_job j = {.ks = ks, .nk = nk, .file = file, .out = t};
+  if (nk) {
+    memcpy(ks[0].entry_rel, r, sizeof(ks[0].entry_rel));
+    parse_chunk(&ks[0], file);
+    for (size_t k = 1; k < nk; k++)
+      for (int a = 0; a < 4; a++)
+        ks[k].entry_rel[a] = ks[0].g.rel[a];
+    parse_run(&j, 1, false, nthreads);
+  }
+
+  size_t total = 0;
+  for (size_t k = 0; k < nk; k++) {
+    chunk *ck = &ks[k];
+    bool wrong = false;
+    for (int a = 0; a < 4; a++) {
+      wrong |= ck->g.guessed[a] && ck->entry_rel[a] != r[a];
+      ck->fix_rel[a] = ck->entry_rel[a] != r[a];
+    }
+    if (wrong) {
+      memcpy(ck->entry_rel, r, sizeof(ck->entry_rel));
+      memset(ck->fix_rel, 0, sizeof(ck->fix_rel));
+      parse_chunk(ck, file);
+    }
+    memcpy(ck->entry, at, sizeof(ck->entry));
+    for (int a = 0; a < 4; a++) {
+      // round like the chunk's last move so the next one starts on it
+      at[a] = ck->g.known[a] ? ck->g.at[a] : at[a] + (float)ck->g.at[a];
+      if (ck->g.mode_set[a])
+        r[a] = ck->g.rel[a];
+    }
+    ck->off = total;
+    total += ck->t.n;
+  }
+
+  segments_resize(t, total);
+  if (sk) {
+    j.sketch = malloc(nthreads * sizeof(stats_sketch));
+    if (!j.sketch) {
+      fprintf(stderr, "out of memory for statistics\n");
+      exit(-1);
+    }
+    for (int i = 0; i < nthreads; i++)
+      stats_sketch_init(&j.sketch[i]);
+  }
+  parse_run(&j, 0, true, nthreads);
+  if (sk) {
+    for (int i = 0; i < nthreads; i++) {
+      stats_sketch_merge(sk, &j.sketch[i]);
+      stats_sketch_free(&j.sketch[i]);
+    }
+    free(j.sketch);
+  }
+  free(ks);
+}
+
+void gcode_parse(segments *t, char *b, char *e, stats *st, int nthreads) {
+  double at[4] = {0};
+  bool r[4] = {false};
+  stats_sketch sk;
+  stats_sketch_init(&sk);
+  parse_range(t, b, b, e, at, r, st ? &sk : NULL, nthreads);
+  if (st)
+    *st = stats_of(&sk);
+  stats_sketch_free(&sk);
+}
+
+void gcode_stream_init(gcode_stream *s, char *b, char *e) {
+  *s = (gcode_stream){.file = b, .c = b, .e = e};
+  stats_sketch_init(&s->sketch);
+}
+
+bool gcode_stream_next(gcode_stream *s, segments *t, size_t bytes,
+                       int nthreads) {
+  if (s->c >= s->e)
+    return false;
+  // where the text is cut doesn't change the table, as with chunks
+  char *q = s->e;
+  if ((size_t)(s->e - s->c) > bytes) {
+    q = memchr(s->c + bytes, '\n', s->e - s->c - bytes);
+    q = q ? q + 1 : s->e;
+  }
+  parse_range(t, s->file, s->c, q, s->at, s->rel, &s->sketch, nthreads);
+  s->c = q;
+  return true;
+}
+
+void gcode_stream_free(gcode_stream *s) { stats_sketch_free(&s->sketch); }
+
+// length of the common prefix of a and b, comparing a page at a time
+static size_t common_prefix(const char *a, const char *b, size_t n) {
+  size_t i = 0;
+  while (i + 4096 <= n && 0 == memcmp(a + i, b + i, 4096))
+    i += 4096;
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+static size_t common_suffix(const char *aend, const char *bend, size_t n) {
+  size_t i = 0;
+  while (i + 4096 <= n && 0 == memcmp(aend - i - 4096, bend - i - 4096, 4096))
+    i += 4096;
+  while (i < n && aend[-1 - (long)i] == bend[-1 - (long)i])
+    i++;
+  return i;
+}
+
+// first segment whose line starts at or after off
+static size_t segment_at(const segments *t, size_t off) {
+  size_t lo = 0, hi = t->n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (t->line[mid] < off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+gcode_splice gcode_reparse(segments *t, char *o, char *oend, char *b, char *e,
+                           segments *removed, int nthreads) {
+  size_t no = oend - o, nn = e - b, m = no < nn ? no : nn;
+  size_t pre = common_prefix(o, b, m);
+  size_t suf = common_suffix(oend, e, m - pre);
+
+  // the prefix ends and the suffix starts on line boundaries
+  while (pre && b[pre - 1] != '\n')
+    pre--;
+  char *nl = suf ? memchr(e - suf, '\n', suf) : NULL;
+  size_t sufstart = nl ? (nl + 1 - b) + no - nn : no; // in the old text
+
+  // restart at the line of the last segment of the prefix, which has the
+  // modes it was parsed in, so mode changes after it are read again
+  size_t kp = segment_at(t, pre), from = kp ? kp - 1 : 0;
+  size_t ks = segment_at(t, sufstart);
+  double at[4] = {0};
+  bool r[4] = {false};
+  char *mb = b;
+  if (kp) {
+    Vector4 p = segments_start(t, from);
+    double entry[4] = {p.x, p.y, p.z, p.w};
+    memcpy(at, entry, sizeof(at));
+    for (int a = 0; a < 4; a++)
+      r[a] = t->axes[from] >> a & 1;
+    mb = b + t->line[from];
+  }
+  char *me = ks < t->n ? b + (t->line[ks] + nn - no) : e;
+
+  segments mid;
+  segments_init(&mid);
+  parse_range(&mid, b, mb, me, at, r, NULL, nthreads);
+
+  // the suffix has to be read in the modes it was read in before
+  bool same_modes = true;
+  for (int a = 0; a < 4 && ks < t->n; a++)
+    same_modes &= r[a] == (t->axes[ks] >> a & 1);
+  if (!same_modes) {
+    segments_free(&mid);
+    gcode_splice sp = {0, t->n, 0, 0};
+    if (removed)
+      segments_copy(removed, t, 0, t->n);
+    gcode_parse(t, b, e, NULL, nthreads);
+    sp.to = sp.dirty = t->n;
+    return sp;
+  }
+
+  if (removed)
+    segments_copy(removed, t, from, ks - from);
+  gcode_splice sp = {from, ks, from + mid.n, from + mid.n};
+  Vector4 entry = ks < t->n ? segments_start(t, ks) : (Vector4){0};
+  segments_splice(t, from, ks - from, &mid);
+  segments_free(&mid);
+
+  size_t n = t->n;
+  for (size_t i = sp.to; i < n; i++)
+    t->line[i] += nn - no;
+
+  // Until a suffix move gives an axis in absolute mode, that axis is still
+  // relative to where the suffix started. Shifting reproduces a reparse to
+  // within float rounding, which is what chunk boundaries do as well.
+  float *starts[4] = {t->x0, t->y0, t->z0, t->e0},
+        *ends[4] = {t->x1, t->y1, t->z1, t->e1};
+  double old_entry[4] = {entry.x, entry.y, entry.z, entry.w};
+  for (int a = 0; a < 4 && sp.to < n; a++) {
+    double d = at[a] - old_entry[a];
+    if (d == 0)
+      continue;
+    size_t i = sp.to;
+    for (; i < n && (t->axes[i] & (0x11 << a)) != 0x10 << a; i++) {
+      starts[a][i] = starts[a][i] + d;
+      ends[a][i] = ends[a][i] + d;
+    }
+    if (i < n) {
+      // the first absolute move still starts from a shifted point
+      starts[a][i] = starts[a][i] + d;
+      i++;
+    }
+    if (i > sp.dirty)
+      sp.dirty = i;
+  }
+  // every move starts where the previous one ended
+  if (sp.to < n) {
+    Vector4 p = sp.to ? segments_end(t, sp.to - 1) : (Vector4){0};
+    t->x0[sp.to] = p.x;
+    t->y0[sp.to] = p.y;
+    t->z0[sp.to] = p.z;
+    t->e0[sp.to] = p.w;
+    if (sp.to + 1 > sp.dirty)
+      sp.dirty = sp.to + 1;
+  }
+  if (sp.to != sp.old_to)
+    sp.dirty = n;
+  return sp;
+}
+
+#ifdef TESTING
+#include <assert.h>
+#include <string.h>
+
+static void parse_string(segments *t, const char *s, int nthreads) {
+  gcode_parse(t, (char *)s, (char *)s + strlen(s), NULL, nthreads);
+}
+
+static bool same(const segments *a, const segments *b) {
+  if (a->n != b->n)
+    return false;
+  for (size_t i = 0; i < a->n; i++) {
+    Vector4 p0 = segments_start(a, i), p1 = segments_end(a, i),
+            q0 = segments_start(b, i), q1 = segments_end(b, i);
+    if (memcmp(&p0, &q0, sizeof(p0)) || memcmp(&p1, &q1, sizeof(p1)) ||
+        memcmp(&a->ai[i], &b->ai[i], sizeof(float)) ||
+        memcmp(&a->aj[i], &b->aj[i], sizeof(float)) ||
+        a->kind[i] != b->kind[i] || a->axes[i] != b->axes[i] ||
+        a->line[i] != b->line[i])
+      return false;
+  }
+  return true;
+}
+
+// random strings that look like gcode numbers, and some that don't
+static void random_number(char *b) {
+  const char *junk[] = {"", "", "", "", "e5", "E-2", "x1", ".", " ", "-",
+                        "inf", "nan", ";", "X", "\n"};
+  char *p = b;
+  if (rand() % 8 == 0)
+    p += sprintf(p, "%s", junk[rand() % 15]);
+  if (rand() % 3 == 0)
+    *p++ = "-+"[rand() % 2];
+  for (int n = rand() % 12; n > 0; n--)
+    *p++ = '0' + rand() % 10;
+  if (rand() % 4) {
+    *p++ = '.';
+    for (int n = rand() % 14; n > 0; n--)
+      *p++ = '0' + rand() % 10;
+  }
+  if (rand() % 8 == 0)
+    p += sprintf(p, "%s", junk[rand() % 15]);
+  *p = '\0';
+}
+
+// lines of moves and mode changes at quarter millimeters, so sums are exact
+static char *random_gcode(char *b, int lines) {
+  for (int i = 0; i < lines; i++) {
+    int r = rand() % 16;
+    const char *cmd = r == 0   ? "G91"
+                      : r == 1 ? "G90"
+                      : r == 2 ? "M83"
+                      : r == 3 ? "M82"
+                      : r == 4 ? "; comment G1 X5"
+                      : r < 8  ? "G0"
+                      : r < 15 ? "G1"
+                      : rand() % 2 ? "G2"
+                               : "G3";
+    b += sprintf(b, "%s", cmd);
+    if (r >= 5)
+      for (int a = 0; a < 4; a++)
+        if (rand() % 2)
+          b += sprintf(b, " %c%g", "XYZE"[a], (rand() % 400 - 100) * 0.25);
+    if (r == 15)
+      for (int a = 0; a < 3; a++)
+        if (rand() % 2)
+          b += sprintf(b, " %c%g", "IJR"[a], (rand() % 400 - 200) * 0.25);
+    b += sprintf(b, "\n");
+  }
+  return b;
+}
+
+int main() {
+  // fast scanning agrees bit for bit with strtof and strtod
+  srand(3);
+  for (int i = 0; i < 2000000; i++) {
+    char b[64], *e1, *e2;
+    random_number(b);
+    float f1 = scan_float(b, b + strlen(b), &e1), f2 = strtof(b, &e2);
+    assert(0 == memcmp(&f1, &f2, sizeof(float)) && e1 == e2);
+    int g1 = scan_command(b, b + strlen(b), &e1), g2 = (int)strtod(b, &e2);
+    assert(e1 == e2 && (e1 == b || g1 == g2));
+  }
+  // midpoints between floats and mantissas past 2^24
+  const char *hard[] = {"16777217", "16777216.5", "0.000000059604644775390625",
+                        "33554433", "1234.56789", "8388608.5", "9007199254740993",
+                        "3.4028235e38", "-0", "-0.0", "00000000000000000001.5"};
+  for (size_t i = 0; i < sizeof(hard) / sizeof(hard[0]); i++) {
+    char *e1, *e2;
+    float f1 = scan_float((char *)hard[i], (char *)hard[i] + strlen(hard[i]), &e1),
+          f2 = strtof(hard[i], &e2);
+    assert(0 == memcmp(&f1, &f2, sizeof(float)) && e1 == e2);
+  }
+
+  segments t;
+  segments_init(&t);
+
+  const char *g = "; header comment G1 X9\n"
+                  "G90\n"
+                  "M83\n"
+                  "G1 X1 Y2 Z0.2 E0.5 ; first\n"
+                  "G0 X3\n"
+                  "G91\n"
+                  "G1 X1 Y1\n"
+                  "G90\n"
+                  "M82\n"
+                  "G1 E2\n"
+                  "G28\n"
+                  "G1 X0 Y0";
+  parse_string(&t, g, 1);
+  assert(t.n == 5);
+
+  // absolute move, relative E
+  assert(t.x1[0] == 1 && t.y1[0] == 2 && t.z1[0] == 0.2f && t.e1[0] == 0.5f);
+  assert(t.kind[0] == 1 && segments_extrudes(&t, 0));
+  assert(0 == strncmp(g + t.line[0], "G1 X1 Y2", 8));
+
+  // travel starts where the previous move ended
+  assert(t.x0[1] == 1 && t.x1[1] == 3 && t.y1[1] == 2);
+  assert(t.kind[1] == 0 && !segments_extrudes(&t, 1));
+
+  // G91 moves are relative
+  assert(t.x1[2] == 4 && t.y1[2] == 3 && t.z1[2] == 0.2f);
+
+  // M82 absolute E
+  assert(t.e0[3] == 0.5f && t.e1[3] == 2);
+
+  // last line without a trailing newline
+  assert(t.x1[4] == 0 && t.y1[4] == 0);
+  assert(0 == strcmp(g + t.line[4], "G1 X0 Y0"));
+
+  // arcs: I and J stay relative to the start under G91, R alone is NaN R,
+  // and I J win over R
+  parse_string(&t,
+               "G1 X10 Y0\nG3 X0 Y10 I-10 J0 E1\nG91\nG2 X10 Y-10 R10\n"
+               "G2 X1 I2 R5\nG1 X1 I7\n",
+               1);
+  assert(t.n == 5 && t.kind[1] == 3 && t.kind[2] == 2);
+  assert(t.x1[1] == 0 && t.y1[1] == 10 && t.ai[1] == -10 && t.aj[1] == 0);
+  assert(t.x1[2] == 10 && t.y1[2] == 0 && isnan(t.ai[2]) && t.aj[2] == 10);
+  assert(t.x1[3] == 11 && t.ai[3] == 2 && t.aj[3] == 0);
+  assert(t.kind[4] == 1 && t.ai[4] == 0 && t.x1[4] == 12);
+
+  // reparsing replaces the previous contents
+  parse_string(&t, "G1 X1\nG1 X2\n", 1);
+  assert(t.n == 2 && t.x0[1] == 1 && t.x1[1] == 2);
+
+  // tiny chunks stitched across mode changes give the same table as one
+  // chunk: quarters add up exactly in float and double
+  static char big[1 << 16];
+  srand(1);
+  random_gcode(big, 2000);
+  segments one, many;
+  segments_init(&one);
+  segments_init(&many);
+  parse_string(&one, big, 1);
+  size_t chunk = gcode_chunk_bytes;
+  for (gcode_chunk_bytes = 1; gcode_chunk_bytes < 4096; gcode_chunk_bytes *= 3) {
+    parse_string(&many, big, 4);
+    assert(same(&one, &many));
+  }
+
+  // and the stats summed up over chunks and threads are the same as from
+  // the table, except for the order the mean was added up in
+  stats st;
+  gcode_parse(&many, big, big + strlen(big), &st, 4);
+  gcode_chunk_bytes = chunk;
+  assert(st.n == one.n);
+  float *min = &st.min.x, *max = &st.max.x, *mean = &st.mean.x;
+  float *ends[4] = {one.x1, one.y1, one.z1, one.e1};
+  for (int a = 0; a < 4; a++) {
+    float lo = INFINITY, hi = -INFINITY;
+    double sum = 0;
+    for (size_t i = 0; i < one.n; i++) {
+      lo = fminf(lo, ends[a][i]);
+      hi = fmaxf(hi, ends[a][i]);
+      sum += ends[a][i];
+    }
+    assert(min[a] == lo && max[a] == hi);
+    assert(fabs(mean[a] - sum / one.n) < 1e-3);
+  }
+  gcode_parse(&many, big, big + strlen(big), &st, 1);
+  stats st4;
+  gcode_parse(&many, big, big + strlen(big), &st4, 4);
+  assert(0 == memcmp(&st.center, &st4.center, sizeof(Vector4)));
+
+  // parsing a window at a time gives the same table in pieces, and the
+  // same stats but for the mean
+  gcode_chunk_bytes = 100;
+  parse_string(&one, big, 4);
+  gcode_parse(&many, big, big + strlen(big), &st, 4);
+  gcode_stream gs;
+  gcode_stream_init(&gs, big, big + strlen(big));
+  segments piece;
+  segments_init(&piece);
+  segments_resize(&many, 0);
+  size_t windows = 0;
+  while (gcode_stream_next(&gs, &piece, 1000 * (windows + 1), 4)) {
+    assert(piece.n && 0 == strncmp(big + piece.line[0], "G", 1));
+    segments_splice(&many, many.n, 0, &piece);
+    windows++;
+  }
+  assert(windows > 5 && gs.c == gs.e && same(&one, &many));
+  assert(!gcode_stream_next(&gs, &piece, 1000, 4));
+  stats sts = stats_of(&gs.sketch);
+  assert(sts.n == st.n && 0 == memcmp(&sts.min, &st.min, sizeof(Vector4)) &&
+         0 == memcmp(&sts.max, &st.max, sizeof(Vector4)) &&
+         0 == memcmp(&sts.center, &st.center, sizeof(Vector4)));
+  gcode_stream_free(&gs);
+  segments_free(&piece);
+  gcode_chunk_bytes = chunk;
+
+  // reparsing after an edit gives the same table as parsing from scratch:
+  // replace a run of lines with random ones, at the start, the end or in
+  // between, and sometimes change nothing
+  static char edited[1 << 17];
+  segments removed;
+  segments_init(&removed);
+  for (int k = 0; k < 300; k++) {
+    size_t len = strlen(big);
+    char *p = big + rand() % (len + 1), *q = p + rand() % 400;
+    if (k % 10 == 0)
+      p = big;
+    if (k % 10 == 1 || q > big + len)
+      q = big + len;
+    while (p > big && p[-1] != '\n')
+      p--;
+    while (q < big + len && q[-1] != '\n')
+      q++;
+    size_t keep = p - big;
+    memcpy(edited, big, keep);
+    char *r = k % 10 == 2 ? edited + keep : random_gcode(edited + keep, rand() % 8);
+    memcpy(r, q, big + len - q + 1);
+
+    parse_string(&many, big, 4);
+    size_t n_old = many.n;
+    gcode_splice sp = gcode_reparse(&many, big, big + len, edited,
+                                    edited + strlen(edited), &removed, 4);
+    parse_string(&one, edited, 4);
+    assert(same(&one, &many));
+    assert(sp.from <= sp.to && sp.old_to - sp.from == removed.n);
+    assert(sp.to - sp.from + n_old - removed.n == many.n);
+    assert(sp.dirty >= sp.to && sp.dirty <= many.n);
+    if (strlen(edited) < sizeof(big))
+      strcpy(big, edited);
+  }
+  segments_free(&removed);
+  segments_free(&one);
+  segments_free(&many);
+
+  segments_free(&t);
+  printf("ok\n");
+}
+#endif
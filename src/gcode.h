@@ -0,0 +1,83 @@
+#pragma once
+#include "raylib.h"
+#include "segments.h"
+#include "stats.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// parser state for one stretch of gcode text
+/// c is the cursor running from c0 to cend.
+/// A chunk that starts in the middle of a file doesn't know the position
+/// or the G90/G91/M82/M83 modes it inherits, so it parses relative to its
+/// entry and records what it will need to be stitched onto the previous
+/// chunk.
+typedef struct {
+  char *c, *c0, *cend;
+
+  /// advance_ps() moves ps[1] to ps[0] and reads the next move into ps[1]
+  Vector4 ps[2];
+  bool rel[4]; // X,Y,Z,E relative flags
+
+  /// source line and G number of the move in ps
+  char *line;
+  int kind;
+  float arc[2]; // G2/G3: I and J, or NaN and R
+  uint8_t words; // bit a: the line gave axis a
+
+  double at[4];     // position, relative to the chunk entry unless known
+  bool known[4];    // at[i] is absolute
+  bool mode_set[4]; // rel[i] was set inside this chunk
+  bool guessed[4];  // an axis word was read before rel[i] was set
+} gcode_cursor;
+
+/// start parsing b..e from the origin in absolute mode
+void advance_ps_reset(gcode_cursor *g, char *b, char *e);
+
+bool advance_ps(gcode_cursor *g);
+
+/// bytes per chunk for gcode_parse()
+/// Chunk boundaries don't depend on the thread count so the result doesn't
+/// either.
+extern size_t gcode_chunk_bytes;
+
+/// parse b..e once into t, replacing its contents
+/// using nthreads threads, or every core when nthreads is 0
+/// Unless st is NULL, it gets the stats of the segment end points.
+void gcode_parse(segments *t, char *b, char *e, stats *st, int nthreads);
+
+/// parsing a file a window of text at a time, for showing it as it loads
+/// Put together, the windows are what gcode_parse() gives.
+typedef struct {
+  char *file, *c, *e; // parsed up to c
+  double at[4];       // position and modes at c
+  bool rel[4];
+  stats_sketch sketch; // of every window so far
+} gcode_stream;
+
+/// start parsing b..e from the origin in absolute mode
+void gcode_stream_init(gcode_stream *s, char *b, char *e);
+
+/// parse at least bytes more of the text, or what's left, into t,
+/// replacing its contents. Returns false, changing nothing, at the end.
+bool gcode_stream_next(gcode_stream *s, segments *t, size_t bytes,
+                       int nthreads);
+
+void gcode_stream_free(gcode_stream *s);
+
+/// what gcode_reparse() changed
+/// Segments [from, old_to) of the old table were replaced by [from, to) and
+/// the ones after it moved along by to - old_to. Values from dirty on are
+/// the same as before, only their index may have changed.
+typedef struct {
+  size_t from, old_to, to, dirty;
+} gcode_splice;
+
+/// update t, parsed from the old text o..oend, for the new text b..e
+/// The common prefix and suffix of the two texts aren't parsed again: the
+/// changed lines in between are parsed starting from the state the prefix
+/// left, and the suffix segments are kept, shifted along relative axes when
+/// the edit moved where they start. Unless removed is NULL, it gets the old
+/// segments [from, old_to).
+gcode_splice gcode_reparse(segments *t, char *o, char *oend, char *b, char *e,
+                           segments *removed, int nthreads);
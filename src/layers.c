@@ -0,0 +1,265 @@
+#include "layers.h"
+#include "arc.h"
+#include "raymath.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void layers_free(layers *ls) {
+  free(ls->l);
+  memset(ls, 0, sizeof(*ls));
+}
+
+static layer *push(layers *ls, size_t from, float z) {
+  if (ls->n == ls->cap) {
+    ls->cap = ls->cap ? 2 * ls->cap : 256;
+    ls->l = realloc(ls->l, ls->cap * sizeof(layer));
+    if (!ls->l) {
+      fprintf(stderr, "out of memory for %zu layers\n", ls->cap);
+      exit(-1);
+    }
+  }
+  layer *l = &ls->l[ls->n++];
+  *l = (layer){.from = from, .z = z};
+  return l;
+}
+
+// index the layers of t from segment start on, which starts layer ls->n
+// Once a layer starts at sync or later where one of old[0..nold) started,
+// moved along by shift, the rest are those. Returns the first of them, or
+// ls->n.
+static size_t scan(layers *ls, const segments *t, size_t start, size_t sync,
+                   const layer *old, size_t nold, size_t shift) {
+  if (start >= t->n)
+    return ls->n;
+  // one pass: a layer ends after its last extrusion, and what follows goes
+  // to the next one
+  layer *l = push(ls, start, t->z1[start]);
+  bool extruded = false;
+  size_t last = start, m = 0; // after the last extrusion of l
+  for (size_t i = start; i < t->n; i++) {
+    if (!segments_extrudes(t, i))
+      continue;
+    float z = t->z1[i];
+    if (extruded && fabsf(z - l->z) > LAYERS_EPS) {
+      l->to = last;
+      if (last >= sync) {
+        for (; m < nold && old[m].from + shift < last; m++)
+          ;
+        if (m < nold && old[m].from + shift == last) {
+          size_t first = ls->n;
+          for (; m < nold; m++) {
+            l = push(ls, old[m].from + shift, old[m].z);
+            l->to = old[m].to + shift;
+            l->box = old[m].box;
+          }
+          return first;
+        }
+      }
+      l = push(ls, last, z);
+    }
+    l->z = z;
+    extruded = true;
+    last = i + 1;
+  }
+  l->to = t->n;
+  return ls->n;
+}
+
+void layers_build(layers *ls, const segments *t) {
+  ls->n = 0;
+  scan(ls, t, 0, 0, NULL, 0, 0);
+  for (size_t k = 0; k < ls->n; k++)
+    ls->l[k].box = layers_box(t, ls->l[k].from, ls->l[k].to);
+}
+
+void layers_splice(layers *ls, const segments *t, size_t from, size_t old_to,
+                   size_t to, size_t dirty) {
+  // the edit can join its layer to the one before, so that one is redone
+  // too; where it starts doesn't depend on anything after it
+  size_t k = layers_find(ls, from);
+  if (k == ls->n && k)
+    k--; // appended to the last layer
+  k = k ? k - 1 : 0;
+  size_t nold = ls->n > k ? ls->n - k - 1 : 0;
+  layer *old = malloc(nold * sizeof(layer) + 1);
+  if (!old) {
+    fprintf(stderr, "out of memory for %zu layers\n", nold);
+    exit(-1);
+  }
+  memcpy(old, ls->l + k + 1, nold * sizeof(layer));
+  size_t start = k < ls->n ? ls->l[k].from : 0;
+  ls->n = k;
+  size_t end = scan(ls, t, start, dirty > to ? dirty : to, old, nold,
+                    to - old_to);
+  for (; k < end; k++)
+    ls->l[k].box = layers_box(t, ls->l[k].from, ls->l[k].to);
+  free(old);
+}
+
+BoundingBox layers_box(const segments *t, size_t from, size_t to) {
+  // a column at a time, which compilers vectorize
+  const float *cols[2][3] = {{t->x0, t->y0, t->z0}, {t->x1, t->y1, t->z1}};
+  float lo[3], hi[3];
+  for (int a = 0; a < 3; a++) {
+    lo[a] = INFINITY;
+    hi[a] = -INFINITY;
+    for (int e = 0; e < 2; e++)
+      for (size_t i = from; i < to; i++) {
+        float v = cols[e][a][i];
+        lo[a] = v < lo[a] ? v : lo[a];
+        hi[a] = v > hi[a] ? v : hi[a];
+      }
+  }
+  BoundingBox box = {{lo[0], lo[1], lo[2]}, {hi[0], hi[1], hi[2]}};
+  // arcs can bulge past their ends
+  for (size_t i = from; i < to; i++)
+    if (segments_arc(t, i)) {
+      BoundingBox b = arc_box(t, i);
+      box.min = Vector3Min(box.min, b.min);
+      box.max = Vector3Max(box.max, b.max);
+    }
+  return box;
+}
+
+size_t layers_find(const layers *ls, size_t i) {
+  size_t lo = 0, hi = ls->n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ls->l[mid].to <= i)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+bool layers_box_visible(Matrix mvp, BoundingBox b) {
+  // corners in clip space, then out if they're all past the same plane
+  int outside[6] = {0};
+  for (int c = 0; c < 8; c++) {
+    Vector3 p = {c & 1 ? b.max.x : b.min.x, c & 2 ? b.max.y : b.min.y,
+                 c & 4 ? b.max.z : b.min.z};
+    // like Vector3Transform(), but keeping w
+    float x = mvp.m0 * p.x + mvp.m4 * p.y + mvp.m8 * p.z + mvp.m12,
+          y = mvp.m1 * p.x + mvp.m5 * p.y + mvp.m9 * p.z + mvp.m13,
+          z = mvp.m2 * p.x + mvp.m6 * p.y + mvp.m10 * p.z + mvp.m14,
+          w = mvp.m3 * p.x + mvp.m7 * p.y + mvp.m11 * p.z + mvp.m15;
+    outside[0] += x < -w;
+    outside[1] += x > w;
+    outside[2] += y < -w;
+    outside[3] += y > w;
+    outside[4] += z < -w;
+    outside[5] += z > w;
+  }
+  for (int k = 0; k < 6; k++)
+    if (outside[k] == 8)
+      return false;
+  return true;
+}
+
+#ifdef TESTING
+#include <assert.h>
+
+int main() {
+  // three layers with a z hop in the middle one and travel between them
+  segments t;
+  segments_init(&t);
+  Vector4 p = {0, 0, 0.2f, 0};
+  for (int k = 0; k < 3; k++) {
+    float z = 0.2f * (k + 1);
+    Vector4 q = {0, 0, z, p.w};
+    segments_push(&t, p, q, 0, 0, 0); // up to the layer
+    p = q;
+    for (int i = 0; i < 10; i++) {
+      q = (Vector4){i, k, z, p.w + 1};
+      segments_push(&t, p, q, 1, 0, 0);
+      p = q;
+      if (k == 1 && i == 5) {
+        // hop over something
+        q.z += 0.4f;
+        segments_push(&t, p, q, 0, 0, 0);
+        p = q;
+        q.z = z;
+        segments_push(&t, p, q, 0, 0, 0);
+        p = q;
+      }
+    }
+    q = (Vector4){20, 20, z, p.w};
+    segments_push(&t, p, q, 0, 0, 0); // travel away
+    p = q;
+  }
+  // and a circle around the end of the last one
+  segments_push(&t, p, (Vector4){p.x, p.y, p.z, p.w + 1}, 3, 0, 0);
+  t.ai[t.n - 1] = -15;
+
+  layers ls = {0};
+  layers_build(&ls, &t);
+  assert(ls.n == 3);
+  assert(ls.l[0].from == 0 && ls.l[0].to == 11);
+  assert(ls.l[1].from == 11 && ls.l[1].to == 25);
+  assert(ls.l[2].from == 25 && ls.l[2].to == t.n);
+  for (size_t k = 0; k < ls.n; k++) {
+    assert(fabsf(ls.l[k].z - 0.2f * (k + 1)) < 1e-6f);
+    for (size_t i = ls.l[k].from; i < ls.l[k].to; i++) {
+      assert(layers_find(&ls, i) == k);
+      assert(t.x1[i] >= ls.l[k].box.min.x && t.x1[i] <= ls.l[k].box.max.x);
+      assert(t.z0[i] >= ls.l[k].box.min.z && t.z1[i] <= ls.l[k].box.max.z);
+    }
+  }
+  assert(layers_find(&ls, t.n) == ls.n);
+  assert(ls.l[1].box.max.z > 0.79f); // the hop
+  assert(ls.l[2].box.min.x < -9.9f && ls.l[2].box.max.y > 34.9f);
+
+  // a camera looking down at the origin sees a box there, not one behind it
+  Camera3D c = {{0, 0, 10}, {0, 0, 0}, {0, 1, 0}, 45, CAMERA_PERSPECTIVE};
+  Matrix mvp = MatrixMultiply(MatrixLookAt(c.position, c.target, c.up),
+                              MatrixPerspective(45 * DEG2RAD, 1, 0.01, 1000));
+  assert(layers_box_visible(mvp, (BoundingBox){{-1, -1, -1}, {1, 1, 1}}));
+  assert(!layers_box_visible(mvp, (BoundingBox){{-1, -1, 20}, {1, 1, 30}}));
+  assert(!layers_box_visible(mvp, (BoundingBox){{50, -1, -1}, {60, 1, 1}}));
+  // big enough to have every corner outside but still cross the view
+  assert(layers_box_visible(mvp, (BoundingBox){{-90, -90, -1}, {90, 90, 1}}));
+
+  // edits anywhere, some moving whole layers around, index the same as
+  // starting over, and so does appending
+  segments u, ins;
+  segments_init(&u);
+  segments_init(&ins);
+  p = (Vector4){0, 0, 0, 0};
+  for (int i = 0; i < 3000; i++) {
+    Vector4 q = {i % 17, i % 5, 0.2f * (i / 100 + 1), p.w + (i % 7 ? 1 : 0)};
+    segments_push(&u, p, q, 1, 0, 0);
+    p = q;
+  }
+  layers_build(&ls, &u);
+  layers want = {0};
+  srand(3);
+  for (int k = 0; k < 200; k++) {
+    size_t from = k % 10 ? rand() % (u.n + 1) : u.n, nold = rand() % 150;
+    nold = from + nold > u.n ? u.n - from : nold;
+    size_t src = rand() % u.n, nins = rand() % 150;
+    nins = src + nins > u.n ? u.n - src : nins;
+    segments_copy(&ins, &u, src, nins);
+    segments_splice(&u, from, nold, &ins);
+    layers_splice(&ls, &u, from, from + nold, from + nins, from + nins);
+    layers_build(&want, &u);
+    assert(ls.n == want.n);
+    for (size_t l = 0; l < ls.n; l++)
+      assert(ls.l[l].from == want.l[l].from && ls.l[l].to == want.l[l].to &&
+             ls.l[l].z == want.l[l].z &&
+             0 == memcmp(&ls.l[l].box, &want.l[l].box, sizeof(BoundingBox)));
+  }
+  layers_free(&want);
+  segments_free(&u);
+  segments_free(&ins);
+
+  // nothing
+  segments_free(&t);
+  layers_build(&ls, &t);
+  assert(ls.n == 0 && layers_find(&ls, 0) == 0);
+  layers_free(&ls);
+  printf("ok\n");
+}
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+#include "raylib.h"
+#include "segments.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/// a layer: segments [from, to), extruding at height z
+/// The travel and z moves leading up to a layer's first extrusion belong to
+/// it, so the layers cover every segment in file order.
+typedef struct {
+  size_t from, to;
+  float z;
+  BoundingBox box;
+} layer;
+
+typedef struct {
+  size_t n, cap;
+  layer *l;
+} layers;
+
+/// index the layers of t, replacing what was in ls
+/// A new layer starts at an extrusion more than LAYERS_EPS away from the
+/// height of the current one, so z hops stay in their layer.
+void layers_build(layers *ls, const segments *t);
+
+#define LAYERS_EPS 1e-3f
+
+/// update ls after segments [from, old_to) of t were replaced by [from, to),
+/// and the ones after moved along by to - old_to, keeping their values from
+/// dirty on
+/// Only the layers from the one before the edit up to the first layer past
+/// dirty that starts where one did before are indexed again; the rest are
+/// moved along.
+void layers_splice(layers *ls, const segments *t, size_t from, size_t old_to,
+                   size_t to, size_t dirty);
+
+/// the box around segments [from, to) of t, arcs included
+BoundingBox layers_box(const segments *t, size_t from, size_t to);
+
+void layers_free(layers *ls);
+
+/// the layer segment i is in, or ls->n past the end
+size_t layers_find(const layers *ls, size_t i);
+
+/// whether any of b can be on screen for mvp, the model view projection
+/// Boxes entirely beyond one side of the view volume are culled.
+bool layers_box_visible(Matrix mvp, BoundingBox b);
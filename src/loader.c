@@ -0,0 +1,284 @@
+#include "loader.h"
+#include "cache.h"
+#include "gcode.h"
+#include "prof.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// pieces go around a ring with one writer, the loader thread, and one
+// reader: slots [tail, head) are full. Each side only moves its own end, so
+// publishing a piece is a release store and taking it an acquire load.
+static loader_piece ring[LOADER_SLOTS];
+static atomic_size_t head, tail;
+static atomic_bool stopping;
+
+static struct {
+  char *file, *text;
+  struct stat st;
+  bool use_cache, pack;
+  void (*ready)(void);
+  struct timespec t0;
+} job;
+static pthread_t loader;
+static bool running, busy;
+
+static uint64_t since_start() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (t.tv_sec - job.t0.tv_sec) * 1000000000ull + t.tv_nsec -
+         job.t0.tv_nsec;
+}
+
+// false when stopped instead, and p is still the caller's
+static bool put(loader_piece *p) {
+  size_t h = atomic_load_explicit(&head, memory_order_relaxed);
+  while (h - atomic_load_explicit(&tail, memory_order_acquire) ==
+         LOADER_SLOTS) {
+    if (atomic_load(&stopping))
+      return false;
+    usleep(1000);
+  }
+  p->ns = since_start();
+  ring[h % LOADER_SLOTS] = *p;
+  atomic_store_explicit(&head, h + 1, memory_order_release);
+  if (job.ready)
+    job.ready();
+  return true;
+}
+
+// the piece wasn't taken
+static void drop(loader_piece *p) {
+  segments_free(&p->t);
+  bvh_free(&p->tree);
+  ooc_layers_free(p->layers, p->nlayers);
+  free(p->layers);
+}
+
+// let go of the pages of text before end, which the parse is past
+static void forget(char **done, char *end) {
+  long page = sysconf(_SC_PAGESIZE);
+  end = job.text + (end - job.text) / page * page;
+  if (end > *done) {
+    madvise(*done, end - *done, MADV_DONTNEED);
+    *done = end;
+  }
+}
+
+static void *load(void *unused) {
+  prof_thread_name("loader");
+  loader_piece p = {.cached = true, .last = true, .bytes = job.st.st_size};
+  segments_init(&p.t);
+  if (!job.pack && job.use_cache &&
+      cache_load(job.file, &job.st, job.text, &p.t, &p.tree, &p.ps)) {
+    if (!put(&p))
+      drop(&p);
+    return NULL;
+  }
+
+  gcode_stream s;
+  gcode_stream_init(&s, job.text, job.text + job.st.st_size);
+  size_t window = LOADER_FIRST_WINDOW;
+  size_t max = job.pack ? OOC_WINDOW : LOADER_MAX_WINDOW;
+  // read once, front to back
+  ooc_packer k;
+  ooc_packer_init(&k);
+  char *done = job.text;
+  if (job.pack && job.st.st_size)
+    madvise(job.text, job.st.st_size, MADV_SEQUENTIAL);
+  do {
+    p = (loader_piece){0};
+    segments_init(&p.t);
+    {
+      PROF_SCOPE("parse");
+      gcode_stream_next(&s, &p.t, window, 0);
+    }
+    p.ps = stats_of(&s.sketch);
+    p.bytes = s.c - job.text;
+    p.last = s.c == s.e;
+    if (job.pack) {
+      PROF_SCOPE("pack");
+      p.nlayers = ooc_pack(&k, &p.t, p.last, &p.layers);
+      segments_free(&p.t);
+      forget(&done, s.c);
+    }
+    if (!put(&p)) {
+      drop(&p);
+      break;
+    }
+    if (window < max)
+      window *= 2;
+  } while (!p.last);
+  ooc_packer_free(&k);
+  gcode_stream_free(&s);
+  return NULL;
+}
+
+void loader_start(const char *file, const struct stat *st, char *text,
+                  bool use_cache, bool pack, void (*ready)(void)) {
+  loader_stop();
+  free(job.file);
+  job.file = strdup(file);
+  job.text = text;
+  job.st = *st;
+  job.use_cache = use_cache;
+  job.pack = pack;
+  job.ready = ready;
+  clock_gettime(CLOCK_MONOTONIC, &job.t0);
+  busy = true;
+  running = 0 == pthread_create(&loader, NULL, load, NULL);
+  if (!running)
+    load(NULL);
+}
+
+bool loader_take(loader_piece *p, bool wait) {
+  size_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+  while (busy && t == atomic_load_explicit(&head, memory_order_acquire)) {
+    if (!wait)
+      return false;
+    usleep(1000);
+  }
+  if (!busy)
+    return false;
+  *p = ring[t % LOADER_SLOTS];
+  atomic_store_explicit(&tail, t + 1, memory_order_release);
+  busy = !p->last;
+  return true;
+}
+
+bool loader_busy() { return busy; }
+
+void loader_stop() {
+  atomic_store(&stopping, true);
+  if (running)
+    pthread_join(loader, NULL);
+  running = false;
+  atomic_store(&stopping, false);
+  loader_piece p;
+  while (loader_take(&p, false))
+    drop(&p);
+  busy = false;
+}
+
+#ifdef TESTING
+#include "synth.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+static bool same(const segments *a, const segments *b) {
+  return a->n == b->n && 0 == memcmp(a->x0, b->x0, a->n * 4) &&
+         0 == memcmp(a->e1, b->e1, a->n * 4) &&
+         0 == memcmp(a->aj, b->aj, a->n * 4) &&
+         0 == memcmp(a->axes, b->axes, a->n) &&
+         0 == memcmp(a->line, b->line, a->n * sizeof(size_t));
+}
+
+static atomic_int readies;
+static void ready() { atomic_fetch_add(&readies, 1); }
+
+int main() {
+  const char *file = "test_loader.gcode";
+  synth_opts o = SYNTH_DEFAULTS;
+  o.arcs = 10;
+  size_t len;
+  char *text = synth_gcode(&o, &len);
+  FILE *h = fopen(file, "w");
+  fwrite(text, 1, len, h);
+  fclose(h);
+  struct stat st;
+  stat(file, &st);
+  unlink("test_loader.gcode.gcv");
+
+  segments one, all;
+  segments_init(&one);
+  segments_init(&all);
+  stats ps;
+  gcode_parse(&one, text, text + len, &ps, 0);
+
+  // the pieces put together are the whole file, getting bigger, with the
+  // stats of the whole file at the end
+  loader_start(file, &st, text, true, false, ready);
+  assert(loader_busy());
+  loader_piece p;
+  size_t pieces = 0, bytes = 0;
+  while (loader_take(&p, true)) {
+    assert(!p.cached && p.bytes > bytes && p.last == (p.bytes == len));
+    assert(p.bytes - bytes >= LOADER_FIRST_WINDOW || p.last);
+    bytes = p.bytes;
+    segments_splice(&all, all.n, 0, &p.t);
+    segments_free(&p.t);
+    pieces++;
+  }
+  assert(!loader_busy() && bytes == len && pieces > 3);
+  assert(atomic_load(&readies) == (int)pieces);
+  assert(same(&one, &all));
+  assert(p.ps.n == ps.n && 0 == memcmp(&p.ps.min, &ps.min, sizeof(Vector4)) &&
+         0 == memcmp(&p.ps.max, &ps.max, sizeof(Vector4)) &&
+         0 == memcmp(&p.ps.center, &ps.center, sizeof(Vector4)));
+
+  // stopping part way leaves nothing behind
+  loader_start(file, &st, text, false, false, NULL);
+  assert(loader_take(&p, true) && !p.last);
+  segments_free(&p.t);
+  loader_stop();
+  assert(!loader_busy() && !loader_take(&p, true));
+
+  // with a cache, the whole file is one piece
+  bvh b = {0};
+  bvh_build(&b, &one);
+  cache_save(file, &st, text, &one, &b, &ps);
+  cache_wait();
+  loader_start(file, &st, text, true, false, NULL);
+  assert(loader_take(&p, true) && p.cached && p.last && p.bytes == len);
+  assert(same(&one, &p.t) && p.tree.n == one.n);
+  assert(!loader_take(&p, false));
+  segments_free(&p.t);
+  bvh_free(&p.tree);
+
+  // packed, the layers are those of the whole file, and the cache is
+  // neither read nor written
+  int fd = open(file, O_RDONLY);
+  char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  loader_start(file, &st, map, true, true, NULL);
+  ooc big;
+  ooc_init(&big, 0);
+  while (loader_take(&p, true)) {
+    assert(!p.cached && p.t.n == 0);
+    ooc_add(&big, p.layers, p.nlayers);
+    free(p.layers);
+  }
+  layers ls = {0};
+  layers_build(&ls, &all);
+  assert(big.n == ls.n && big.segments == all.n);
+  for (size_t k = 0; k < ls.n; k++)
+    assert(big.l[k].l.from == ls.l[k].from && big.l[k].l.to == ls.l[k].to);
+  ooc_get(0, all.n, &one, &big);
+  assert(same(&one, &all));
+  // what was dropped comes back from the file
+  assert(0 == memcmp(map, text, len));
+  ooc_free(&big);
+  layers_free(&ls);
+
+  // stopped, the layers not taken are freed
+  loader_start(file, &st, map, false, true, NULL);
+  assert(loader_take(&p, true));
+  ooc_layers_free(p.layers, p.nlayers);
+  free(p.layers);
+  loader_stop();
+  munmap(map, len);
+
+  unlink(file);
+  unlink("test_loader.gcode.gcv");
+  segments_free(&one);
+  segments_free(&all);
+  bvh_free(&b);
+  free(text);
+  printf("ok\n");
+}
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+#include "bvh.h"
+#include "ooc.h"
+#include "segments.h"
+#include "stats.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/// bytes of text in the first piece, few enough to show up within a frame
+#define LOADER_FIRST_WINDOW (256 << 10)
+/// every piece after that is twice as big, up to this, or OOC_WINDOW when
+/// packing
+#define LOADER_MAX_WINDOW (64 << 20)
+/// pieces parsed and not yet taken before the loader waits
+#define LOADER_SLOTS 16
+
+/// a stretch of the file, parsed in the background
+typedef struct {
+  segments t;        // the segments that follow those of the pieces before
+  bvh tree;          // over t when cached, otherwise empty
+  ooc_layer *layers; // when packing, t is empty and these are finished
+  size_t nlayers;
+  stats ps;     // of every segment so far
+  bool cached;  // t and tree are the cache of the whole file
+  bool last;    // nothing follows
+  size_t bytes; // of the text parsed so far
+  uint64_t ns;  // since loader_start()
+} loader_piece;
+
+/// parse text..text + st->st_size, the contents of file, on a thread,
+/// handing it over a piece at a time, or as one piece from the cache when
+/// use_cache and it is good. ready() is called from that thread after each
+/// piece, unless it is NULL. text must stay mapped until the last piece is
+/// taken or loader_stop(). One load at a time.
+/// With pack, for a file too big to hold as segments, the cache is skipped
+/// and the pieces have packed layers instead. text must then be a mapping
+/// of file, since the pages parsed are dropped as it goes, to be read
+/// again from the file should anything look at them.
+void loader_start(const char *file, const struct stat *st, char *text,
+                  bool use_cache, bool pack, void (*ready)(void));
+
+/// move the next piece into p, waiting for it when wait
+/// Returns false, changing nothing, when there is none yet or the load is
+/// over. The caller frees p->t, p->tree and p->layers, after handing their
+/// packed segments to ooc_add() or freeing them.
+bool loader_take(loader_piece *p, bool wait);
+
+/// true from loader_start() until the last piece is taken
+bool loader_busy();
+
+/// stop loading and drop the pieces not taken
+void loader_stop();
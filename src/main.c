@@ -1,6 +1,8 @@
 #include "raylib.h"
 #include "raymath.h"
+#include "rlgl.h"
 #include <fcntl.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,262 +11,158 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include "segdistance.h"
+#include "arc.h"
+#include "batch.h"
+#include "bvh.h"
+#include "cache.h"
+#include "csv.h"
+#include "diff.h"
+#include "gcode.h"
+#include "layers.h"
+#include "loader.h"
+#include "ooc.h"
+#include "prof.h"
+#include "remap.h"
+#include "render.h"
+#include "segments.h"
 #include "selected.h"
+#include "watch.h"
 
 // maximum output csv filename length
 #define NFILENAME 200
+// points of a lasso, a few pixels apart
+#define NLASSO 1024
+// more selected segments in view than this are drawn as lines, not capsules
+#define SELECTED_CAPSULES 5000
 
 Vector3 Vector4To3(Vector4 a) { return (Vector3){a.x, a.y, a.z}; }
 
-/// get the area between segment p0-p1 and segment q0-q1
-double SegmentDistance(Vector3 p0, Vector3 p1, Vector3 q0, Vector3 q1) {
-  // d = p0-q0
-  // dd = (p1-p0) - (q1-q0)
-  Vector3 d = Vector3Subtract(p0, q0), dp = Vector3Subtract(p1, p0),
-          dq = Vector3Subtract(q1, q0), dd = Vector3Subtract(dp, dq);
-  Quaternion q = QuaternionFromVector3ToVector3(dd, (Vector3){1, 0, 0});
-  Vector3 acd = Vector3RotateByQuaternion(d, q);
-  return f1(acd.x, Vector3Length(dd), acd.y, acd.z);
-}
-
-double SegmentDistance4(Vector4 ps[2], Vector4 qs[2]) {
-  return SegmentDistance(Vector4To3(ps[0]), Vector4To3(ps[1]),
-                         Vector4To3(qs[0]), Vector4To3(qs[1]));
-}
-
-char *c, *cend, *c0;
-
-Vector4 ps[2];
-
-bool rel[4]; // X,Y,Z,E relative flags
-
-static inline int isspace_ascii(char ch) {
-  return ch == ' ' || ch == '\t' || ch == '\r';
+// segs is the parsed current file
+// segs_old has the segments a reload replaced while selected_refresh() runs
+segments segs, segs_old;
+// what the last reload changed
+gcode_splice reloaded;
+// spatial index over segs for picking
+bvh tree;
+// where each layer of segs starts and ends
+layers lays;
+// only layers [view_lo, view_hi) are drawn, picked and saved to csv
+bool layer_view;
+size_t view_lo, view_hi;
+
+// out of core, every layer is kept packed in big and segs only has those of
+// layers [big.lo, big.hi), which are segments seg_base.. of the file
+// lays then has the outlines of every layer and res_lays those in segs,
+// counting from its start. Selected segments are still counted in the file.
+bool out_of_core;
+ooc big;
+size_t seg_base;
+layers res_lays;
+// bytes of the packed layers
+size_t packed_total;
+
+// set when the selection, segs or the layers in view changed, for
+// show_selection() before the next frame
+bool selection_changed = true;
+// the selected segments in view, counted in segs, when there are few enough
+// to draw as capsules
+size_t capsules[SELECTED_CAPSULES], ncapsules;
+
+// the segments of the file, resident or not
+size_t file_segments() { return out_of_core ? big.segments : segs.n; }
+
+// the segments of the layers in view
+void view_segments(size_t *from, size_t *to) {
+  if (!layer_view || !lays.n) {
+    *from = 0;
+    *to = file_segments();
+    return;
+  }
+  *from = lays.l[view_lo].from;
+  *to = lays.l[view_hi - 1].to;
 }
 
-void advance_ps_reset() {
-  c = c0;
-  ps[1] = (Vector4){0, 0, 0, 0};
-  for (int i = 0; i < 4; i++)
-    rel[i] = 0;
+// the segments of the layers in view that are in segs, counted in segs
+void resident_segments(size_t *from, size_t *to) {
+  view_segments(from, to);
+  size_t lo = seg_base, hi = seg_base + segs.n;
+  *from = *from < lo ? 0 : *from > hi ? segs.n : *from - lo;
+  *to = *to < lo ? 0 : *to > hi ? segs.n : *to - lo;
 }
 
-bool advance_ps() {
-  ps[0] = ps[1];
-
-  if (c >= cend)
-    return false;
-
-  while (c < cend) {
-    if (*c == '\n' || c == c0) {
-      char *q = (c == c0) ? c : c + 1;
-
-      // find end of line
-      char *line_end = q;
-      while (line_end < cend && *line_end != '\n')
-        ++line_end;
-
-      // semicolon is the comment or end of line
-      char *semicolon = q;
-      while (semicolon < cend && *semicolon != '\n' && *semicolon != ';')
-        ++semicolon;
-
-      // command at start of line?
-      if (q < semicolon && (q[0] == 'G' || q[0] == 'M')) {
-        char cmd = q[0];
-        char *num_end;
-        double gval_d = strtod(q + 1, &num_end);
-        if (num_end != (q + 1)) {
-          int gval = (int)gval_d;
-
-          if (cmd == 'G') {
-            switch (gval) {
-              // clang-format off
-              case 90: // G90: all absolute
-                rel[0] = rel[1] = rel[2] = rel[3] = false;
-                c = line_end;
-                continue;
-              case 91: // G91: all relative
-                rel[0] = rel[1] = rel[2] = rel[3] = true;
-                c = line_end;
-                continue;
-            case 0: case 1: { // G0 move G1: extrude move
-              // clang-format on
-              ps[1] = ps[0];
-
-              char *s = num_end; // after the numeric part of "G1"
-              while (s < semicolon) {
-                while (s < semicolon && isspace_ascii(*s))
-                  ++s;
-                if (s >= semicolon)
-                  break;
-
-                char axis = *s;
-                if (axis == 'X' || axis == 'Y' || axis == 'Z' || axis == 'E') {
-                  char *num_start = s + 1;
-                  char *num_end_f;
-                  float f = strtof(num_start, &num_end_f);
-                  if (num_end_f != num_start) {
-                    // clang-format off
-                      switch (axis) {
-                        case 'X': ps[1].x = rel[0] ? ps[0].x + f : f; break;
-                        case 'Y': ps[1].y = rel[1] ? ps[0].y + f : f; break;
-                        case 'Z': ps[1].z = rel[2] ? ps[0].z + f : f; break;
-                        case 'E': ps[1].w = rel[3] ? ps[0].w + f : f; break;
-                      }
-                    // clang-format on
-                    s = num_end_f;
-                    continue;
-                  }
-                }
-                // skip unknown token
-                while (s < semicolon && !isspace_ascii(*s))
-                  ++s;
-              }
-
-              c = line_end; // advance cursor to end of parsed line
-              return true;
-            }
-            default:
-              break;
-            }
-          } else if (cmd == 'M') {
-            switch (gval) {
-            case 82: // M82: E absolute
-              rel[3] = false;
-              c = line_end;
-              continue;
-            case 83: // M83: E relative
-              rel[3] = true;
-              c = line_end;
-              continue;
-            default:
-              break;
-            }
-          }
-        }
-      }
-
-      // not a recognized command; skip line
-      c = line_end;
-      continue;
+// out of core, the layers are those packed so far
+static void copy_layers(layers *ls, size_t lo, size_t hi, size_t base) {
+  if (ls->cap < hi - lo) {
+    ls->cap = 2 * (hi - lo) + 256;
+    ls->l = realloc(ls->l, ls->cap * sizeof(layer));
+    if (!ls->l) {
+      fprintf(stderr, "out of memory for %zu layers\n", ls->cap);
+      exit(-1);
     }
-    ++c;
   }
-  c = cend; // no more commands
-  return false;
-}
-
-Vector4 ps_max, ps_min, ps_avg, ps_trim;
-#define NTRIM 200
-static float sorting[NTRIM];
-static float trimmed_avg(size_t off) {
-  advance_ps_reset();
-  int n = 0;
-  float sum = 0;
-  for (n = 0; n < NTRIM && advance_ps(); n++) {
-
-#define FIELDF(p, off) (*(float *)((char *)(p) + (off)))
-
-    float v = FIELDF(&ps[1], off);
-    int j = n;
-    for (; j > 0 && sorting[j - 1] > v; j--) {
-      sorting[j] = sorting[j - 1];
-    }
-    sorting[j] = v;
+  for (size_t k = lo; k < hi; k++) {
+    ls->l[k - lo] = big.l[k].l;
+    ls->l[k - lo].from -= base;
+    ls->l[k - lo].to -= base;
   }
+  ls->n = hi - lo;
+}
 
-  n = 0;
-  while (advance_ps()) {
-    float v = FIELDF(&ps[1], off);
-    float a = sorting[NTRIM / 2 - 1];
-    float b = sorting[NTRIM / 2];
-    if (v >= a && v <= b) {
-      // no need to shift
-      sum += v;
-      n++;
-    }
-    if (v < a) {
-      // shift left inserting v
-      int j = 1;
-      for (; j < NTRIM && sorting[j] < v; j++) {
-        sorting[j - 1] = sorting[j];
-      }
-      sorting[j] = v;
-    }
-    if (v > b) {
-      // shift right inserting v
-      int j = NTRIM;
-      for (; j > 0 && sorting[j] > v; j--) {
-        sorting[j] = sorting[j - 1];
-      }
-      sorting[j - 1] = v;
-    }
-  }
-  return sum / n;
+// index the layers again after segs changed as sp says, keeping the view
+// inside them
+void reindex_layers(gcode_splice sp) {
+  PROF_SCOPE("layers");
+  if (out_of_core)
+    copy_layers(&lays, 0, big.n, 0);
+  else
+    layers_splice(&lays, &segs, sp.from, sp.old_to, sp.to, sp.dirty);
+  if (view_hi > lays.n)
+    view_hi = lays.n;
+  if (view_lo + 1 > view_hi)
+    view_lo = view_hi ? view_hi - 1 : 0;
+  layer_view &= lays.n > 0;
 }
 
-void gcode_bbox() {
-  c = c0;
-  int n = 0;
-  size_t o[4] = {offsetof(Vector4, x), offsetof(Vector4, y),
-                 offsetof(Vector4, z), offsetof(Vector4, w)};
-
-  advance_ps_reset();
-  while (advance_ps()) {
-    ps_max = Vector4Max(ps_max, ps[1]);
-    ps_min = Vector4Min(ps_min, ps[1]);
-    ps_avg = Vector4Add(ps_avg, ps[1]);
-    n++;
-  }
-  ps_avg = Vector4Divide(ps_avg, (Vector4){n, n, n, n});
+// where the toolpath is, for placing the camera
+stats ps;
 
-  for (int i = 0; i < 4; i++)
-    FIELDF(&ps_trim, o[i]) = trimmed_avg(o[i]);
-}
+// in diff mode, base is the file as it was when it started, or the first
+// file of --diff, and changes has how segs differs from it, unless still
+// comparing
+bool diffing, comparing;
+segments base;
+layers base_lays;
+diff changes;
 
-// is this the operation that'll make me give up on advance_ps
-// and instead allocate a buffer of floats with the points that's easier to
-// random access?
-Vector4 qs[2];
-bool sel[4];
-char *d, *d0, *dend;
-void swapcd() {
-  for (size_t i = 0; i < 2; ++i) {
-    Vector4 tmp = qs[i];
-    qs[i] = ps[i];
-    ps[i] = tmp;
-  }
-  for (size_t i = 0; i < 4; ++i) {
-    bool tmpb = sel[i];
-    sel[i] = rel[i];
-    rel[i] = tmpb;
+// parse file into base, on every core
+bool load_base(char *file) {
+  int fd = open(file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    if (fd >= 0)
+      close(fd);
+    return false;
   }
-  char *t0 = c0;
-  c0 = d0;
-  d0 = t0;
-  char *te = cend;
-  cend = dend;
-  dend = te;
-}
-bool advance_qs() {
-  swapcd();
-  bool r = advance_ps();
-  swapcd();
-  return r;
-};
-void advance_qs_reset() {
-  d = d0;
-  qs[1] = (Vector4){0, 0, 0, 0};
-  for (int i = 0; i < 4; i++)
-    sel[i] = 0;
+  char *text = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                 fd, 0)
+                          : NULL;
+  close(fd);
+  if (text == MAP_FAILED)
+    return false;
+  stats unused;
+  gcode_parse(&base, text, text + st.st_size, &unused, 0);
+  if (text)
+    munmap(text, st.st_size);
+  layers_build(&base_lays, &base);
+  return true;
 }
 
-// the old gcode file is d, d0, dend, qs, advance_qs()
-// the new gcode file is c, c0, cend, ps, advance_ps()
-// try to update selected[] so that the new indexes
+// the old gcode file is segs_old
+// the new gcode file is segs
+// try to update the selection so that the new indexes
 // are as close as possible
+// Segments outside the reparsed stretch only changed their index, the others
+// go to the closest new segment nobody else has.
 // TODO: lines can break apart or combine
 // SegmentDistance can't take polylines
 // I need a different distance calculation which
@@ -273,56 +171,139 @@ void advance_qs_reset() {
 // In other words the result of a single call to
 // SegmentDistance4Growable() will be like
 // an intersection of intervals.
-// TODO ps and qs sequences are usually sorted
-// by z so there's no need to look far
-void selected_refresh() {
-  advance_qs_reset();
-  int i = 0;
-  while (advance_qs()) {
-    int j = selected_index(i);
-    if (j != SELECTED_EMPTY) {
-      double dmin = INFINITY;
-      int k = 0, kmin = 0;
-      advance_ps_reset();
-      while (advance_ps()) {
-        double d = SegmentDistance4(ps, qs);
-        if (d < dmin) {
-          // XXX k not already taken but how do I check?
-          // selected[] has old and new mixed up
-          kmin = k;
-        }
-        k++;
-      }
-      selected[j] = kmin;
+void selected_refresh(gcode_splice sp) {
+  PROF_SCOPE("selected_refresh");
+  size_t n = selected_end(), nmoved = 0, nrows = 0;
+  size_t *moved = malloc(n * sizeof(size_t) + 1),
+         *rows = malloc(n * sizeof(size_t) + 1),
+         *out = malloc(n * sizeof(size_t) + 1);
+  for (size_t j = 0; j < n; j++) {
+    size_t i = selected_nth(j);
+    if (i == SELECTED_EMPTY)
+      continue;
+    if (i < sp.from || i >= sp.old_to) {
+      moved[nmoved++] = i < sp.from ? i : i - sp.old_to + sp.to;
+    } else {
+      // filled in below
+      rows[nrows++] = i - sp.from;
+      moved[nmoved++] = SELECTED_EMPTY;
     }
-    i++;
   }
+  remap(&segs_old, rows, nrows, &segs, &tree, moved, nmoved, out, 0);
+
+  // old and new indexes would mix if they were replaced in place
+  selected_init();
+  for (size_t j = 0, k = 0; j < nmoved; j++) {
+    size_t i = moved[j] != SELECTED_EMPTY ? moved[j] : out[k++];
+    if (i != REMAP_NONE)
+      selected_add(i);
+  }
+  free(moved);
+  free(rows);
+  free(out);
 }
 
+char *c0, *cend, *d0, *dend;
 struct stat statbuf_old;
+bool use_cache = true;
+// MB/s of the last full parse, or 0 after loading the cache
+double parse_mbs;
+// bytes of the file in segs while the loader is busy
+size_t loaded_bytes;
+
+// GLFW is compiled into a static raylib, and this is safe to call from any
+// thread. A raylib that doesn't export it, like some shared builds, leaves
+// it NULL, and then nothing can wake the loop, so it doesn't sleep.
+// There's nothing to wake before the window is open.
+void glfwPostEmptyEvent(void) __attribute__((weak));
+static atomic_bool window_open;
+static void wake() {
+  if (glfwPostEmptyEvent && atomic_load(&window_open))
+    glfwPostEmptyEvent();
+}
+
+// compare segs with base in the background, once it's all there, and save
+// the differences; the ones shown are of the segments before, so they go
+void update_diff(char *path) {
+  if (!diffing || loader_busy())
+    return;
+  diff_free(&changes);
+  render_diff(&changes, &base, &segs, &lays);
+  comparing = true;
+  diff_start(&base, &base_lays, &segs, &lays, path, wake);
+}
+
+// stop comparing and drop the differences
+void stop_diff() {
+  diff_wait();
+  diff_take(&changes);
+  diff_free(&changes);
+  render_diff(&changes, &base, &segs, &lays);
+  comparing = false;
+}
+
 /// mmap or munmap/mmap the given file,
 /// depending on mtime
 /// store the beginning at c0, end at cend
-/// c = c0
+/// and parse it into segs: the first time on the loader thread, see
+/// take_pieces(), after that here
+/// Out of core, the text is dropped as it's parsed, so there's nothing to
+/// reparse against and a change is loaded again from the start, keeping the
+/// selection as it was.
 bool mmapfile(char *file) {
   // mmap file
   int fd = open(file, O_RDONLY);
   struct stat statbuf;
-  fstat(fd, &statbuf);
+  if (fd < 0 || fstat(fd, &statbuf)) {
+    // between unlink and rename, keep the old version
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
   if (c0) {
+    // a file renamed into place can be older than the one it replaced
     bool newer = (statbuf.st_mtim.tv_sec > statbuf_old.st_mtim.tv_sec) ||
                  (statbuf.st_mtim.tv_sec == statbuf_old.st_mtim.tv_sec &&
-                  statbuf.st_mtim.tv_nsec > statbuf_old.st_mtim.tv_nsec);
-    if (newer) {
-      swapcd();
+                  statbuf.st_mtim.tv_nsec > statbuf_old.st_mtim.tv_nsec) ||
+                 statbuf.st_ino != statbuf_old.st_ino ||
+                 statbuf.st_size != statbuf_old.st_size;
+    if (newer && out_of_core) {
+      // the csv files still being written read big
+      csv_wait();
+      munmap(c0, cend - c0);
+      ooc_free(&big);
+      packed_total = 0;
+      segments_resize(&segs, 0);
+      seg_base = 0;
+      reloaded = (gcode_splice){0};
+      reindex_layers(reloaded);
+      res_lays.n = 0;
+    } else if (newer) {
+      PROF_SCOPE("reload");
+      d0 = c0;
+      dend = cend;
 
       c0 = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
       close(fd);
       cend = c0 + statbuf.st_size;
       statbuf_old = statbuf;
-      c = c0;
 
-      selected_refresh();
+      // csv and cache files and the diff still being written read segs
+      csv_wait();
+      cache_wait();
+      diff_wait();
+      // only the lines between the unchanged start and end are parsed
+      {
+        PROF_SCOPE("reparse");
+        reloaded = gcode_reparse(&segs, d0, dend, c0, cend, &segs_old, 0);
+      }
+      {
+        PROF_SCOPE("bvh_refit");
+        bvh_refit(&tree, &segs, reloaded.from, reloaded.dirty);
+      }
+      reindex_layers(reloaded);
+      selected_refresh(reloaded);
+      segments_free(&segs_old);
 
       munmap(d0, dend - d0);
       return true;
@@ -335,18 +316,93 @@ bool mmapfile(char *file) {
   close(fd);
   cend = c0 + statbuf.st_size;
   statbuf_old = statbuf;
-  c = c0;
+  loaded_bytes = 0;
+  loader_start(file, &statbuf, c0, use_cache, out_of_core, wake);
+  return true;
+}
+
+/// append what the loader has parsed since last time to segs, waiting for
+/// a piece when wait. Returns false when there was nothing.
+/// After the last piece the cache is saved.
+/// Out of core, the layers go to big instead, see fit_resident().
+bool take_pieces(char *file, bool wait) {
+  loader_piece p;
+  size_t from = segs.n;
+  bool any = false, last = false, cached = false;
+  while (!last && loader_take(&p, wait)) {
+    PROF_SCOPE("take");
+    if (!any) {
+      // csv and cache files and the diff still being written read segs
+      csv_wait();
+      cache_wait();
+      diff_wait();
+    }
+    any = true;
+    if (out_of_core) {
+      for (size_t k = 0; k < p.nlayers; k++)
+        packed_total += packed_bytes(&p.layers[k].p);
+      ooc_add(&big, p.layers, p.nlayers);
+      free(p.layers);
+    } else if (p.cached) {
+      segments_free(&segs);
+      bvh_free(&tree);
+      segs = p.t;
+      tree = p.tree;
+    } else {
+      segments_splice(&segs, segs.n, 0, &p.t);
+      segments_free(&p.t);
+    }
+    ps = p.ps;
+    loaded_bytes = p.bytes;
+    last = p.last;
+    cached = p.cached;
+    parse_mbs = cached ? 0 : p.bytes / 1e3 / (p.ns + 1);
+  }
+  if (!any)
+    return false;
+  if (out_of_core) {
+    reindex_layers((gcode_splice){0});
+    return true;
+  }
+  if (!cached) {
+    PROF_SCOPE("bvh_refit");
+    bvh_refit(&tree, &segs, from, segs.n);
+  }
+  // appended, or all of it from the cache
+  if (cached)
+    from = 0;
+  reindex_layers((gcode_splice){from, from, segs.n, segs.n});
+  if (last && !cached && use_cache)
+    cache_save(file, &statbuf_old, c0, &segs, &tree, &ps);
   return true;
 }
 
-/// distance between a ray and a line segment
-double DistanceToRay(Ray q, Vector3 f, Vector3 t) {
-  Quaternion mkq =
-      QuaternionFromVector3ToVector3(q.direction, (Vector3){1, 0, 0});
-  Vector3 ft = Vector3Subtract(f, t), qt = Vector3Subtract(q.position, t);
-  ft = Vector3RotateByQuaternion(ft, mkq);
-  qt = Vector3RotateByQuaternion(qt, mkq);
-  return f2(qt.x, qt.y, qt.z, ft.x, ft.y, ft.z);
+/// out of core, decode the layers in view into segs, as many as the budget
+/// holds: from the bottom while loading, so what's there stays as more
+/// comes in, and from the top after, as stepping through the layers does
+void fit_resident() {
+  size_t lo, hi;
+  ooc_fit(&big, layer_view ? view_lo : 0, layer_view ? view_hi : lays.n,
+          loader_busy(), &lo, &hi);
+  if (lo == big.lo && hi == big.hi)
+    return;
+  PROF_SCOPE("page");
+  size_t first = ooc_page(&big, lo, hi, &segs);
+  seg_base = lo < hi ? big.l[lo].l.from : 0;
+  copy_layers(&res_lays, lo, hi, seg_base);
+  bvh_refit(&tree, &segs, first, segs.n);
+  render_update(&segs, &res_lays, first, segs.n);
+  selection_changed = true;
+}
+
+/// look at the middle of the toolpath from above one corner
+void place_camera(Camera3D *camera, stats ps) {
+  const float fac = 0.2;
+  camera->position =
+      (Vector3){fac * (ps.max.x - ps.min.x) + ps.center.x,
+                fac * (ps.max.y - ps.min.y) + ps.center.y,
+                fac * (ps.max.z - ps.min.z) + ps.center.z};
+  camera->target = (Vector3){ps.center.x, ps.center.y, ps.center.z};
 }
 
 // calipers
@@ -360,58 +416,133 @@ typedef enum {
   CLOSEST_SKIP_G0 = 8,
 } closest;
 
+// i is a row of segs
 bool selected_keep_row(int i, closest flag) {
-  bool is_sel = selected_find(i);
-  bool is_g0 = ps[0].w >= ps[1].w;
-  bool is_g1 = ps[0].w < ps[1].w;
+  bool is_sel = selected_find(i + seg_base);
+  bool is_g1 = segments_extrudes(&segs, i);
+  bool is_g0 = !is_g1;
   return !(flag & CLOSEST_SKIP_SELECTED && is_sel ||
            flag & CLOSEST_ONLY_SELECTED && !is_sel ||
            flag & CLOSEST_SKIP_G0 && is_g0 || flag & CLOSEST_SKIP_G1 && is_g1);
 }
 
+static bool keep_unselected(size_t i, void *ud) {
+  return !selected_find(i + seg_base);
+}
+
+// the segment of the file, out of those in segs
 int closestToRay(Ray r, float *distance, closest flag) {
-  float dmax = INFINITY, d;
-  int i = 0, imax = -1;
-  advance_ps_reset();
-  while (advance_ps()) {
-    if (selected_keep_row(i, flag)) {
-      d = DistanceToRay(r, Vector4To3(ps[0]), Vector4To3(ps[1]));
-      if (d < dmax) {
-        imax = i;
-        dmax = d;
+  PROF_SCOPE("closestToRay");
+  size_t from, to;
+  resident_segments(&from, &to);
+  if (flag & CLOSEST_ONLY_SELECTED) {
+    // the selection is small enough to check directly, a batch at a time
+    size_t idx[256];
+    float dmax = INFINITY, d[256];
+    int imax = -1;
+    for (size_t k = 0; k < selected_end();) {
+      size_t n = 0;
+      for (; k < selected_end() && n < 256; k++) {
+        size_t i = selected_nth(k) - seg_base;
+        if (i >= from && i < to && selected_keep_row(i, flag))
+          idx[n++] = i;
       }
+      bvh_distances(&segs, r, idx, n, d);
+      for (size_t m = 0; m < n; m++)
+        if (d[m] < dmax || (d[m] == dmax && (int)idx[m] < imax)) {
+          imax = idx[m];
+          dmax = d[m];
+        }
     }
-    i++;
+    if (distance)
+      *distance = dmax;
+    return imax < 0 ? imax : imax + (int)seg_base;
+  }
+  uint8_t skip = (flag & CLOSEST_SKIP_G0 ? BVH_TRAVEL : 0) |
+                 (flag & CLOSEST_SKIP_G1 ? BVH_EXTRUDE : 0);
+  int i = bvh_closest(&tree, &segs, r, from, to, skip,
+                      flag & CLOSEST_SKIP_SELECTED ? keep_unselected : NULL,
+                      NULL, distance);
+  return i < 0 ? i : i + (int)seg_base;
+}
+
+// add what's in view in r to the selection, or remove it
+void select_region(const bvh_region *r, bool remove) {
+  PROF_SCOPE("select_region");
+  size_t from, to, *in;
+  resident_segments(&from, &to);
+  size_t n = bvh_inside(&tree, &segs, r, from, to, 0, &in);
+  for (size_t k = 0; k < n; k++) {
+    size_t i = in[k] + seg_base;
+    if (remove)
+      selected_remove(i);
+    else if (!selected_find(i))
+      selected_add(i);
+  }
+  free(in);
+}
+
+// give the selection in segs to render_selection() and keep the part in
+// view for capsules
+void show_selection() {
+  size_t from, to, n = 0, nview = 0;
+  resident_segments(&from, &to);
+  size_t *in = malloc(selected_end() * sizeof(size_t) + 1);
+  for (size_t k = 0; k < selected_end(); k++) {
+    // holes and segments out of segs wrap around past its end
+    size_t j = selected_nth(k) - seg_base;
+    if (j >= segs.n)
+      continue;
+    in[n++] = j;
+    nview += j >= from && j < to;
   }
-  if (distance)
-    *distance = dmax;
-  return imax;
+  render_selection(&segs, out_of_core ? &res_lays : &lays, in, n);
+  ncapsules = 0;
+  for (size_t k = 0; k < n && nview <= SELECTED_CAPSULES; k++)
+    if (in[k] >= from && in[k] < to)
+      capsules[ncapsules++] = in[k];
+  free(in);
+  selection_changed = false;
 }
 
+// written in the background from a copy of the selection
 void write_csv(char *path, closest flag) {
-  FILE *h = fopen(path, "w");
-
-  fprintf(h, "x,y,z,e,x2,y2,z2,e2,isel\n");
-  advance_ps_reset();
-  int i = 0;
-  while (advance_ps()) {
-    if (selected_keep_row(i, flag))
-      fprintf(h, "%f,%f,%f,%f,%f,%f,%f,%f,%d\n", ps[0].x, ps[0].y, ps[0].z,
-              ps[0].w, ps[1].x, ps[1].y, ps[1].z, ps[1].w,
-              (int)selected_index(i));
-    i++;
+  PROF_SCOPE("write_csv");
+  size_t n = selected_end(), nmarks = 0;
+  csv_mark *marks = malloc(n * sizeof(csv_mark) + 1);
+  // isel counts the selections before, not the holes removals left, so
+  // the same selection always gets the same numbers
+  long rank = 0;
+  for (size_t k = 0; k < n; k++) {
+    size_t i = selected_nth(k);
+    if (i == SELECTED_EMPTY)
+      continue;
+    if (i < file_segments())
+      marks[nmarks++] = (csv_mark){i, rank};
+    rank++;
   }
-  fclose(h);
+  uint8_t skip = (flag & CLOSEST_SKIP_SELECTED ? CSV_SKIP_MARKED : 0) |
+                 (flag & CLOSEST_ONLY_SELECTED ? CSV_SKIP_UNMARKED : 0) |
+                 (flag & CLOSEST_SKIP_G0 ? CSV_SKIP_TRAVEL : 0) |
+                 (flag & CLOSEST_SKIP_G1 ? CSV_SKIP_EXTRUDE : 0);
+  size_t from, to;
+  view_segments(&from, &to);
+  if (out_of_core)
+    csv_write_fetch(path, ooc_get, &big, from, to, marks, nmarks, skip);
+  else
+    csv_write(path, &segs, from, to, marks, nmarks, skip);
+  free(marks);
 }
 
 int main(int argc, char **argv) {
   static char csvout[NFILENAME + 1] = "gcodeviewer_out.csv";
   static char csvselected[NFILENAME + 1] = "gcodeviewer_selected.csv";
+  static char csvdiff[NFILENAME + 1] = "gcodeviewer_diff.csv";
 
   {
     char *csvprefix = getenv("CSV_PREFIX");
     if (csvprefix) {
-      csvout[0] = csvselected[0] = '\0';
+      csvout[0] = csvselected[0] = csvdiff[0] = '\0';
       if (strlen(csvprefix) + strlen("selected.csv") > NFILENAME) {
         fprintf(
             stderr,
@@ -421,14 +552,19 @@ int main(int argc, char **argv) {
       }
       strncat(csvout, csvprefix, NFILENAME);
       strncat(csvselected, csvprefix, NFILENAME);
+      strncat(csvdiff, csvprefix, NFILENAME);
       strncat(csvout, "out.csv", NFILENAME);
       strncat(csvselected, "selected.csv", NFILENAME);
+      strncat(csvdiff, "diff.csv", NFILENAME);
     }
   }
 
   if (argc == 1 || (argc >= 2 && (0 == strcmp(argv[1], "-h") ||
                                   0 == strcmp(argv[1], "--help")))) {
-    printf("usage: %s file.gcode\n", argv[0]);
+    printf("usage: %s file.gcode\n"
+           "       %s --diff old.gcode file.gcode\n"
+           "       %s --batch [-j N] file.gcode|dir...\n",
+           argv[0], argv[0], argv[0]);
     printf("\n\tq ESC quit\n\tLEFT MOUSE DRAG rotates the view\n"
            "\tRIGHT MOUSE DRAG pans the view\n"
            "\tMOUSE WHEEL DRAG zooms the view\n"
@@ -436,51 +572,184 @@ int main(int argc, char **argv) {
            "\tALT-SPACE toggles selection of the segment closest to the mouse\n"
            "\tBACKSPACE removes the segment closest to the mouse from the "
            "selection\n"
+           "\tCTRL-LEFT MOUSE DRAG adds the segments in a rectangle to the "
+           "selection,\n\t  ALT-LEFT MOUSE DRAG those in a lasso, and with "
+           "SHIFT they're removed\n"
+           "\tUP DOWN show one layer, starting from the top, and step through "
+           "them\n"
+           "\tSHIFT-UP SHIFT-DOWN show fewer or more layers below it\n"
+           "\tA shows all layers again\n"
+           "\tD compares the file from now on with how it is now, or stops\n"
+           "\tF3 shows how long the last frame took, and on what\n"
            "\n\tThe  selection has a different rendering style"
-           "\n\tand is saved to csv files %s and %s\n"
+           "\n\tand is saved to csv files %s and %s"
+           "\n\twith only the layers in view\n"
            "\n\t`CSV_PREFIX=abc_ %s` saves abc_out.csv and "
            "abc_selected.csv instead\n"
+           "\n\tparsed files are cached next to them in file.gcode.gcv, "
+           "`GCODE_CACHE=0 %s` neither reads nor writes the cache\n"
+           "\n\ta file too big for memory is kept packed, with only the "
+           "layers in view"
+           "\n\t  decoded, as many as fit, and the others outlined in gray;"
+           "\n\t  `GCODE_BUDGET=500 %s` does that with 500 MB for them, "
+           "=0 never does\n"
+           "\n\tcomparing, what was added is drawn green, removed red and "
+           "moved magenta,"
+           "\n\t  and saved to %s with columns "
+           "kind,x,y,z,e,x2,y2,z2,e2,distance;"
+           "\n\t  --diff compares with old.gcode from the start\n"
+           "\n\t`GCODE_TRACE=trace.json %s` writes what took how long to "
+           "trace.json on exit,\n\t  for chrome://tracing or "
+           "ui.perfetto.dev\n"
+           "\n\tafter a reload the selection moves to the closest segments,"
+           "\n\t  measured with f1 or a Gauss rule, whichever is faster here;"
+           "\n\t  GCODE_SEGMENT_DISTANCE=f1 or =gauss picks one\n"
            "\n\tcsv files have columns x,y,z,e, x2,y2,z2,e2, isel"
            "\n\t  where xyze are coordinates of the start points and xyze2 are "
            "the end"
-           "\n\t  and isel 0 is the first selected point, -1 is not selected\n",
-           csvout, csvselected, argv[0]);
+           "\n\t  and isel 0 is the first selected point, -1 is not selected\n"
+           "\n\t--batch writes the csv of every file, and of the .gcode files "
+           "in every dir,"
+           "\n\t  on N threads or every core, without opening a window: "
+           "a/part.gcode"
+           "\n\t  goes to gcodeviewer_part_out.csv, or abc_part_out.csv with "
+           "CSV_PREFIX=abc_."
+           "\n\t  A line per file with its bounding box, center and timings "
+           "goes to stdout.\n",
+           csvout, csvselected, argv[0], argv[0], argv[0], csvdiff, argv[0]);
 
     exit(0);
   }
+  if (0 == strcmp(argv[1], "--batch")) {
+    int arg = 2, nworkers = 0;
+    if (argc > 3 && 0 == strcmp(argv[2], "-j")) {
+      nworkers = atoi(argv[3]);
+      arg = 4;
+    }
+    char *prefix = getenv("CSV_PREFIX"), **files;
+    size_t n = batch_files(argv + arg, argc - arg, &files);
+    batch_header(stdout);
+    size_t failed = batch_run(files, n, nworkers,
+                              prefix ? prefix : "gcodeviewer_", stdout, NULL);
+    batch_files_free(files, n);
+    exit(failed ? 1 : 0);
+  }
+  if (0 == strcmp(argv[1], "--diff")) {
+    if (argc < 4 || !load_base(argv[2])) {
+      fprintf(stderr, "usage: %s --diff old.gcode file.gcode\n", argv[0]);
+      exit(-1);
+    }
+    diffing = true;
+    // from here on argv[1] is the file being watched
+    argv += 2;
+    argc -= 2;
+  }
+  {
+    char *cache = getenv("GCODE_CACHE");
+    use_cache = !cache || strcmp(cache, "0");
+  }
+  {
+    // how remap() compares segments after a reload
+    char *kind = getenv("GCODE_SEGMENT_DISTANCE");
+    if (kind && 0 == strcmp(kind, "f1"))
+      segment_distance = SEGMENT_DISTANCE_F1;
+    else if (kind && 0 == strcmp(kind, "gauss"))
+      segment_distance = SEGMENT_DISTANCE_GAUSS;
+    else
+      segment_distance = segment_distance_fastest(1e-3, NULL);
+  }
+  {
+    // a file whose segments would take more than half the memory, at about
+    // a segment per 32 bytes of text, is kept packed, with a quarter of the
+    // memory for the layers in view
+    char *budget = getenv("GCODE_BUDGET");
+    long pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+    size_t ram = pages > 0 && page > 0 ? (size_t)pages * page : 0;
+    struct stat st;
+    if (budget) {
+      out_of_core = atof(budget) > 0;
+      ooc_init(&big, atof(budget) * 1e6);
+    } else if (ram && 0 == stat(argv[1], &st) && st.st_size >= 0 &&
+               (size_t)st.st_size / 32 * OOC_SEGMENT_BYTES > ram / 2) {
+      out_of_core = true;
+      ooc_init(&big, ram / 4);
+    }
+  }
+  if (out_of_core && diffing) {
+    fprintf(stderr, "%s is kept packed, so it can't be compared\n", argv[1]);
+    diffing = false;
+  }
+  prof_thread_name("main");
   selected_init();
+  // parsed in the background, showing what there is so far every frame
   mmapfile(argv[1]);
-  write_csv(csvout, 0);
-  write_csv(csvselected, CLOSEST_ONLY_SELECTED);
-  advance_ps_reset();
-
-  gcode_bbox();
 
   SetConfigFlags(FLAG_MSAA_4X_HINT | FLAG_WINDOW_RESIZABLE);
   InitWindow(800, 600, "gcodeviewer");
   SetTargetFPS(60);
+  atomic_store(&window_open, true);
 
-  const float fac = 0.2;
-  Camera3D camera = {.position =
-                         (Vector3){fac * (ps_max.x - ps_min.x) + ps_trim.x,
-                                   fac * (ps_max.y - ps_min.y) + ps_trim.y,
-                                   fac * (ps_max.z - ps_min.z) + ps_trim.z},
+  // with a watcher thread to wake it up, the loop can sleep between events
+  bool watching = watch_start(argv[1], 100, wake);
+  if (watching && glfwPostEmptyEvent)
+    EnableEventWaiting();
+
+  // placed when the first piece comes in, and again with the final stats
+  // unless it has been moved by then
+  Camera3D camera = {.position = (Vector3){1, 1, 1},
                      .fovy = 90,
-                     .target = (Vector3){ps_trim.x, ps_trim.y, ps_trim.z},
                      .up = (Vector3){0, 0, 1},
                      .projection = CAMERA_ORTHOGRAPHIC};
-  // Render-to-texture cache for the 3D scene
-  static RenderTexture2D rt;
-  rt = LoadRenderTexture(GetScreenWidth(), GetScreenHeight());
-
+  bool camera_moved = false;
+  render_upload(&segs);
+
+  bool show_prof = false;
+  // the model view projection the last frame was drawn with, and the
+  // corners of a rectangle or the points of a lasso being dragged
+  Matrix mvp = MatrixIdentity();
+  bool dragging = false, lasso = false;
+  static Vector2 drag[NLASSO];
+  size_t ndrag = 0;
   while (!WindowShouldClose() && !IsKeyPressed(KEY_Q) &&
          !IsKeyPressed(KEY_ESCAPE)) {
+    prof_frame();
+    if (IsKeyPressed(KEY_F3))
+      show_prof = !show_prof;
     {
+      PROF_SCOPE("poll");
+      if (diff_take(&changes)) {
+        comparing = false;
+        render_diff(&changes, &base, &segs, &lays);
+      }
+      // without inotify, check every 20 frames
       static int n = 0;
-      n++;
-      n = n % 20;
-      if (n && mmapfile(argv[1])) // check mtime and reload if needed
-        goto rebuild;
+      n = (n + 1) % 20;
+      size_t from = segs.n;
+      if (loader_busy()) {
+        // a change while loading is picked up after it
+        if (take_pieces(argv[1], false)) {
+          if (out_of_core)
+            fit_resident();
+          else
+            render_update(&segs, &lays, from, segs.n);
+          selection_changed = true;
+          if (!camera_moved && (!from || !loader_busy()))
+            place_camera(&camera, ps);
+          if (!loader_busy()) {
+            write_csv(csvout, 0);
+            write_csv(csvselected, CLOSEST_ONLY_SELECTED);
+            update_diff(csvdiff);
+          }
+        }
+      } else {
+        bool check = watching ? watch_changed() : n == 0;
+        // check mtime and reload if needed
+        if (check && mmapfile(argv[1])) {
+          render_update(&segs, &lays, reloaded.from, reloaded.dirty);
+          selection_changed = true;
+          update_diff(csvdiff);
+        }
+      }
     }
 
     // The mouse buttons are already used for navigation.
@@ -508,25 +777,118 @@ int main(int argc, char **argv) {
                        : alt ? 0
                              : CLOSEST_SKIP_SELECTED;
         int i = closestToRay(r, NULL, flag);
-        if (back)
+        if (i < 0)
+          ; // nothing in view to pick
+        else if (back)
           selected_remove(i);
         else if (!selected_find(i))
           selected_add(i);
         else if (alt)
           selected_remove(i);
+        selection_changed = true;
         write_csv(csvselected, CLOSEST_ONLY_SELECTED);
-        goto rebuild;
       };
     }
 
-    if (IsMouseButtonDown(MOUSE_LEFT_BUTTON)) {
+    {
+      // CTRL-LEFT MOUSE DRAG adds what's in a rectangle to the selection,
+      // ALT-LEFT MOUSE DRAG what's in a lasso, and with SHIFT as well they
+      // remove it instead
+      bool ctrl = IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL);
+      bool alt = IsKeyDown(KEY_LEFT_ALT);
+      Vector2 p = GetMousePosition();
+      if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON) && (ctrl || alt)) {
+        dragging = true;
+        lasso = !ctrl;
+        drag[0] = drag[1] = p;
+        ndrag = 2;
+      } else if (dragging && !lasso) {
+        drag[1] = p;
+      } else if (dragging && ndrag < NLASSO &&
+                 Vector2Distance(drag[ndrag - 1], p) >= 3) {
+        drag[ndrag++] = p;
+      }
+      if (dragging && !IsMouseButtonDown(MOUSE_LEFT_BUTTON)) {
+        dragging = false;
+        // in normalized device coordinates, y up
+        float w = GetScreenWidth(), h = GetScreenHeight();
+        Vector2 lo = {INFINITY, INFINITY}, hi = {-INFINITY, -INFINITY};
+        for (size_t k = 0; k < ndrag; k++) {
+          drag[k] = (Vector2){2 * drag[k].x / w - 1, 1 - 2 * drag[k].y / h};
+          lo = Vector2Min(lo, drag[k]);
+          hi = Vector2Max(hi, drag[k]);
+        }
+        // a click isn't a region
+        if ((hi.x - lo.x) * w > 4 && (hi.y - lo.y) * h > 4) {
+          bvh_region r = {mvp, lo, hi, lasso ? drag : NULL, ndrag};
+          select_region(&r, IsKeyDown(KEY_LEFT_SHIFT) ||
+                                IsKeyDown(KEY_RIGHT_SHIFT));
+          selection_changed = true;
+          write_csv(csvselected, CLOSEST_ONLY_SELECTED);
+        }
+      }
+    }
+
+    {
+      // UP and DOWN step through the layers starting from the top one,
+      // SHIFT-UP and SHIFT-DOWN show fewer or more layers below it,
+      // and A shows every layer again
+      bool up = IsKeyPressed(KEY_UP) || IsKeyPressedRepeat(KEY_UP);
+      bool down = IsKeyPressed(KEY_DOWN) || IsKeyPressedRepeat(KEY_DOWN);
+      bool shift = IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT);
+      size_t lo = view_lo, hi = view_hi;
+      bool was = layer_view;
+      if ((up || down) && !layer_view && lays.n) {
+        layer_view = true;
+        view_lo = lays.n - 1;
+        view_hi = lays.n;
+      } else if (layer_view && shift) {
+        if (down && view_lo > 0)
+          view_lo--;
+        if (up && view_lo + 1 < view_hi)
+          view_lo++;
+      } else if (layer_view) {
+        if (up && view_hi < lays.n)
+          view_lo++, view_hi++;
+        if (down && view_lo > 0)
+          view_lo--, view_hi--;
+      }
+      if (IsKeyPressed(KEY_A))
+        layer_view = false;
+      if (was != layer_view || lo != view_lo || hi != view_hi) {
+        if (out_of_core)
+          fit_resident();
+        selection_changed = true;
+        write_csv(csvout, 0);
+        write_csv(csvselected, CLOSEST_ONLY_SELECTED);
+      }
+    }
+
+    if (IsKeyPressed(KEY_D)) {
+      // D keeps the file as it is to compare the next versions with, once
+      // it's all there, and again turns that off
+      if (diffing) {
+        diffing = false;
+        stop_diff();
+      } else if (out_of_core) {
+        fprintf(stderr, "%s is kept packed, so it can't be compared\n",
+                argv[1]);
+      } else if (!loader_busy()) {
+        diffing = true;
+        segments_copy(&base, &segs, 0, segs.n);
+        layers_build(&base_lays, &base);
+        update_diff(csvdiff);
+      }
+    }
+
+    if (IsMouseButtonDown(MOUSE_LEFT_BUTTON) && !dragging) {
       // rotate
       UpdateCamera(&camera, CAMERA_THIRD_PERSON);
-      if (Vector2LengthSqr(GetMouseDelta()) > 0)
-        goto rebuild;
+      camera_moved = true;
     }
     if (IsMouseButtonDown(MOUSE_RIGHT_BUTTON)) {
       // pan
+      camera_moved = true;
       Vector2 p = GetMousePosition();
       Vector2 q = Vector2Subtract(p, GetMouseDelta());
       Vector3 r = GetScreenToWorldRay(p, camera).position;
@@ -534,57 +896,120 @@ int main(int argc, char **argv) {
       Vector3 d = Vector3Subtract(s, r);
       camera.position = Vector3Add(camera.position, d);
       camera.target = Vector3Add(camera.target, d);
-      goto rebuild;
     }
     {
       // zoom
       float f = GetMouseWheelMove();
+      camera_moved |= f != 0;
       camera.fovy = Clamp(camera.fovy / (1 + f / 6) - 7 * f, 20, 120);
-      if (fabsf(f) > 0)
-        goto rebuild;
-    }
-
-    // Recreate render target on window resize
-    if (IsWindowResized() && (rt.texture.height < GetScreenHeight() ||
-                              rt.texture.width < GetScreenWidth())) {
-      UnloadRenderTexture(rt);
-      rt = LoadRenderTexture(GetScreenWidth(), GetScreenHeight());
-      goto rebuild;
     }
 
-    // Draw cached texture to the screen
-  draw:
+    // the toolpath is a static vertex buffer, so there's nothing to cache
+    prof_span draw = prof_begin("draw");
     BeginDrawing();
     ClearBackground(BLACK);
-    Rectangle src = (Rectangle){0, 0, (float)rt.texture.width,
-                                -(float)rt.texture.height}; // flip vertically
-    Rectangle dst =
-        (Rectangle){0, 0, (float)GetScreenWidth(), (float)GetScreenHeight()};
-    DrawTexturePro(rt.texture, src, dst, (Vector2){0, 0}, 0.0f, WHITE);
-    EndDrawing();
-    continue;
-
-  rebuild:
-    // Rebuild the cached texture
-    BeginTextureMode(rt);
-    ClearBackground(BLACK);
     BeginMode3D(camera);
-
-    advance_ps_reset();
-    int j = 0;
-    while (advance_ps()) {
-      Color c = ps[0].w < ps[1].w ? BLUE : YELLOW;
-      if (selected_find(j)) {
-        DrawCapsule(Vector4To3(ps[0]), Vector4To3(ps[1]), 1, 10, 10, c);
-
-      } else
-        DrawLine3D(Vector4To3(ps[0]), Vector4To3(ps[1]), c);
-      j++;
+    mvp = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+    size_t lo = layer_view ? view_lo : 0, hi = layer_view ? view_hi : lays.n;
+    if (out_of_core) {
+      // the layers in view that aren't decoded are outlined
+      for (size_t k = lo; k < hi; k++)
+        if (k < big.lo || k >= big.hi)
+          DrawBoundingBox(lays.l[k].box, DARKGRAY);
+      lo = lo > big.lo ? lo - big.lo : 0;
+      hi = hi > big.lo ? hi - big.lo : 0;
+      hi = hi < res_lays.n ? hi : res_lays.n;
+    }
+    // the selection and the differences are drawn as lines with the
+    // toolpath
+    if (selection_changed)
+      show_selection();
+    // an orthographic camera shows fovy world units from top to bottom
+    render_draw(&segs, out_of_core ? &res_lays : &lays, lo, hi,
+                camera.fovy / GetScreenHeight());
+    // capsules stand out, but a region can select too many to draw them
+    for (size_t k = 0; k < ncapsules; k++) {
+      size_t j = capsules[k];
+      bool g1 = segments_extrudes(&segs, j);
+      // arcs get a capsule per piece, about as coarse as the capsules are
+      Vector3 p[32];
+      size_t np = arc_points(&segs, j, 0.5f, p, 32);
+      for (size_t e = 0; e + 1 < np; e++)
+        DrawCapsule(p[e], p[e + 1], 1, 10, 10, g1 ? BLUE : YELLOW);
     }
     EndMode3D();
-    EndTextureMode();
-    goto draw;
+    if (dragging && !lasso) {
+      Vector2 a = Vector2Min(drag[0], drag[1]),
+              b = Vector2Max(drag[0], drag[1]);
+      DrawRectangleLines(a.x, a.y, b.x - a.x, b.y - a.y, WHITE);
+    }
+    for (size_t k = 0; dragging && lasso && k < ndrag; k++)
+      DrawLineV(drag[k], drag[(k + 1) % ndrag], WHITE);
+    if (layer_view)
+      DrawText(view_hi - view_lo == 1
+                   ? TextFormat("layer %zu of %zu, z %.2f", view_lo + 1,
+                                lays.n, lays.l[view_lo].z)
+                   : TextFormat("layers %zu to %zu of %zu", view_lo + 1,
+                                view_hi, lays.n),
+               10, 10, 20, WHITE);
+    if (diffing && !loader_busy())
+      DrawText(comparing
+                   ? "comparing"
+                   : TextFormat("%zu added, %zu removed, %zu moved, in %zu "
+                                "of %zu layers",
+                                changes.added, changes.removed, changes.moved,
+                                changes.changed_layers,
+                                changes.changed_layers + changes.same_layers),
+               10, GetScreenHeight() - 55, 20, WHITE);
+    if (loader_busy())
+      DrawText(TextFormat("loading %.0f%%",
+                          100.0 * loaded_bytes / (cend - c0 + 1)),
+               10, GetScreenHeight() - 30, 20, WHITE);
+    if (show_prof) {
+      // what the last frame went on, in the order it finished
+      prof_stage st[24];
+      uint64_t frame;
+      size_t n = prof_last_frame(st, 24, &frame);
+      int y = 40;
+      DrawText(TextFormat("frame %.2f ms, %zu segments, %zu layers",
+                          frame / 1e6, file_segments(), lays.n),
+               10, y, 16, GREEN);
+      if (out_of_core)
+        DrawText(TextFormat("layers %zu to %zu decoded, %.0f of %.0f MB, "
+                            "%.0f MB packed",
+                            big.lo + 1, big.hi,
+                            segs.n * OOC_SEGMENT_BYTES / 1e6, big.budget / 1e6,
+                            packed_total / 1e6),
+                 10, y += 18, 16, GREEN);
+      DrawText(parse_mbs ? TextFormat("parsed at %.0f MB/s", parse_mbs)
+                         : "loaded from the cache",
+               10, y += 18, 16, GREEN);
+      for (size_t k = 0; k < n; k++)
+        DrawText(TextFormat("%s %.3f ms x%u", st[k].name, st[k].ns / 1e6,
+                            st[k].count),
+                 10, y += 18, 16, GREEN);
+    }
+    prof_end(&draw);
+    {
+      // with vsync, mostly waiting
+      PROF_SCOPE("present");
+      EndDrawing();
+    }
   }
-  UnloadRenderTexture(rt);
+  render_unload();
   CloseWindow();
+  atomic_store(&window_open, false);
+  if (loader_busy()) {
+    // the csv files are of the whole file, even when it closed early
+    while (take_pieces(argv[1], true))
+      ;
+    write_csv(csvout, 0);
+    write_csv(csvselected, CLOSEST_ONLY_SELECTED);
+  }
+  csv_wait();
+  cache_wait();
+  diff_wait();
+  char *trace = getenv("GCODE_TRACE");
+  if (trace && !prof_dump(trace))
+    fprintf(stderr, "can't write %s\n", trace);
 }
@@ -0,0 +1,297 @@
+#include "ooc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t ooc_layer_max = 1 << 20;
+
+void ooc_init(ooc *o, size_t budget) { *o = (ooc){.budget = budget}; }
+
+void ooc_layers_free(ooc_layer *ls, size_t n) {
+  for (size_t k = 0; k < n; k++)
+    packed_free(&ls[k].p);
+}
+
+void ooc_free(ooc *o) {
+  ooc_layers_free(o->l, o->n);
+  free(o->l);
+  ooc_init(o, o->budget);
+}
+
+void ooc_add(ooc *o, ooc_layer *ls, size_t n) {
+  if (o->n + n > o->cap) {
+    o->cap = 2 * (o->n + n) + 256;
+    o->l = realloc(o->l, o->cap * sizeof(ooc_layer));
+    if (!o->l) {
+      fprintf(stderr, "out of memory for %zu layers\n", o->cap);
+      exit(-1);
+    }
+  }
+  if (n)
+    memcpy(o->l + o->n, ls, n * sizeof(ooc_layer));
+  o->n += n;
+  if (o->n)
+    o->segments = o->l[o->n - 1].l.to;
+}
+
+static size_t layer_bytes(const ooc *o, size_t k) {
+  return (o->l[k].l.to - o->l[k].l.from) * OOC_SEGMENT_BYTES;
+}
+
+void ooc_fit(const ooc *o, size_t want_lo, size_t want_hi, bool bottom_up,
+             size_t *lo, size_t *hi) {
+  if (want_hi > o->n)
+    want_hi = o->n;
+  if (want_lo >= want_hi) {
+    *lo = *hi = want_hi;
+    return;
+  }
+  size_t bytes = 0;
+  if (bottom_up) {
+    *lo = *hi = want_lo;
+    while (*hi < want_hi &&
+           (*hi == *lo || bytes + layer_bytes(o, *hi) <= o->budget))
+      bytes += layer_bytes(o, (*hi)++);
+  } else {
+    *lo = *hi = want_hi;
+    while (*lo > want_lo &&
+           (*lo == *hi || bytes + layer_bytes(o, *lo - 1) <= o->budget))
+      bytes += layer_bytes(o, --*lo);
+  }
+}
+
+// append the segments of layers [lo, hi) to t
+static void decode(const ooc *o, size_t lo, size_t hi, segments *t) {
+  segments part;
+  segments_init(&part);
+  for (size_t k = lo; k < hi; k++) {
+    packed_get(&o->l[k].p, 0, o->l[k].p.n, &part);
+    segments_splice(t, t->n, 0, &part);
+  }
+  segments_free(&part);
+}
+
+size_t ooc_page(ooc *o, size_t lo, size_t hi, segments *t) {
+  size_t changed = t->n;
+  if (lo >= hi || hi <= o->lo || lo >= o->hi) {
+    // nothing to keep
+    segments_resize(t, 0);
+    decode(o, lo, hi, t);
+    changed = 0;
+  } else {
+    segments none, part;
+    segments_init(&none);
+    segments_init(&part);
+    if (lo > o->lo) {
+      segments_splice(t, 0, o->l[lo].l.from - o->l[o->lo].l.from, &none);
+      changed = 0;
+    } else if (lo < o->lo) {
+      decode(o, lo, o->lo, &part);
+      segments_splice(t, 0, 0, &part);
+      changed = 0;
+    }
+    size_t base = o->l[lo].l.from;
+    if (hi < o->hi) {
+      segments_resize(t, o->l[hi].l.from - base);
+    } else if (hi > o->hi) {
+      changed = changed < t->n ? changed : t->n;
+      decode(o, o->hi, hi, t);
+    }
+    segments_free(&part);
+  }
+  if (changed > t->n)
+    changed = t->n;
+  o->lo = lo;
+  o->hi = hi;
+  return changed;
+}
+
+void ooc_get(size_t from, size_t to, segments *out, void *ud) {
+  const ooc *o = ud;
+  segments_resize(out, 0);
+  // the layer with from in it
+  size_t lo = 0, hi = o->n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (o->l[mid].l.to <= from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  segments part;
+  segments_init(&part);
+  for (size_t k = lo; k < o->n && o->l[k].l.from < to; k++) {
+    const layer *l = &o->l[k].l;
+    size_t a = from > l->from ? from : l->from, b = to < l->to ? to : l->to;
+    packed_get(&o->l[k].p, a - l->from, b - l->from, &part);
+    segments_splice(out, out->n, 0, &part);
+  }
+  segments_free(&part);
+}
+
+void ooc_packer_init(ooc_packer *k) {
+  *k = (ooc_packer){0};
+  segments_init(&k->pending);
+}
+
+void ooc_packer_free(ooc_packer *k) {
+  segments_free(&k->pending);
+  layers_free(&k->ls);
+}
+
+size_t ooc_pack(ooc_packer *k, const segments *t, bool last, ooc_layer **out) {
+  segments_splice(&k->pending, k->pending.n, 0, t);
+  layers_build(&k->ls, &k->pending);
+  // the last layer isn't finished until the next one starts, unless it's
+  // too big to wait for
+  size_t done = last || !k->ls.n ? k->ls.n : k->ls.n - 1, parts = 0;
+  if (!last && k->ls.n) {
+    layer *l = &k->ls.l[k->ls.n - 1];
+    parts = (l->to - l->from) / ooc_layer_max;
+  }
+  *out = malloc((done + parts) * sizeof(ooc_layer) + 1);
+  for (size_t j = 0; j < done + parts; j++) {
+    ooc_layer *o = &(*out)[j];
+    if (j < done) {
+      o->l = k->ls.l[j];
+    } else {
+      layer *l = &k->ls.l[done];
+      size_t from = l->from + (j - done) * ooc_layer_max;
+      o->l = (layer){from, from + ooc_layer_max, l->z,
+                     layers_box(&k->pending, from, from + ooc_layer_max)};
+    }
+    packed_init(&o->p);
+    packed_build(&o->p, &k->pending, o->l.from, o->l.to);
+    o->l.from += k->at;
+    o->l.to += k->at;
+  }
+  size_t used = done + parts ? (*out)[done + parts - 1].l.to - k->at : 0;
+  segments none;
+  segments_init(&none);
+  segments_splice(&k->pending, 0, used, &none);
+  k->at += used;
+  return done + parts;
+}
+
+#ifdef TESTING
+#include "gcode.h"
+#include "synth.h"
+#include <assert.h>
+
+static bool same(const segments *a, const segments *b, size_t from) {
+  return a->n >= from + b->n && 0 == memcmp(a->x0 + from, b->x0, b->n * 4) &&
+         0 == memcmp(a->e1 + from, b->e1, b->n * 4) &&
+         0 == memcmp(a->aj + from, b->aj, b->n * 4) &&
+         0 == memcmp(a->kind + from, b->kind, b->n) &&
+         0 == memcmp(a->line + from, b->line, b->n * sizeof(size_t));
+}
+
+// pack text in windows of bytes into o, and parse it into all the same way:
+// relative moves round differently with other cuts
+static void pack(ooc *o, char *text, size_t len, size_t bytes, segments *all) {
+  gcode_stream s;
+  gcode_stream_init(&s, text, text + len);
+  ooc_packer k;
+  ooc_packer_init(&k);
+  segments t;
+  segments_init(&t);
+  bool more = true;
+  while (more) {
+    more = gcode_stream_next(&s, &t, bytes, 1);
+    if (more)
+      segments_splice(all, all->n, 0, &t);
+    ooc_layer *ls;
+    size_t n = ooc_pack(&k, more ? &t : &(segments){0}, !more, &ls);
+    ooc_add(o, ls, n);
+    free(ls);
+  }
+  assert(k.pending.n == 0);
+  segments_free(&t);
+  ooc_packer_free(&k);
+  gcode_stream_free(&s);
+}
+
+int main() {
+  synth_opts opts = SYNTH_DEFAULTS;
+  opts.layers = 30;
+  opts.arcs = 10;
+  size_t len;
+  char *text = synth_gcode(&opts, &len);
+  segments all, u;
+  segments_init(&all);
+  segments_init(&u);
+
+  // packed a window at a time, the layers are those of the whole file
+  ooc o;
+  ooc_init(&o, 0);
+  pack(&o, text, len, 10000, &all);
+  layers ls = {0};
+  layers_build(&ls, &all);
+  assert(o.n == ls.n && o.segments == all.n);
+  for (size_t k = 0; k < o.n; k++) {
+    layer *a = &o.l[k].l, *b = &ls.l[k];
+    assert(a->from == b->from && a->to == b->to && a->z == b->z);
+    assert(0 == memcmp(&a->box, &b->box, sizeof(a->box)));
+  }
+  ooc_get(0, all.n, &u, &o);
+  assert(u.n == all.n && same(&all, &u, 0));
+  ooc_get(12345, 23456, &u, &o);
+  assert(u.n == 23456 - 12345 && same(&all, &u, 12345));
+
+  // as many layers as the budget holds, but at least one
+  size_t lo, hi, per = (all.n / ls.n) * OOC_SEGMENT_BYTES;
+  ooc_fit(&o, 0, o.n, false, &lo, &hi);
+  assert(lo == o.n - 1 && hi == o.n);
+  o.budget = 5 * per;
+  ooc_fit(&o, 10, 20, false, &lo, &hi);
+  assert(hi == 20 && lo >= 15 && lo <= 17);
+  ooc_fit(&o, 10, 20, true, &lo, &hi);
+  assert(lo == 10 && hi >= 13 && hi <= 15);
+  o.budget = SIZE_MAX;
+  ooc_fit(&o, 3, 7, false, &lo, &hi);
+  assert(lo == 3 && hi == 7);
+
+  // moving the resident layers around keeps what it can
+  segments_resize(&u, 0);
+  size_t moves[][2] = {{5, 9}, {6, 9}, {4, 12}, {4, 10}, {2, 3}, {0, 30},
+                       {29, 30}, {28, 30}, {10, 10}, {1, 2}};
+  for (size_t m = 0; m < sizeof(moves) / sizeof(moves[0]); m++) {
+    size_t lo = moves[m][0], hi = moves[m][1], olo = o.lo, ohi = o.hi;
+    size_t first = ooc_page(&o, lo, hi, &u);
+    size_t from = lo < hi ? ls.l[lo].from : 0;
+    assert(o.lo == lo && o.hi == hi);
+    assert(u.n == (lo < hi ? ls.l[hi - 1].to - from : 0));
+    assert(same(&all, &u, from));
+    // kept the front: only what was added at the back changed
+    if (lo == olo && hi > ohi && ohi > lo)
+      assert(first == ls.l[ohi].from - from);
+    if (lo == olo && hi <= ohi)
+      assert(first == u.n);
+  }
+  ooc_free(&o);
+
+  // a layer too big to wait for comes in parts
+  ooc_init(&o, 0);
+  size_t max = ooc_layer_max;
+  ooc_layer_max = 1000;
+  segments_resize(&all, 0);
+  pack(&o, text, len, 50000, &all);
+  assert(o.n > ls.n && o.segments == all.n);
+  for (size_t k = 0; k < o.n; k++) {
+    assert(o.l[k].l.to - o.l[k].l.from <= 1000 + 50000);
+    assert(k == 0 || o.l[k].l.from == o.l[k - 1].l.to);
+    BoundingBox b = layers_box(&all, o.l[k].l.from, o.l[k].l.to);
+    assert(0 == memcmp(&b, &o.l[k].l.box, sizeof(b)));
+  }
+  ooc_get(0, all.n, &u, &o);
+  assert(same(&all, &u, 0));
+  ooc_layer_max = max;
+  ooc_free(&o);
+
+  layers_free(&ls);
+  segments_free(&all);
+  segments_free(&u);
+  free(text);
+  printf("ok\n");
+}
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+#include "layers.h"
+#include "packed.h"
+#include "segments.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/// bytes a resident segment costs: its columns and its share of the bvh
+#define OOC_SEGMENT_BYTES 64
+
+/// bytes of text parsed at a time when out of core
+#define OOC_WINDOW (16 << 20)
+
+/// a layer with more segments than this, like a CNC file that never
+/// extrudes, is packed in parts of about this many, 1 << 20 unless changed
+extern size_t ooc_layer_max;
+
+/// a layer kept packed: which segments of the file it has, and its outline
+typedef struct {
+  layer l;
+  packed p; // segments [l.from, l.to) of the file
+} ooc_layer;
+
+/// out of core: a file too big to hold as segments
+/// Every layer stays packed, and the segments of a run of them, as many as
+/// fit the budget, are decoded into a table of their own.
+typedef struct {
+  ooc_layer *l;
+  size_t n, cap;
+  size_t segments; // in every layer
+  size_t budget;   // bytes for the segments of the resident layers
+  size_t lo, hi;   // the resident layers
+} ooc;
+
+void ooc_init(ooc *o, size_t budget);
+
+void ooc_free(ooc *o);
+
+/// append n layers, which follow those already there, taking over their
+/// packed segments
+void ooc_add(ooc *o, ooc_layer *ls, size_t n);
+
+/// free n layers that were never added
+void ooc_layers_free(ooc_layer *ls, size_t n);
+
+/// the layers [lo, hi) out of want_lo..want_hi to keep resident: as many as
+/// fit the budget counting down from want_hi, or up from want_lo when
+/// bottom_up, and at least one
+void ooc_fit(const ooc *o, size_t want_lo, size_t want_hi, bool bottom_up,
+             size_t *lo, size_t *hi);
+
+/// make layers [lo, hi) resident
+/// t has the segments of the layers that were, and gets those of [lo, hi),
+/// decoding only layers it didn't have. Returns the first row of t that
+/// changed, or t->n when none did.
+size_t ooc_page(ooc *o, size_t lo, size_t hi, segments *t);
+
+/// segments [from, to) of the file into out, decoded from their layers
+/// Fits csv_fetch, with o the ooc.
+void ooc_get(size_t from, size_t to, segments *out, void *o);
+
+/// how the loader turns the segments it parses into packed layers
+typedef struct {
+  segments pending; // of the layer not known to be finished
+  size_t at;        // index in the file of pending's first segment
+  layers ls;
+} ooc_packer;
+
+void ooc_packer_init(ooc_packer *k);
+
+void ooc_packer_free(ooc_packer *k);
+
+/// add t, the segments that follow those added so far
+/// The layers finished by it, or all of them when last, go into a malloc()ed
+/// *out. Returns how many there are.
+size_t ooc_pack(ooc_packer *k, const segments *t, bool last, ooc_layer **out);
@@ -0,0 +1,366 @@
+#include "packed.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a tag byte starts every move
+#define TAG_KIND 3      // G0..G3
+#define TAG_DETACHED 4  // doesn't start where the last move ended
+#define TAG_ARC 8       // ai and aj follow
+#define TAG_KIND_BYTE 16 // G number >= 4, in the next byte
+#define TAG_SAME_AXES 32 // axes as the last move, else in the next byte
+#define TAG_ARC_UNITS 64 // ai and aj are varints of XYZ units, not floats
+
+// worst case bytes of a move: tag, kind, axes, then 10 byte varints for
+// start, end, arc and line
+#define MOVE_MAX (3 + 11 * 10)
+
+static const double scale[4] = {PACKED_XYZ_SCALE, PACKED_XYZ_SCALE,
+                                PACKED_XYZ_SCALE, PACKED_E_SCALE};
+static const double unit[4] = {1 / PACKED_XYZ_SCALE, 1 / PACKED_XYZ_SCALE,
+                               1 / PACKED_XYZ_SCALE, 1 / PACKED_E_SCALE};
+
+void packed_init(packed *p) { *p = (packed){0}; }
+
+void packed_free(packed *p) {
+  free(p->off);
+  free(p->data);
+  packed_init(p);
+}
+
+size_t packed_bytes(const packed *p) {
+  return sizeof(packed) + p->len + (p->nblocks + 1) * sizeof(size_t);
+}
+
+static float back(int64_t q, int a) { return (float)(q * unit[a]); }
+
+static bool same_bits(float a, float b) { return 0 == memcmp(&a, &b, 4); }
+
+// v as a whole number of units of axis a, if it comes back the same
+static bool fits(float v, int a, int64_t *q) {
+  double d = v * scale[a];
+  if (!(fabs(d) < 1e15)) // and NaN
+    return false;
+  *q = llrint(d);
+  return same_bits(back(*q, a), v);
+}
+
+static int64_t quantum(float v, int a) {
+  int64_t q;
+  fits(v, a, &q);
+  return q;
+}
+
+static uint8_t *put_varint(uint8_t *o, uint64_t v) {
+  while (v >= 0x80) {
+    *o++ = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  *o++ = (uint8_t)v;
+  return o;
+}
+
+static uint8_t *put_svarint(uint8_t *o, int64_t v) {
+  return put_varint(o, (uint64_t)v << 1 ^ (uint64_t)(v >> 63));
+}
+
+static uint8_t *put_float(uint8_t *o, float v) {
+  memcpy(o, &v, 4);
+  return o + 4;
+}
+
+static const uint8_t *get_varint(const uint8_t *i, uint64_t *v) {
+  // most deltas are a byte or two
+  if (i[0] < 0x80) {
+    *v = i[0];
+    return i + 1;
+  }
+  if (i[1] < 0x80) {
+    *v = (i[0] & 0x7f) | (uint64_t)i[1] << 7;
+    return i + 2;
+  }
+  uint64_t r = 0;
+  int s = 0;
+  do
+    r |= (uint64_t)(*i & 0x7f) << s, s += 7;
+  while (*i++ & 0x80);
+  *v = r;
+  return i;
+}
+
+static const uint8_t *get_svarint(const uint8_t *i, int64_t *v) {
+  uint64_t u;
+  i = get_varint(i, &u);
+  *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+  return i;
+}
+
+static const uint8_t *get_float(const uint8_t *i, float *v) {
+  memcpy(v, i, 4);
+  return i + 4;
+}
+
+typedef struct {
+  const float *c[8]; // x0 y0 z0 e0 x1 y1 z1 e1
+} columns;
+
+static columns columns_of(const segments *t) {
+  return (columns){{t->x0, t->y0, t->z0, t->e0, t->x1, t->y1, t->z1, t->e1}};
+}
+
+static uint8_t *encode(uint8_t *o, const segments *t, size_t from,
+                       size_t to) {
+  columns c = columns_of(t);
+  // axes with a value that isn't a whole number of units stay floats
+  uint8_t raw = 0;
+  int64_t q;
+  for (int a = 0; a < 4; a++)
+    for (size_t i = from; i < to && !(raw >> a & 1); i++)
+      if (!fits(c.c[a][i], a, &q) || !fits(c.c[4 + a][i], a, &q))
+        raw |= 1 << a;
+  *o++ = raw;
+  o = put_varint(o, t->line[from]);
+  int64_t at[4]; // where the last move ended, in units
+  for (int a = 0; a < 4; a++)
+    if (raw >> a & 1)
+      o = put_float(o, c.c[a][from]);
+    else
+      o = put_svarint(o, at[a] = quantum(c.c[a][from], a));
+
+  uint8_t axes = 0;
+  for (size_t i = from; i < to; i++) {
+    bool detached = false;
+    for (int a = 0; a < 4 && i > from; a++)
+      detached |= !same_bits(c.c[a][i], c.c[4 + a][i - 1]);
+    bool arc = !same_bits(t->ai[i], 0) || !same_bits(t->aj[i], 0);
+    int64_t qi, qj;
+    bool units = arc && fits(t->ai[i], 0, &qi) && fits(t->aj[i], 0, &qj);
+    uint8_t kind = t->kind[i];
+    *o++ = (kind < 4 ? kind : TAG_KIND_BYTE) | detached * TAG_DETACHED |
+           arc * TAG_ARC | units * TAG_ARC_UNITS |
+           (t->axes[i] == axes) * TAG_SAME_AXES;
+    if (kind >= 4)
+      *o++ = kind;
+    if (t->axes[i] != axes)
+      *o++ = axes = t->axes[i];
+    for (int a = 0; a < 4 && detached; a++)
+      if (raw >> a & 1) {
+        o = put_float(o, c.c[a][i]);
+      } else {
+        q = quantum(c.c[a][i], a);
+        o = put_svarint(o, q - at[a]);
+        at[a] = q;
+      }
+    for (int a = 0; a < 4; a++)
+      if (raw >> a & 1) {
+        o = put_float(o, c.c[4 + a][i]);
+      } else {
+        q = quantum(c.c[4 + a][i], a);
+        o = put_svarint(o, q - at[a]);
+        at[a] = q;
+      }
+    if (units) {
+      o = put_svarint(o, qi);
+      o = put_svarint(o, qj);
+    } else if (arc) {
+      o = put_float(o, t->ai[i]);
+      o = put_float(o, t->aj[i]);
+    }
+    if (i > from)
+      o = put_svarint(o, (int64_t)(t->line[i] - t->line[i - 1]));
+  }
+  return o;
+}
+
+// rows [at, at + n) of t from the block at i
+static void decode(const uint8_t *i, segments *t, size_t at, size_t n) {
+  float *c[8] = {t->x0, t->y0, t->z0, t->e0, t->x1, t->y1, t->z1, t->e1};
+  uint8_t raw = *i++;
+  uint64_t line;
+  i = get_varint(i, &line);
+  int64_t q[4], d;
+  float start[4];
+  for (int a = 0; a < 4; a++)
+    if (raw >> a & 1) {
+      i = get_float(i, &start[a]);
+    } else {
+      i = get_svarint(i, &q[a]);
+      start[a] = back(q[a], a);
+    }
+
+  uint8_t axes = 0;
+  for (size_t k = at; k < at + n; k++) {
+    uint8_t tag = *i++;
+    t->kind[k] = tag & TAG_KIND_BYTE ? *i++ : tag & TAG_KIND;
+    if (!(tag & TAG_SAME_AXES))
+      axes = *i++;
+    t->axes[k] = axes;
+    for (int a = 0; a < 4; a++) {
+      if (tag & TAG_DETACHED) {
+        if (raw >> a & 1) {
+          i = get_float(i, &start[a]);
+        } else {
+          i = get_svarint(i, &d);
+          start[a] = back(q[a] += d, a);
+        }
+      }
+      c[a][k] = start[a];
+    }
+    for (int a = 0; a < 4; a++) {
+      if (raw >> a & 1) {
+        i = get_float(i, &start[a]);
+      } else {
+        i = get_svarint(i, &d);
+        start[a] = back(q[a] += d, a);
+      }
+      c[4 + a][k] = start[a];
+    }
+    if (tag & TAG_ARC_UNITS) {
+      i = get_svarint(i, &d);
+      t->ai[k] = back(d, 0);
+      i = get_svarint(i, &d);
+      t->aj[k] = back(d, 0);
+    } else if (tag & TAG_ARC) {
+      i = get_float(i, &t->ai[k]);
+      i = get_float(i, &t->aj[k]);
+    } else {
+      t->ai[k] = t->aj[k] = 0;
+    }
+    if (k > at) {
+      i = get_svarint(i, &d);
+      line += d;
+    }
+    t->line[k] = line;
+  }
+}
+
+void packed_build(packed *p, const segments *t, size_t from, size_t to) {
+  p->n = to - from;
+  p->nblocks = (p->n + PACKED_BLOCK - 1) / PACKED_BLOCK;
+  p->off = realloc(p->off, (p->nblocks + 1) * sizeof(size_t));
+  p->len = 0;
+  for (size_t b = 0; b < p->nblocks; b++) {
+    if (p->cap - p->len < PACKED_BLOCK * MOVE_MAX + 64) {
+      p->cap = 2 * p->cap + PACKED_BLOCK * MOVE_MAX + 64;
+      p->data = realloc(p->data, p->cap);
+    }
+    if (!p->data || !p->off) {
+      fprintf(stderr, "out of memory packing %zu segments\n", p->n);
+      exit(-1);
+    }
+    size_t i = from + b * PACKED_BLOCK,
+           e = i + PACKED_BLOCK < to ? i + PACKED_BLOCK : to;
+    p->off[b] = p->len;
+    p->len = encode(p->data + p->len, t, i, e) - p->data;
+  }
+  p->off[p->nblocks] = p->len;
+  // the slack was only for the worst case
+  if (p->len)
+    p->data = realloc(p->data, p->cap = p->len);
+}
+
+static size_t block_size(const packed *p, size_t b) {
+  return b + 1 < p->nblocks ? PACKED_BLOCK : p->n - b * PACKED_BLOCK;
+}
+
+void packed_block(const packed *p, size_t b, segments *out) {
+  segments_resize(out, block_size(p, b));
+  decode(p->data + p->off[b], out, 0, out->n);
+}
+
+void packed_get(const packed *p, size_t from, size_t to, segments *out) {
+  if (to > p->n)
+    to = p->n;
+  if (from >= to) {
+    segments_resize(out, 0);
+    return;
+  }
+  size_t b0 = from / PACKED_BLOCK, b1 = (to - 1) / PACKED_BLOCK + 1;
+  segments_resize(out, (b1 - 1) * PACKED_BLOCK + block_size(p, b1 - 1) -
+                           b0 * PACKED_BLOCK);
+  for (size_t b = b0; b < b1; b++)
+    decode(p->data + p->off[b], out, (b - b0) * PACKED_BLOCK,
+           block_size(p, b));
+  segments none;
+  segments_init(&none);
+  segments_splice(out, 0, from - b0 * PACKED_BLOCK, &none);
+  segments_resize(out, to - from);
+}
+
+#ifdef TESTING
+#include "gcode.h"
+#include "synth.h"
+#include <assert.h>
+
+static bool same(const segments *a, const segments *b, size_t from) {
+  return a->n >= from && 0 == memcmp(a->x0 + from, b->x0, b->n * 4) &&
+         0 == memcmp(a->y0 + from, b->y0, b->n * 4) &&
+         0 == memcmp(a->z0 + from, b->z0, b->n * 4) &&
+         0 == memcmp(a->e0 + from, b->e0, b->n * 4) &&
+         0 == memcmp(a->x1 + from, b->x1, b->n * 4) &&
+         0 == memcmp(a->y1 + from, b->y1, b->n * 4) &&
+         0 == memcmp(a->z1 + from, b->z1, b->n * 4) &&
+         0 == memcmp(a->e1 + from, b->e1, b->n * 4) &&
+         0 == memcmp(a->ai + from, b->ai, b->n * 4) &&
+         0 == memcmp(a->aj + from, b->aj, b->n * 4) &&
+         0 == memcmp(a->kind + from, b->kind, b->n) &&
+         0 == memcmp(a->axes + from, b->axes, b->n) &&
+         0 == memcmp(a->line + from, b->line, b->n * sizeof(size_t));
+}
+
+int main() {
+  // a sliced looking file, with arcs, comments and relative layers
+  synth_opts o = SYNTH_DEFAULTS;
+  o.layers = 20;
+  o.arcs = 20;
+  o.relative = 30;
+  size_t len;
+  char *text = synth_gcode(&o, &len);
+  segments t, u;
+  segments_init(&t);
+  segments_init(&u);
+  gcode_parse(&t, text, text + len, NULL, 0);
+  free(text);
+  // and the odd things a file can have
+  segments_push(&t, (Vector4){-0.0f, 1e30f, NAN, 0.1f},
+                (Vector4){1e-7f, -INFINITY, 5, 0.33333334f}, 28, 0xff,
+                len + 5);
+  segments_push(&t, (Vector4){1, 2, 3, 4}, (Vector4){1.0005f, 2, 3, 4}, 92,
+                0, len);
+  t.ai[t.n - 1] = NAN;
+
+  packed p;
+  packed_init(&p);
+  packed_build(&p, &t, 0, t.n);
+  assert(p.n == t.n);
+  // a fraction of the columns
+  size_t columns = t.n * (10 * 4 + 2 + sizeof(size_t));
+  assert(packed_bytes(&p) * 3 < columns);
+
+  // every block, and stretches across them, come back bit for bit
+  for (size_t b = 0; b < p.nblocks; b++) {
+    packed_block(&p, b, &u);
+    assert(u.n == (b + 1 < p.nblocks ? PACKED_BLOCK : t.n % PACKED_BLOCK) &&
+           same(&t, &u, b * PACKED_BLOCK));
+  }
+  size_t cuts[][2] = {{0, 0}, {0, 1}, {5, 64}, {63, 65}, {100, 1000},
+                      {t.n - 70, t.n}, {0, t.n}, {t.n - 1, t.n + 10}};
+  for (size_t k = 0; k < sizeof(cuts) / sizeof(cuts[0]); k++) {
+    packed_get(&p, cuts[k][0], cuts[k][1], &u);
+    size_t to = cuts[k][1] < t.n ? cuts[k][1] : t.n;
+    assert(u.n == to - cuts[k][0] && same(&t, &u, cuts[k][0]));
+  }
+
+  // a part of a table
+  packed_build(&p, &t, 1000, 1130);
+  packed_get(&p, 0, 130, &u);
+  assert(p.nblocks == 3 && same(&t, &u, 1000));
+
+  packed_free(&p);
+  segments_free(&t);
+  segments_free(&u);
+  printf("ok\n");
+}
+#endif
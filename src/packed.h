@@ -0,0 +1,43 @@
+#pragma once
+#include "segments.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/// segments per block, the unit of decoding: BVH_LEAF divides it, so a
+/// block is whole leaves
+#define PACKED_BLOCK 64
+
+/// what one unit of a coordinate is: 1 µm for XYZ, 10 nL-ish for E
+#define PACKED_XYZ_SCALE 1000.0
+#define PACKED_E_SCALE 100000.0
+
+/// segments in a fraction of the memory, read back a block at a time
+/// Coordinates are whole units, each block starting from an absolute point
+/// and every move after it from where the one before ended, as zigzag
+/// varints. A move that doesn't start where the last one ended says so and
+/// pays for its start. An axis of a block with a value that wouldn't come
+/// back as the same float, like E after many relative moves, keeps that
+/// axis as floats in that block. So decoding gives back exactly what was
+/// packed, bit for bit.
+typedef struct {
+  size_t n, nblocks;
+  size_t *off; // block b is data[off[b]..off[b + 1])
+  uint8_t *data;
+  size_t len, cap;
+} packed;
+
+void packed_init(packed *p);
+
+void packed_free(packed *p);
+
+/// replace p with segments [from, to) of t
+void packed_build(packed *p, const segments *t, size_t from, size_t to);
+
+/// replace out with block b of p: segments [b, b + 1) * PACKED_BLOCK
+void packed_block(const packed *p, size_t b, segments *out);
+
+/// replace out with segments [from, to) of p, decoding only their blocks
+void packed_get(const packed *p, size_t from, size_t to, segments *out);
+
+/// bytes p takes up, for comparing against the columns it came from
+size_t packed_bytes(const packed *p);
@@ -0,0 +1,246 @@
+#include "prof.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// threads with a ring, counting ones that exited and left it for another
+#define PROF_THREADS 256
+
+typedef struct {
+  const char *name;
+  uint64_t t0, t1;
+} event;
+
+typedef struct {
+  event ev[PROF_RING];
+  uint64_t head;    // events ever recorded, the latest at head - 1
+  atomic_bool free; // its thread exited, so another can have it
+  int tid;
+  char name[32];
+  uint64_t frame[2]; // the last whole frame is [frame[0], frame[1])
+} ring;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static ring *rings[PROF_THREADS];
+static int nrings;
+static _Thread_local ring *mine;
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static const char frame_name[] = "frame";
+
+static void release(void *r) { atomic_store(&((ring *)r)->free, true); }
+
+static void make_key() { pthread_key_create(&key, release); }
+
+// the calling thread's ring, or NULL once there are PROF_THREADS of them
+static ring *get() {
+  if (mine)
+    return mine;
+  pthread_once(&once, make_key);
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < nrings && !mine; i++)
+    if (atomic_load(&rings[i]->free))
+      mine = rings[i];
+  if (!mine && nrings < PROF_THREADS) {
+    // calloc()ed pages cost nothing until the ring gets that far
+    mine = calloc(1, sizeof(ring));
+    if (mine)
+      mine->tid = nrings, rings[nrings++] = mine;
+  }
+  if (mine) {
+    atomic_store(&mine->free, false);
+    snprintf(mine->name, sizeof(mine->name), "thread %d", mine->tid);
+    mine->frame[0] = mine->frame[1] = 0;
+    pthread_setspecific(key, mine);
+  }
+  pthread_mutex_unlock(&lock);
+  return mine;
+}
+
+uint64_t prof_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+prof_span prof_begin(const char *name) { return (prof_span){name, prof_now()}; }
+
+static void record(ring *r, const char *name, uint64_t t0, uint64_t t1) {
+  r->ev[r->head % PROF_RING] = (event){name, t0, t1};
+  r->head++;
+}
+
+void prof_end(prof_span *s) {
+  ring *r = get();
+  if (r)
+    record(r, s->name, s->t0, prof_now());
+}
+
+void prof_thread_name(const char *name) {
+  ring *r = get();
+  if (r)
+    snprintf(r->name, sizeof(r->name), "%s", name);
+}
+
+void prof_frame() {
+  ring *r = get();
+  if (!r)
+    return;
+  uint64_t now = prof_now();
+  if (r->frame[1])
+    record(r, frame_name, r->frame[1], now);
+  r->frame[0] = r->frame[1] ? r->frame[1] : now;
+  r->frame[1] = now;
+}
+
+size_t prof_last_frame(prof_stage *out, size_t max, uint64_t *frame_ns) {
+  ring *r = get();
+  if (frame_ns)
+    *frame_ns = r ? r->frame[1] - r->frame[0] : 0;
+  if (!r || r->frame[0] == r->frame[1])
+    return 0;
+  // events go in as they end, so the frame's are the last few
+  uint64_t oldest = r->head > PROF_RING ? r->head - PROF_RING : 0,
+           first = r->head;
+  while (first > oldest && r->ev[(first - 1) % PROF_RING].t1 >= r->frame[0])
+    first--;
+  size_t n = 0;
+  for (uint64_t k = first; k < r->head; k++) {
+    const event *e = &r->ev[k % PROF_RING];
+    if (e->name == frame_name || e->t0 < r->frame[0] || e->t1 > r->frame[1])
+      continue;
+    size_t j = 0;
+    while (j < n && strcmp(out[j].name, e->name))
+      j++;
+    if (j == n) {
+      if (n == max)
+        continue;
+      out[n++] = (prof_stage){e->name, 0, 0};
+    }
+    out[j].ns += e->t1 - e->t0;
+    out[j].count++;
+  }
+  return n;
+}
+
+uint64_t prof_last_ns(const char *name) {
+  ring *r = get();
+  if (!r)
+    return 0;
+  uint64_t oldest = r->head > PROF_RING ? r->head - PROF_RING : 0;
+  for (uint64_t k = r->head; k > oldest; k--) {
+    const event *e = &r->ev[(k - 1) % PROF_RING];
+    if (0 == strcmp(e->name, name))
+      return e->t1 - e->t0;
+  }
+  return 0;
+}
+
+bool prof_dump(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  pthread_mutex_lock(&lock);
+  bool comma = false;
+  for (int i = 0; i < nrings; i++) {
+    ring *r = rings[i];
+    fprintf(f,
+            "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+            comma ? ",\n" : "", r->tid, r->name);
+    comma = true;
+    uint64_t oldest = r->head > PROF_RING ? r->head - PROF_RING : 0;
+    for (uint64_t k = oldest; k < r->head; k++) {
+      const event *e = &r->ev[k % PROF_RING];
+      // microseconds
+      fprintf(f,
+              ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+              "\"ts\": %.3f, \"dur\": %.3f}",
+              e->name, r->tid, e->t0 / 1e3, (e->t1 - e->t0) / 1e3);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  fprintf(f, "\n]}\n");
+  return 0 == fclose(f);
+}
+
+#ifdef TESTING
+#include <assert.h>
+#include <unistd.h>
+
+static void *worker(void *p) {
+  prof_thread_name("worker");
+  for (int i = 0; i < 3; i++) {
+    PROF_SCOPE("work");
+    usleep(100);
+  }
+  return p;
+}
+
+int main() {
+  prof_thread_name("main");
+  prof_frame();
+  {
+    PROF_SCOPE("outer");
+    for (int i = 0; i < 2; i++) {
+      PROF_SCOPE("inner");
+      usleep(1000);
+    }
+  }
+  prof_frame();
+
+  // the last frame has both names, in the order they ended
+  prof_stage st[8];
+  uint64_t frame;
+  size_t n = prof_last_frame(st, 8, &frame);
+  assert(n == 2 && 0 == strcmp(st[0].name, "inner") && st[0].count == 2);
+  assert(0 == strcmp(st[1].name, "outer") && st[1].count == 1);
+  assert(st[0].ns >= 2000000 && st[1].ns >= st[0].ns && frame >= st[1].ns);
+  assert(prof_last_ns("outer") == st[1].ns && prof_last_ns("nothing") == 0);
+
+  // an empty frame, and one with more names than room
+  prof_frame();
+  assert(prof_last_frame(st, 8, &frame) == 0);
+  {
+    PROF_SCOPE("a");
+    PROF_SCOPE("b");
+  }
+  prof_frame();
+  assert(prof_last_frame(st, 1, NULL) == 1 && 0 == strcmp(st[0].name, "b"));
+
+  // threads get their own rings, and the rings of finished ones are reused
+  for (int k = 0; k < 2; k++) {
+    pthread_t th[4];
+    for (int i = 0; i < 4; i++)
+      pthread_create(&th[i], NULL, worker, NULL);
+    for (int i = 0; i < 4; i++)
+      pthread_join(th[i], NULL);
+  }
+  assert(nrings >= 2 && nrings <= 5);
+
+  // the ring keeps the latest spans
+  for (int i = 0; i < PROF_RING + 10; i++) {
+    PROF_SCOPE("many");
+  }
+  assert(prof_last_ns("many") < 1000000 && prof_last_ns("outer") == 0);
+
+  const char *path = "test_prof.json";
+  assert(prof_dump(path));
+  FILE *f = fopen(path, "r");
+  char line[256];
+  int work = 0, names = 0;
+  while (fgets(line, sizeof(line), f)) {
+    work += NULL != strstr(line, "\"work\"");
+    names += NULL != strstr(line, "thread_name");
+  }
+  fclose(f);
+  unlink(path);
+  assert(work == 24 && names == nrings);
+  printf("ok\n");
+}
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// scoped timers, kept per thread in a ring of the last PROF_RING spans
+/// Recording a span is two clock reads and a store, so they stay on.
+/// Names are string literals: spans are kept by pointer.
+#define PROF_RING (1 << 15)
+
+typedef struct {
+  const char *name;
+  uint64_t t0;
+} prof_span;
+
+/// nanoseconds on the monotonic clock
+uint64_t prof_now();
+
+prof_span prof_begin(const char *name);
+
+/// record s on the calling thread's ring
+void prof_end(prof_span *s);
+
+#define PROF_CAT_(a, b) a##b
+#define PROF_CAT(a, b) PROF_CAT_(a, b)
+/// time from here to the end of the enclosing block
+#define PROF_SCOPE(name)                                                      \
+  prof_span PROF_CAT(prof_span_, __LINE__)                                    \
+      __attribute__((cleanup(prof_end))) = prof_begin(name)
+
+/// name the calling thread's track in the trace
+void prof_thread_name(const char *name);
+
+/// end a frame of the calling thread and start the next one
+void prof_frame();
+
+/// time one name took in the last whole frame
+typedef struct {
+  const char *name;
+  uint64_t ns;
+  unsigned count;
+} prof_stage;
+
+/// the spans of the calling thread in its last whole frame, summed by name
+/// in the order they ended, at most max of them. Returns how many, and the
+/// length of the frame in frame_ns.
+size_t prof_last_frame(prof_stage *out, size_t max, uint64_t *frame_ns);
+
+/// how long the calling thread's latest span called name took, or 0
+uint64_t prof_last_ns(const char *name);
+
+/// write every thread's ring to path as Chrome trace JSON, for
+/// chrome://tracing or ui.perfetto.dev
+/// Threads that are still recording should be done first.
+bool prof_dump(const char *path);
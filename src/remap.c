@@ -0,0 +1,411 @@
+#include "remap.h"
+#include "prof.h"
+#include "raymath.h"
+#include "segdistance.h"
+#include "simd.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static Vector3 Vector4To3(Vector4 a) { return (Vector3){a.x, a.y, a.z}; }
+
+segment_distance_kind segment_distance = SEGMENT_DISTANCE_F1;
+
+double SegmentDistanceF1(Vector3 p0, Vector3 p1, Vector3 q0, Vector3 q1) {
+  // d = p0-q0
+  // dd = (p1-p0) - (q1-q0)
+  Vector3 d = Vector3Subtract(p0, q0), dp = Vector3Subtract(p1, p0),
+          dq = Vector3Subtract(q1, q0), dd = Vector3Subtract(dp, dq);
+  // f1 divides by |dd|, but then p(s)-q(s) is d all along
+  if (Vector3LengthSqr(dd) == 0)
+    return Vector3Length(d);
+  // f1 wants dd turned to x, but only needs d along it and d across it
+  double len = Vector3Length(dd);
+  return f1(Vector3DotProduct(d, dd) / len, len,
+            Vector3Length(Vector3CrossProduct(d, dd)) / len, 0);
+}
+
+// Gauss–Legendre on [0, 1]
+#define GAUSS_N 8
+static const float gauss_x[GAUSS_N] = {
+    0.0198550717512319f, 0.1016667612931866f, 0.2372337950418355f,
+    0.4082826787521751f, 0.5917173212478249f, 0.7627662049581645f,
+    0.8983332387068134f, 0.9801449282487681f};
+static const float gauss_w[GAUSS_N] = {
+    0.0506142681451881f, 0.1111905172266872f, 0.1568533229389436f,
+    0.1813418916891810f, 0.1813418916891810f, 0.1568533229389436f,
+    0.1111905172266872f, 0.0506142681451881f};
+
+// the mean of |d + dd s| for s from 0 to 1
+// That is smooth but where it is least, which is nearly a corner when the
+// segments nearly cross. So the rule is used on either side of that point,
+// with the nodes bunched up towards it by going x^2 of the way out.
+static inline float gauss_mean(float dx, float dy, float dz, float ex,
+                               float ey, float ez) {
+  float ee = ex * ex + ey * ey + ez * ez,
+        de = dx * ex + dy * ey + dz * ez;
+  float m = ee > 0 ? Clamp(-de / ee, 0, 1) : 0, sum = 0;
+  for (int k = 0; k < GAUSS_N; k++) {
+    float x2 = gauss_x[k] * gauss_x[k], w = 2 * gauss_x[k] * gauss_w[k];
+    float s = m - m * x2, u = m + (1 - m) * x2;
+    float a = sqrtf((dx + ex * s) * (dx + ex * s) +
+                    (dy + ey * s) * (dy + ey * s) +
+                    (dz + ez * s) * (dz + ez * s)),
+          b = sqrtf((dx + ex * u) * (dx + ex * u) +
+                    (dy + ey * u) * (dy + ey * u) +
+                    (dz + ez * u) * (dz + ez * u));
+    sum += w * (m * a + (1 - m) * b);
+  }
+  return sum;
+}
+
+double SegmentDistanceGauss(Vector3 p0, Vector3 p1, Vector3 q0, Vector3 q1) {
+  Vector3 d = Vector3Subtract(p0, q0),
+          dd = Vector3Subtract(Vector3Subtract(p1, p0), Vector3Subtract(q1, q0));
+  return gauss_mean(d.x, d.y, d.z, dd.x, dd.y, dd.z);
+}
+
+// gauss_mean() for rows [k, k + GAUSS_N) of p and q, a row per lane
+static inline void gauss_lanes(const segments *p, const segments *q, size_t k,
+                               float *out) {
+  float dx[GAUSS_N], dy[GAUSS_N], dz[GAUSS_N], ex[GAUSS_N], ey[GAUSS_N],
+      ez[GAUSS_N], m[GAUSS_N];
+  for (int i = 0; i < GAUSS_N; i++) {
+    size_t j = k + i;
+    dx[i] = p->x0[j] - q->x0[j];
+    dy[i] = p->y0[j] - q->y0[j];
+    dz[i] = p->z0[j] - q->z0[j];
+    ex[i] = p->x1[j] - p->x0[j] - (q->x1[j] - q->x0[j]);
+    ey[i] = p->y1[j] - p->y0[j] - (q->y1[j] - q->y0[j]);
+    ez[i] = p->z1[j] - p->z0[j] - (q->z1[j] - q->z0[j]);
+    float ee = ex[i] * ex[i] + ey[i] * ey[i] + ez[i] * ez[i],
+          de = dx[i] * ex[i] + dy[i] * ey[i] + dz[i] * ez[i];
+    m[i] = ee > 0 ? Clamp(-de / ee, 0, 1) : 0;
+    out[i] = 0;
+  }
+  for (int n = 0; n < GAUSS_N; n++) {
+    float x2 = gauss_x[n] * gauss_x[n], w = 2 * gauss_x[n] * gauss_w[n];
+    for (int i = 0; i < GAUSS_N; i++) {
+      float s = m[i] - m[i] * x2, u = m[i] + (1 - m[i]) * x2;
+      float a = sqrtf((dx[i] + ex[i] * s) * (dx[i] + ex[i] * s) +
+                      (dy[i] + ey[i] * s) * (dy[i] + ey[i] * s) +
+                      (dz[i] + ez[i] * s) * (dz[i] + ez[i] * s)),
+            b = sqrtf((dx[i] + ex[i] * u) * (dx[i] + ex[i] * u) +
+                      (dy[i] + ey[i] * u) * (dy[i] + ey[i] * u) +
+                      (dz[i] + ez[i] * u) * (dz[i] + ez[i] * u));
+      out[i] += w * (m[i] * a + (1 - m[i]) * b);
+    }
+  }
+}
+
+VECTORIZED void SegmentDistanceBatch(const segments *p, const segments *q,
+                                     size_t n, float *out) {
+  size_t k = 0;
+  for (; k + GAUSS_N <= n; k += GAUSS_N)
+    gauss_lanes(p, q, k, out + k);
+  for (; k < n; k++)
+    out[k] = SegmentDistanceGauss(Vector4To3(segments_start(p, k)),
+                                  Vector4To3(segments_end(p, k)),
+                                  Vector4To3(segments_start(q, k)),
+                                  Vector4To3(segments_end(q, k)));
+}
+
+double SegmentDistance(Vector3 p0, Vector3 p1, Vector3 q0, Vector3 q1) {
+  return segment_distance == SEGMENT_DISTANCE_GAUSS
+             ? SegmentDistanceGauss(p0, p1, q0, q1)
+             : SegmentDistanceF1(p0, p1, q0, q1);
+}
+
+// pairs of moves like those in a layer: up to 5 mm long, up to 5 mm apart,
+// with every so often a pair that crosses
+static void some_pairs(Vector3 (*pairs)[4], size_t n) {
+  uint32_t x = 7;
+  for (size_t k = 0; k < n; k++)
+    for (int e = 0; e < 4; e++) {
+      float c[3];
+      for (int i = 0; i < 3; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        c[i] = (x >> 8) / (float)(1 << 24) * 5;
+      }
+      pairs[k][e] = (Vector3){c[0], c[1], k % 8 ? c[2] / 25 : 0};
+    }
+}
+
+segment_distance_kind segment_distance_fastest(double max_error,
+                                               double *error) {
+  enum { N = 4096 };
+  Vector3(*pairs)[4] = malloc(N * sizeof(pairs[0]));
+  if (!pairs)
+    return SEGMENT_DISTANCE_F1;
+  some_pairs(pairs, N);
+  volatile double sink = 0;
+  uint64_t t[2] = {UINT64_MAX, UINT64_MAX};
+  for (int round = 0; round < 4; round++) {
+    int kind = round % 2;
+    uint64_t t0 = prof_now();
+    for (size_t k = 0; k < N; k++) {
+      Vector3 *p = pairs[k];
+      sink += kind ? SegmentDistanceGauss(p[0], p[1], p[2], p[3])
+                   : SegmentDistanceF1(p[0], p[1], p[2], p[3]);
+    }
+    uint64_t dt = prof_now() - t0;
+    t[kind] = dt < t[kind] ? dt : t[kind];
+  }
+  double worst = 0;
+  for (size_t k = 0; k < N; k++) {
+    Vector3 *p = pairs[k];
+    double e = fabs(SegmentDistanceGauss(p[0], p[1], p[2], p[3]) -
+                    SegmentDistanceF1(p[0], p[1], p[2], p[3]));
+    worst = e > worst ? e : worst;
+  }
+  free(pairs);
+  if (error)
+    *error = worst;
+  return worst <= max_error && t[1] < t[0] ? SEGMENT_DISTANCE_GAUSS
+                                           : SEGMENT_DISTANCE_F1;
+}
+
+double SegmentDistance4(Vector4 ps[2], Vector4 qs[2]) {
+  return SegmentDistance(Vector4To3(ps[0]), Vector4To3(ps[1]),
+                         Vector4To3(qs[0]), Vector4To3(qs[1]));
+}
+
+typedef struct {
+  const segments *old, *t;
+  const bvh *b;
+  const size_t *rows;
+  size_t n;
+  uint8_t *taken; // a bit per segment of t
+  size_t *out;
+  double *dist;
+  atomic_size_t next;
+} job;
+
+typedef struct {
+  const job *j;
+  Vector4 q[2];
+} query;
+
+static bool is_taken(const uint8_t *taken, size_t i) {
+  return taken[i / 8] >> (i % 8) & 1;
+}
+
+static void take(uint8_t *taken, size_t i) { taken[i / 8] |= 1 << (i % 8); }
+
+// SegmentDistance() is the mean distance between points at the same
+// fraction along both segments, so it's at least the distance between the
+// middle points, which is what bvh_nearest() needs
+static double distance_to(size_t i, void *ud) {
+  const query *q = ud;
+  if (is_taken(q->j->taken, i))
+    return INFINITY;
+  Vector4 p[2] = {segments_start(q->j->t, i), segments_end(q->j->t, i)};
+  return SegmentDistance4(p, (Vector4 *)q->q);
+}
+
+static size_t match(const job *j, size_t k, double *d) {
+  size_t r = j->rows[k];
+  query q = {j, {segments_start(j->old, r), segments_end(j->old, r)}};
+  Vector3 mid =
+      Vector3Scale(Vector3Add(Vector4To3(q.q[0]), Vector4To3(q.q[1])), 0.5f);
+  long i = bvh_nearest(j->b, mid, distance_to, &q, d);
+  return i < 0 ? REMAP_NONE : (size_t)i;
+}
+
+static void *worker(void *p) {
+  job *j = p;
+  PROF_SCOPE("remap_match");
+  size_t k;
+  while ((k = atomic_fetch_add(&j->next, 1)) < j->n)
+    j->out[k] = match(j, k, &j->dist[k]);
+  return NULL;
+}
+
+typedef struct {
+  double d;
+  size_t k;
+} ranked;
+
+static int by_distance(const void *a, const void *b) {
+  const ranked *x = a, *y = b;
+  if (x->d != y->d)
+    return x->d < y->d ? -1 : 1;
+  return x->k < y->k ? -1 : x->k > y->k;
+}
+
+void remap(const segments *old, const size_t *rows, size_t n,
+           const segments *t, const bvh *b, const size_t *reserved,
+           size_t nreserved, size_t *out, int nthreads) {
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+  if ((size_t)nthreads > n)
+    nthreads = n ? n : 1;
+
+  job j = {.old = old,
+           .t = t,
+           .b = b,
+           .rows = rows,
+           .n = n,
+           .taken = calloc(t->n / 8 + 1, 1),
+           .out = out,
+           .dist = malloc(n * sizeof(double) + 1)};
+  ranked *order = malloc(n * sizeof(ranked) + 1);
+  if (!j.taken || !j.dist || !order) {
+    fprintf(stderr, "out of memory remapping %zu segments\n", n);
+    exit(-1);
+  }
+  for (size_t i = 0; i < nreserved; i++)
+    if (reserved[i] < t->n)
+      take(j.taken, reserved[i]);
+
+  // everyone looks for their closest segment at the same time
+  pthread_t th[nthreads > 1 ? nthreads - 1 : 1];
+  for (int i = 0; i < nthreads - 1; i++)
+    pthread_create(&th[i], NULL, worker, &j);
+  worker(&j);
+  for (int i = 0; i < nthreads - 1; i++)
+    pthread_join(th[i], NULL);
+
+  // then the closest pairs win, and whoever lost looks again among the
+  // segments that are left
+  for (size_t k = 0; k < n; k++)
+    order[k] = (ranked){j.dist[k], k};
+  qsort(order, n, sizeof(ranked), by_distance);
+  for (size_t o = 0; o < n; o++) {
+    size_t k = order[o].k;
+    if (out[k] != REMAP_NONE && is_taken(j.taken, out[k]))
+      out[k] = match(&j, k, &j.dist[k]);
+    if (out[k] != REMAP_NONE)
+      take(j.taken, out[k]);
+  }
+
+  free(order);
+  free(j.dist);
+  free(j.taken);
+}
+
+#ifdef TESTING
+#include <assert.h>
+
+static float frand(float lo, float hi) {
+  return lo + (hi - lo) * (float)rand() / RAND_MAX;
+}
+
+int main() {
+  // layers of short moves
+  segments t, old;
+  segments_init(&t);
+  segments_init(&old);
+  srand(7);
+  Vector4 p = {0, 0, 0, 0};
+  for (int i = 0; i < 20000; i++) {
+    Vector4 q = {p.x + frand(-2, 2), p.y + frand(-2, 2), i / 500 * 0.2f,
+                 p.w + 0.1f};
+    segments_push(&t, p, q, 1, 0, 0);
+    p = q;
+  }
+  bvh b = {0};
+  bvh_build(&b, &t);
+
+  // the same segments map to themselves
+  size_t rows[100], out[100], reserved[1];
+  for (int k = 0; k < 100; k++)
+    rows[k] = k * 197;
+  segments_copy(&old, &t, 0, t.n);
+  remap(&old, rows, 100, &t, &b, NULL, 0, out, 4);
+  for (int k = 0; k < 100; k++)
+    assert(out[k] == rows[k]);
+
+  // the Gauss rule is close to f1() for pairs of moves, crossing or not,
+  // and the batch gives the same as one at a time
+  double worst = 0;
+  segments ps, qs;
+  segments_init(&ps);
+  segments_init(&qs);
+  for (int k = 0; k < 10000; k++) {
+    Vector4 p[4];
+    for (int e = 0; e < 4; e++)
+      p[e] = (Vector4){frand(-5, 5), frand(-5, 5), k % 2 ? frand(-1, 1) : 0};
+    segments_push(&ps, p[0], p[1], 1, 0, 0);
+    segments_push(&qs, p[2], p[3], 1, 0, 0);
+    double f = SegmentDistanceF1(Vector4To3(p[0]), Vector4To3(p[1]),
+                                 Vector4To3(p[2]), Vector4To3(p[3])),
+           g = SegmentDistanceGauss(Vector4To3(p[0]), Vector4To3(p[1]),
+                                    Vector4To3(p[2]), Vector4To3(p[3]));
+    worst = fmax(worst, fabs(f - g));
+  }
+  float *d = malloc(ps.n * sizeof(float));
+  SegmentDistanceBatch(&ps, &qs, ps.n, d);
+  for (size_t k = 0; k < ps.n; k++)
+    assert(fabsf(d[k] - SegmentDistanceGauss(
+                            Vector4To3(segments_start(&ps, k)),
+                            Vector4To3(segments_end(&ps, k)),
+                            Vector4To3(segments_start(&qs, k)),
+                            Vector4To3(segments_end(&qs, k)))) <= 1e-5f);
+  free(d);
+  segments_free(&ps);
+  segments_free(&qs);
+  printf("gauss: %g mm from f1 at most\n", worst);
+  assert(worst < 1e-3);
+  double error;
+  segment_distance_fastest(1e-3, &error);
+  assert(error < 1e-3);
+
+  // slightly moved segments map to the closest one, as found by scanning
+  // everything, and when two want the same one the farther gets another
+  for (size_t i = 0; i < old.n; i++) {
+    old.x0[i] += 0.01f;
+    old.x1[i] += 0.01f;
+  }
+  for (int k = 0; k < 100; k++)
+    rows[k] = k < 50 ? rand() % t.n : rows[k - 50];
+  reserved[0] = rows[99];
+  // with either way of measuring
+  for (int kind = 0; kind < 2; kind++) {
+    segment_distance = kind;
+    remap(&old, rows, 100, &t, &b, reserved, 1, out, 4);
+    for (int k = 0; k < 100; k++) {
+      assert(out[k] != REMAP_NONE && out[k] != reserved[0]);
+      for (int l = 0; l < k; l++)
+        assert(out[l] != out[k]);
+      Vector4 q[2] = {segments_start(&old, rows[k]),
+                      segments_end(&old, rows[k])};
+      double best = INFINITY, d = 0;
+      for (size_t i = 0; i < t.n; i++) {
+        Vector4 s[2] = {segments_start(&t, i), segments_end(&t, i)};
+        double di = SegmentDistance4(s, q);
+        if (i == out[k])
+          d = di;
+        if (di < best)
+          best = di;
+      }
+      // only the rows that lost their closest segment are farther
+      bool lost = false;
+      for (int l = 0; l < 100; l++)
+        lost |= l != k && rows[l] == rows[k];
+      lost |= rows[k] == reserved[0];
+      assert(d == best || lost);
+    }
+  }
+  segment_distance = SEGMENT_DISTANCE_F1;
+
+  // nothing to find in an empty table
+  segments_free(&t);
+  bvh_build(&b, &t);
+  remap(&old, rows, 1, &t, &b, NULL, 0, out, 1);
+  assert(out[0] == REMAP_NONE);
+
+  bvh_free(&b);
+  segments_free(&old);
+  printf("ok\n");
+}
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+#include "bvh.h"
+#include "raylib.h"
+#include "segments.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define REMAP_NONE SIZE_MAX
+
+/// get the area between segment p0-p1 and segment q0-q1
+/// That is the mean distance between the points at the same fraction along
+/// both, worked out as segment_distance says.
+double SegmentDistance(Vector3 p0, Vector3 p1, Vector3 q0, Vector3 q1);
+
+typedef enum {
+  SEGMENT_DISTANCE_F1,    // the closed form f1() from maxima
+  SEGMENT_DISTANCE_GAUSS, // a fixed Gauss–Legendre rule
+} segment_distance_kind;
+
+/// how SegmentDistance() works, SEGMENT_DISTANCE_F1 until changed
+extern segment_distance_kind segment_distance;
+
+double SegmentDistanceF1(Vector3 p0, Vector3 p1, Vector3 q0, Vector3 q1);
+double SegmentDistanceGauss(Vector3 p0, Vector3 p1, Vector3 q0, Vector3 q1);
+
+/// SegmentDistanceGauss() between row k of p and row k of q, for k < n
+/// Straight from the columns, a few pairs at a time.
+void SegmentDistanceBatch(const segments *p, const segments *q, size_t n,
+                          float *out);
+
+/// SEGMENT_DISTANCE_GAUSS if it is faster on this machine and within
+/// max_error of f1() on some typical pairs, else SEGMENT_DISTANCE_F1
+/// The largest difference goes in error. Takes about a millisecond.
+segment_distance_kind segment_distance_fastest(double max_error,
+                                               double *error);
+
+double SegmentDistance4(Vector4 ps[2], Vector4 qs[2]);
+
+/// find the segments of t closest to segments rows[k] of old
+/// out[k] is the match of rows[k], or REMAP_NONE when there is nothing left.
+/// No two rows get the same match, nor one of the nreserved indexes in
+/// reserved. b is the bvh of t. Uses nthreads threads, or every core when
+/// nthreads is 0.
+void remap(const segments *old, const size_t *rows, size_t n,
+           const segments *t, const bvh *b, const size_t *reserved,
+           size_t nreserved, size_t *out, int nthreads);
@@ -0,0 +1,579 @@
+#include "render.h"
+#include "arc.h"
+#include "prof.h"
+#include "raylib.h"
+#include "raymath.h"
+#include "rlgl.h"
+#include <GL/gl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// vertices and colors are freed after upload, only vaoId/vboId stay useful
+static Mesh mesh;
+// vertices the buffers have room for, vertexCount are drawn
+static size_t capacity;
+
+/// a coarser copy of the toolpath, for when pixels are bigger than its
+/// tolerance
+/// The lines stay here after upload, so the layers that didn't change keep
+/// theirs and only what changed is made and sent again.
+typedef struct {
+  Mesh mesh;
+  size_t room;   // lines the buffers have room for
+  size_t *start; // first line of each layer, and the end of the last
+  size_t nlayers;
+  size_t *range; // the segments each layer was built from, two per layer
+  float *v;      // 6 floats and 8 colors per line
+  unsigned char *c;
+  size_t n, cap;
+} level;
+
+// lod[k] has tolerance RENDER_LOD_TOL << k, built from lod[k - 1], the
+// first lod_levels of them when they were first needed
+static level lod[RENDER_LOD_LEVELS];
+static int lod_levels;
+
+// arcs are lines from their start to itself in the meshes above, and
+// tessellated into these for the tolerances arcs_tol, 0 when unused, so
+// zooming back and forth across one doesn't tessellate them all again
+#define ARC_LEVELS 4
+static level arcs[ARC_LEVELS];
+static float arcs_tol[ARC_LEVELS];
+static unsigned arcs_used[ARC_LEVELS]; // the frame each was last drawn
+static bool has_arcs;
+
+// the selection and what changed from the file compared with, over the
+// toolpath in colors of their own
+static level selection, changed;
+
+static void level_free(level *lv) {
+  if (lv->mesh.vaoId)
+    UnloadMesh(lv->mesh);
+  free(lv->start);
+  free(lv->range);
+  free(lv->v);
+  free(lv->c);
+  *lv = (level){0};
+}
+
+static void arcs_unload() {
+  for (int k = 0; k < ARC_LEVELS; k++) {
+    level_free(&arcs[k]);
+    arcs_tol[k] = 0;
+  }
+}
+
+static void lod_unload() {
+  for (int k = 0; k < RENDER_LOD_LEVELS; k++)
+    level_free(&lod[k]);
+  lod_levels = 0;
+}
+
+void render_unload() {
+  if (mesh.vaoId)
+    UnloadMesh(mesh);
+  mesh = (Mesh){0};
+  capacity = 0;
+  lod_unload();
+  arcs_unload();
+  level_free(&selection);
+  level_free(&changed);
+}
+
+// fill vertices and colors with segments [from, to) of t
+static void fill(float *vertices, unsigned char *colors, const segments *t,
+                 size_t from, size_t to) {
+  for (size_t i = from; i < to; i++) {
+    float *v = vertices + 6 * (i - from);
+    bool arc = segments_arc(t, i);
+    v[0] = t->x0[i];
+    v[1] = t->y0[i];
+    v[2] = t->z0[i];
+    v[3] = arc ? t->x0[i] : t->x1[i];
+    v[4] = arc ? t->y0[i] : t->y1[i];
+    v[5] = arc ? t->z0[i] : t->z1[i];
+    Color c = segments_extrudes(t, i) ? BLUE : YELLOW;
+    unsigned char *col = colors + 8 * (i - from);
+    col[0] = col[4] = c.r;
+    col[1] = col[5] = c.g;
+    col[2] = col[6] = c.b;
+    col[3] = col[7] = c.a;
+  }
+}
+
+// whether segments [from, to) of t have any arcs to tessellate
+static bool any_arcs(const segments *t, size_t from, size_t to) {
+  for (size_t i = from; i < to; i++)
+    if (segments_arc(t, i))
+      return true;
+  return false;
+}
+
+// the whole of t into mesh, with room for at least room vertices, leaving
+// the levels as they are
+static void upload(const segments *t, size_t room) {
+  if (mesh.vaoId)
+    UnloadMesh(mesh);
+  mesh = (Mesh){0};
+  capacity = 0;
+  if (!t->n)
+    return;
+
+  // leave some room so reloads that add a few moves can update in place
+  capacity = 2 * (t->n + t->n / 16);
+  capacity = capacity > room ? capacity : room;
+  mesh.vertexCount = capacity;
+  mesh.vertices = calloc(capacity, 3 * sizeof(float));
+  mesh.colors = calloc(capacity, 4 * sizeof(unsigned char));
+  fill(mesh.vertices, mesh.colors, t, 0, t->n);
+  UploadMesh(&mesh, true);
+  mesh.vertexCount = 2 * t->n;
+
+  free(mesh.vertices);
+  free(mesh.colors);
+  mesh.vertices = NULL;
+  mesh.colors = NULL;
+}
+
+void render_upload(const segments *t) {
+  render_unload();
+  has_arcs = any_arcs(t, 0, t->n);
+  upload(t, 0);
+}
+
+// squared distance from p to the segment a..b
+static float distance_sqr(const float *p, const float *a, const float *b) {
+  float ab[3], ap[3], dot = 0, len = 0;
+  for (int k = 0; k < 3; k++) {
+    ab[k] = b[k] - a[k];
+    ap[k] = p[k] - a[k];
+    dot += ab[k] * ap[k];
+    len += ab[k] * ab[k];
+  }
+  float s = len > 0 ? Clamp(dot / len, 0, 1) : 0, d = 0;
+  for (int k = 0; k < 3; k++) {
+    float e = ap[k] - s * ab[k];
+    d += e * e;
+  }
+  return d;
+}
+
+// how many lines a decimated run replaces at most
+#define RUN 64
+
+// append lines [0, n) of v, c to out, out_c at *nout, merging runs of
+// connected lines of one color while the points they drop stay within tol
+// of the line replacing them, and leaving out what's left shorter than tol
+static void decimate(const float *v, const unsigned char *c, size_t n,
+                     float tol, float *out, unsigned char *out_c,
+                     size_t *nout) {
+  float tol2 = tol * tol;
+  for (size_t i = 0, j; i < n; i = j + 1) {
+    const float *a = v + 6 * i;
+    for (j = i; j + 1 < n && j + 1 - i < RUN; j++) {
+      const float *next = v + 6 * (j + 1);
+      if (memcmp(next, v + 6 * j + 3, 3 * sizeof(float)) ||
+          memcmp(c + 8 * (j + 1), c + 8 * i, 4))
+        break;
+      bool close = true;
+      for (size_t k = i; close && k <= j; k++)
+        close = distance_sqr(v + 6 * k + 3, a, next + 3) <= tol2;
+      if (!close)
+        break;
+    }
+    const float *b = v + 6 * j + 3;
+    if (distance_sqr(b, a, a) < tol2)
+      continue;
+    memcpy(out + 6 * *nout, a, 3 * sizeof(float));
+    memcpy(out + 6 * *nout + 3, b, 3 * sizeof(float));
+    memcpy(out_c + 8 * *nout, c + 8 * i, 8);
+    (*nout)++;
+  }
+}
+
+// room for n more lines in lv
+static void level_reserve(level *lv, size_t n) {
+  if (lv->n + n <= lv->cap)
+    return;
+  lv->cap = 2 * (lv->n + n);
+  lv->v = realloc(lv->v, lv->cap * 6 * sizeof(float));
+  lv->c = realloc(lv->c, lv->cap * 8);
+  if (!lv->v || !lv->c) {
+    fprintf(stderr, "out of memory for %zu lines\n", lv->cap);
+    exit(-1);
+  }
+}
+
+// send lines [first, sent) of lv to its buffers, or all of them to new
+// ones when they don't fit
+static void level_send(level *lv, size_t first, size_t sent) {
+  if (lv->mesh.vaoId && lv->n <= lv->room) {
+    lv->mesh.vertexCount = 2 * lv->n;
+    if (sent > first) {
+      UpdateMeshBuffer(lv->mesh, 0, lv->v + 6 * first,
+                       (sent - first) * 6 * sizeof(float),
+                       first * 6 * sizeof(float));
+      UpdateMeshBuffer(lv->mesh, 3, lv->c + 8 * first, (sent - first) * 8,
+                       first * 8);
+    }
+  } else if (lv->n) {
+    // as much room as there is for the lines here, which grows
+    // geometrically
+    if (lv->mesh.vaoId)
+      UnloadMesh(lv->mesh);
+    lv->mesh = (Mesh){0};
+    lv->room = lv->cap;
+    lv->mesh.vertexCount = 2 * lv->room;
+    lv->mesh.vertices = lv->v;
+    lv->mesh.colors = lv->c;
+    UploadMesh(&lv->mesh, true);
+    lv->mesh.vertices = NULL;
+    lv->mesh.colors = NULL;
+    lv->mesh.vertexCount = 2 * lv->n;
+  }
+}
+
+// appends the lines of layer l of ls to out
+typedef void layer_lines(level *out, const segments *t, const layers *ls,
+                         size_t l, int k);
+
+// lv again for t and its layers ls after segments [from, to) changed
+// The layers before and after the edit that span the same segments as
+// before keep their lines, and those between are made again with lines().
+// Only the lines from the first of them on are sent, or up to the last of
+// them when there are as many lines as before, unless the buffers grow.
+static void level_splice(level *lv, const segments *t, const layers *ls,
+                         size_t from, size_t to, layer_lines *lines, int k) {
+  size_t on = lv->nlayers, nn = ls->n;
+  // layers [0, a) and the last b of both are the same
+  size_t a = 0, b = 0;
+  for (; a < on && a < nn && ls->l[a].to <= from; a++)
+    if (lv->range[2 * a] != ls->l[a].from ||
+        lv->range[2 * a + 1] != ls->l[a].to)
+      break;
+  for (; b < on - a && b < nn - a; b++) {
+    size_t m = on - 1 - b, l = nn - 1 - b;
+    if (ls->l[l].from < to || lv->range[2 * m] != ls->l[l].from ||
+        lv->range[2 * m + 1] != ls->l[l].to)
+      break;
+  }
+
+  // the layers between, on their own
+  level mid = {0};
+  size_t *start = malloc((nn + 1) * sizeof(size_t)),
+         *range = malloc(2 * nn * sizeof(size_t) + 1);
+  if (!start || !range) {
+    fprintf(stderr, "out of memory for %zu layers\n", nn);
+    exit(-1);
+  }
+  size_t first = a ? lv->start[a] : 0, // where they go
+      tail = on ? lv->start[on - b] : 0;
+  for (size_t l = a; l < nn - b; l++) {
+    start[l] = first + mid.n;
+    lines(&mid, t, ls, l, k);
+  }
+  size_t n = first + mid.n + lv->n - tail;
+
+  // between the lines before and after
+  if (n > lv->n)
+    level_reserve(lv, n - lv->n);
+  if (lv->n > tail) {
+    memmove(lv->v + 6 * (first + mid.n), lv->v + 6 * tail,
+            (lv->n - tail) * 6 * sizeof(float));
+    memmove(lv->c + 8 * (first + mid.n), lv->c + 8 * tail,
+            (lv->n - tail) * 8);
+  }
+  if (mid.n) {
+    memcpy(lv->v + 6 * first, mid.v, mid.n * 6 * sizeof(float));
+    memcpy(lv->c + 8 * first, mid.c, mid.n * 8);
+  }
+  for (size_t l = 0; l < a; l++)
+    start[l] = lv->start[l];
+  for (size_t j = 0; j < b; j++)
+    start[nn - b + j] = lv->start[on - b + j] - tail + first + mid.n;
+  start[nn] = n;
+  for (size_t l = 0; l < nn; l++) {
+    range[2 * l] = ls->l[l].from;
+    range[2 * l + 1] = ls->l[l].to;
+  }
+  size_t sent = n == lv->n ? first + mid.n : n;
+  free(lv->start);
+  free(lv->range);
+  lv->start = start;
+  lv->range = range;
+  lv->nlayers = nn;
+  lv->n = n;
+  free(mid.v);
+  free(mid.c);
+  level_send(lv, first, sent);
+}
+
+// layer l of level k, decimated from the one before, or from t for the
+// first, a layer at a time so runs don't cross layers
+static void lod_lines(level *out, const segments *t, const layers *ls,
+                      size_t l, int k) {
+  if (k) {
+    const level *prev = &lod[k - 1];
+    size_t f = prev->start[l], e = prev->start[l + 1];
+    level_reserve(out, e - f);
+    decimate(prev->v + 6 * f, prev->c + 8 * f, e - f,
+             RENDER_LOD_TOL * (1 << k), out->v, out->c, &out->n);
+    return;
+  }
+  // filled past where the decimated lines go, which are never more
+  size_t n = ls->l[l].to - ls->l[l].from;
+  level_reserve(out, 2 * n);
+  float *v = out->v + 6 * (out->n + n);
+  unsigned char *c = out->c + 8 * (out->n + n);
+  fill(v, c, t, ls->l[l].from, ls->l[l].to);
+  decimate(v, c, n, RENDER_LOD_TOL, out->v, out->c, &out->n);
+}
+
+// the levels built so far, each from the one before, for the layers
+// touching segments [from, to)
+static void lod_splice(const segments *t, const layers *ls, size_t from,
+                       size_t to) {
+  PROF_SCOPE("lod_build");
+  for (int k = 0; k < lod_levels; k++)
+    level_splice(&lod[k], t, ls, from, to, lod_lines, k);
+}
+
+// the levels up to k, building those not needed before
+static void lod_need(const segments *t, const layers *ls, int k) {
+  PROF_SCOPE("lod_build");
+  for (; lod_levels <= k; lod_levels++)
+    level_splice(&lod[lod_levels], t, ls, 0, t->n, lod_lines, lod_levels);
+}
+
+// most points one arc is drawn with
+#define ARC_POINTS 256
+
+// append the lines between points [0, np) of p to out, in color col
+static void level_points(level *out, const Vector3 *p, size_t np, Color col) {
+  level_reserve(out, np);
+  for (size_t j = 0; j + 1 < np; j++, out->n++) {
+    memcpy(out->v + 6 * out->n, &p[j], 3 * sizeof(float));
+    memcpy(out->v + 6 * out->n + 3, &p[j + 1], 3 * sizeof(float));
+    for (int e = 0; e < 2; e++)
+      memcpy(out->c + 8 * out->n + 4 * e, &col, 4);
+  }
+}
+
+// the arcs of layer l, with chords at most arcs_tol[k] from them
+static void arc_lines(level *out, const segments *t, const layers *ls,
+                      size_t l, int k) {
+  Vector3 p[ARC_POINTS];
+  for (size_t i = ls->l[l].from; i < ls->l[l].to; i++) {
+    if (!segments_arc(t, i))
+      continue;
+    size_t np = arc_points(t, i, arcs_tol[k], p, ARC_POINTS);
+    level_points(out, p, np, segments_extrudes(t, i) ? BLUE : YELLOW);
+  }
+}
+
+// the arcs of every layer for the tolerance tol, made in the level that
+// was drawn least recently unless there is one already
+static level *arcs_for(const segments *t, const layers *ls, float tol) {
+  static unsigned frame;
+  frame++;
+  int k = 0;
+  for (int j = 1; j < ARC_LEVELS; j++)
+    if (arcs_used[j] < arcs_used[k])
+      k = j;
+  for (int j = 0; j < ARC_LEVELS; j++)
+    if (arcs_tol[j] == tol)
+      k = j;
+  arcs_used[k] = frame;
+  if (arcs_tol[k] != tol || arcs[k].nlayers != ls->n) {
+    PROF_SCOPE("arcs_build");
+    level_free(&arcs[k]);
+    arcs_tol[k] = tol;
+    level_splice(&arcs[k], t, ls, 0, t->n, arc_lines, k);
+  }
+  return &arcs[k];
+}
+
+static int by_index(const void *a, const void *b) {
+  size_t x = *(const size_t *)a, y = *(const size_t *)b;
+  return (x > y) - (x < y);
+}
+
+void render_selection(const segments *t, const layers *ls, const size_t *sel,
+                      size_t n) {
+  PROF_SCOPE("render_selection");
+  size_t *in = malloc(n * sizeof(size_t) + 1),
+         *start = realloc(selection.start, (ls->n + 1) * sizeof(size_t));
+  if (!in || !start) {
+    fprintf(stderr, "out of memory for %zu selected\n", n);
+    exit(-1);
+  }
+  memcpy(in, sel, n * sizeof(size_t));
+  qsort(in, n, sizeof(size_t), by_index);
+  selection.start = start;
+  selection.nlayers = ls->n;
+  selection.n = 0;
+  size_t k = 0;
+  for (size_t l = 0; l < ls->n; l++) {
+    start[l] = selection.n;
+    for (; k < n && in[k] < ls->l[l].from; k++)
+      ;
+    for (; k < n && in[k] < ls->l[l].to && in[k] < t->n; k++) {
+      // arcs about as coarse as the capsules drawn over few of them
+      Vector3 p[32];
+      size_t np = arc_points(t, in[k], 0.5f, p, 32);
+      level_points(&selection, p, np,
+                   segments_extrudes(t, in[k]) ? SKYBLUE : ORANGE);
+    }
+  }
+  start[ls->n] = selection.n;
+  free(in);
+  level_send(&selection, 0, selection.n);
+}
+
+void render_diff(const diff *d, const segments *old, const segments *t,
+                 const layers *ls) {
+  PROF_SCOPE("render_diff");
+  size_t *start = realloc(changed.start, (ls->n + 1) * sizeof(size_t));
+  if (!start) {
+    fprintf(stderr, "out of memory for %zu layers\n", ls->n);
+    exit(-1);
+  }
+  changed.start = start;
+  changed.nlayers = ls->n;
+  changed.n = 0;
+  size_t k = 0;
+  for (size_t l = 0; l < ls->n; l++) {
+    start[l] = changed.n;
+    for (; k < d->n && d->c[k].layer <= l; k++) {
+      // added green, removed red and moved magenta
+      const diff_change *c = &d->c[k];
+      bool removed = c->kind == DIFF_REMOVED;
+      Color col = removed ? RED : c->kind == DIFF_ADDED ? GREEN : MAGENTA;
+      Vector3 p[32];
+      size_t np = arc_points(removed ? old : t, removed ? c->old : c->new,
+                             0.5f, p, 32);
+      level_points(&changed, p, np, col);
+    }
+  }
+  start[ls->n] = changed.n;
+  level_send(&changed, 0, changed.n);
+}
+
+void render_update(const segments *t, const layers *ls, size_t from,
+                   size_t to) {
+  PROF_SCOPE("render_update");
+  // the coarse levels and arcs again for the layers that changed, if they
+  // were needed yet
+  lod_splice(t, ls, from, to);
+  has_arcs = has_arcs || any_arcs(t, from, to < t->n ? to : t->n);
+  for (int k = 0; k < ARC_LEVELS; k++)
+    if (arcs_tol[k] != 0) {
+      PROF_SCOPE("arcs_build");
+      level_splice(&arcs[k], t, ls, from, to, arc_lines, k);
+    }
+  if (!mesh.vaoId || 2 * t->n > capacity) {
+    // room for twice the segments there are, or twice as big as before,
+    // so that while loading most pieces fit and only their own range is
+    // sent; what's sent again adds up to about twice the file
+    upload(t, 4 * t->n > 2 * capacity ? 4 * t->n : 2 * capacity);
+    return;
+  }
+  mesh.vertexCount = 2 * t->n;
+  if (to > t->n)
+    to = t->n;
+  if (from >= to)
+    return;
+
+  float *vertices = malloc((to - from) * 6 * sizeof(float));
+  unsigned char *colors = malloc((to - from) * 8 * sizeof(unsigned char));
+  fill(vertices, colors, t, from, to);
+  // UploadMesh() puts the positions in buffer 0 and the colors in buffer 3
+  UpdateMeshBuffer(mesh, 0, vertices, (to - from) * 6 * sizeof(float),
+                   from * 6 * sizeof(float));
+  UpdateMeshBuffer(mesh, 3, colors, (to - from) * 8, from * 8);
+  free(vertices);
+  free(colors);
+}
+
+// layers [lo, hi) of m, whose layer l is lines [start[l], start[l + 1]),
+// or those of ls without start
+static void draw_layers(const Mesh *m, const size_t *start, const layers *ls,
+                        size_t lo, size_t hi, Matrix mvp) {
+  rlEnableVertexArray(m->vaoId);
+  // neighbouring layers on screen go in one draw call
+  size_t first = 0, count = 0, n = m->vertexCount / 2;
+  for (size_t l = lo; l < hi && l < ls->n; l++) {
+    size_t from = start ? start[l] : ls->l[l].from,
+           to = start ? start[l + 1] : ls->l[l].to;
+    if (to > n || from == to || !layers_box_visible(mvp, ls->l[l].box))
+      continue;
+    if (count && first + count == from) {
+      count += to - from;
+      continue;
+    }
+    if (count)
+      glDrawArrays(GL_LINES, 2 * first, 2 * count);
+    first = from;
+    count = to - from;
+  }
+  if (count)
+    glDrawArrays(GL_LINES, 2 * first, 2 * count);
+  rlDisableVertexArray();
+}
+
+// DrawMesh() only draws triangles, so this is DrawMesh() with the default
+// shader and GL_LINES
+void render_draw(const segments *t, const layers *ls, size_t lo, size_t hi,
+                 float pixel) {
+  if (!mesh.vaoId)
+    return;
+  // the coarsest level that's still finer than a pixel: each level can be
+  // off by its tolerance plus what the ones below it were off by, so by
+  // less than twice its tolerance
+  int k = -1;
+  while (k + 1 < RENDER_LOD_LEVELS &&
+         2 * RENDER_LOD_TOL * (1 << (k + 1)) <= pixel)
+    k++;
+  if (k >= 0)
+    lod_need(t, ls, k);
+  if (k >= 0 && lod[k].nlayers != ls->n)
+    k = -1;
+  const Mesh *m = k < 0 ? &mesh : &lod[k].mesh;
+  if (!m->vaoId)
+    return;
+  // arcs are tessellated for each factor of two of zoom, to half a pixel
+  // rounded down to a power of two
+  const level *arc = NULL;
+  if (has_arcs) {
+    int e;
+    frexpf(pixel / 2 > 1e-4f ? pixel / 2 : 1e-4f, &e);
+    arc = arcs_for(t, ls, ldexpf(0.5f, e));
+  }
+
+  rlDrawRenderBatchActive(); // flush what was drawn in immediate mode
+
+  int *locs = rlGetShaderLocsDefault();
+  rlEnableShader(rlGetShaderIdDefault());
+  Matrix mvp = MatrixMultiply(
+      MatrixMultiply(rlGetMatrixTransform(), rlGetMatrixModelview()),
+      rlGetMatrixProjection());
+  rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_MVP], mvp);
+  float white[4] = {1, 1, 1, 1};
+  rlSetUniform(locs[SHADER_LOC_COLOR_DIFFUSE], white, RL_SHADER_UNIFORM_VEC4,
+               1);
+  rlActiveTextureSlot(0);
+  rlEnableTexture(rlGetTextureIdDefault());
+
+  draw_layers(m, k < 0 ? NULL : lod[k].start, ls, lo, hi, mvp);
+  if (arc && arc->mesh.vaoId)
+    draw_layers(&arc->mesh, arc->start, ls, lo, hi, mvp);
+  if (selection.mesh.vaoId && selection.nlayers == ls->n)
+    draw_layers(&selection.mesh, selection.start, ls, lo, hi, mvp);
+  if (changed.mesh.vaoId && changed.nlayers == ls->n)
+    draw_layers(&changed.mesh, changed.start, ls, lo, hi, mvp);
+
+  rlDisableTexture();
+  rlDisableShader();
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "diff.h"
+#include "layers.h"
+#include "segments.h"
+
+/// coarser copies of the toolpath drawn when zoomed out: level k merges
+/// connected lines and drops short ones within RENDER_LOD_TOL << k
+#define RENDER_LOD_LEVELS 6
+#define RENDER_LOD_TOL 0.02f
+
+/// upload t to the GPU as a single line list,
+/// extruding moves blue and the rest yellow
+/// Arcs are tessellated separately when drawn, for the pixel size.
+/// call again when the file is reloaded
+void render_upload(const segments *t);
+
+/// update the GPU copy after segments [from, to) of t changed, and ls was
+/// indexed again, in place unless the buffers are too small
+/// Coarse levels and tessellated arcs are built again only for the layers
+/// that changed.
+void render_update(const segments *t, const layers *ls, size_t from,
+                   size_t to);
+
+/// the selected segments sel[0..n) of t, in any order, drawn over the
+/// toolpath in lighter colors from now on
+/// The lines are made and sent here, so call it only when the selection, t
+/// or ls changed.
+void render_selection(const segments *t, const layers *ls, const size_t *sel,
+                      size_t n);
+
+/// the changes of d from old to t, in layers ls of t, drawn over the
+/// toolpath from now on, replacing the ones before
+/// Like render_selection(), call it only when they change.
+void render_diff(const diff *d, const segments *old, const segments *t,
+                 const layers *ls);
+
+/// draw layers [lo, hi) of the uploaded toolpath, inside BeginMode3D()
+/// Layers whose boxes are off screen are skipped. pixel is how big a pixel
+/// is in the world, and picks the coarsest level that doesn't show. t and
+/// ls are what was uploaded, for building the levels.
+void render_draw(const segments *t, const layers *ls, size_t lo, size_t hi,
+                 float pixel);
+
+void render_unload();
@@ -0,0 +1,137 @@
+#include "segments.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+void segments_init(segments *t) { memset(t, 0, sizeof(*t)); }
+
+void segments_free(segments *t) {
+  if (t->map) {
+    munmap(t->map, t->maplen);
+    segments_init(t);
+    return;
+  }
+  float **cols[] = {&t->x0, &t->y0, &t->z0, &t->e0, &t->x1,
+                    &t->y1, &t->z1, &t->e1, &t->ai, &t->aj};
+  for (size_t i = 0; i < sizeof(cols) / sizeof(cols[0]); i++)
+    free(*cols[i]);
+  free(t->kind);
+  free(t->axes);
+  free(t->line);
+  segments_init(t);
+}
+
+static void *grow(void *p, size_t size) {
+  p = realloc(p, size);
+  if (!p) {
+    fprintf(stderr, "out of memory for %zu bytes of segments\n", size);
+    exit(-1);
+  }
+  return p;
+}
+
+#define NCOLS 13
+
+// every column of t and the size of its elements
+static void columns(const segments *t, char *cols[NCOLS],
+                    size_t size[NCOLS]) {
+  char *c[NCOLS] = {(char *)t->x0,   (char *)t->y0,  (char *)t->z0,
+                    (char *)t->e0,   (char *)t->x1,  (char *)t->y1,
+                    (char *)t->z1,   (char *)t->e1,  (char *)t->ai,
+                    (char *)t->aj,   (char *)t->kind, (char *)t->axes,
+                    (char *)t->line};
+  for (int k = 0; k < NCOLS; k++) {
+    cols[k] = c[k];
+    size[k] = k < 10   ? sizeof(float)
+              : k < 12 ? sizeof(uint8_t)
+                       : sizeof(size_t);
+  }
+}
+
+void segments_reserve(segments *t, size_t cap) {
+  if (t->map) {
+    // move to the heap, with the space asked for
+    segments m = *t;
+    segments_init(t);
+    segments_reserve(t, cap > m.n ? cap : m.n);
+    char *d[NCOLS], *s[NCOLS];
+    size_t size[NCOLS];
+    columns(t, d, size);
+    columns(&m, s, size);
+    for (int k = 0; k < NCOLS && m.n; k++)
+      memcpy(d[k], s[k], m.n * size[k]);
+    t->n = m.n;
+    segments_free(&m);
+    return;
+  }
+  if (cap <= t->cap)
+    return;
+  float **cols[] = {&t->x0, &t->y0, &t->z0, &t->e0, &t->x1,
+                    &t->y1, &t->z1, &t->e1, &t->ai, &t->aj};
+  for (size_t i = 0; i < sizeof(cols) / sizeof(cols[0]); i++)
+    *cols[i] = grow(*cols[i], cap * sizeof(float));
+  t->kind = grow(t->kind, cap * sizeof(uint8_t));
+  t->axes = grow(t->axes, cap * sizeof(uint8_t));
+  t->line = grow(t->line, cap * sizeof(size_t));
+  t->cap = cap;
+}
+
+void segments_resize(segments *t, size_t n) {
+  segments_reserve(t, n);
+  t->n = n;
+}
+
+void segments_push(segments *t, Vector4 p0, Vector4 p1, uint8_t kind,
+                   uint8_t axes, size_t line) {
+  if (t->n == t->cap)
+    segments_reserve(t, t->cap ? 2 * t->cap : 1024);
+  size_t i = t->n++;
+  t->x0[i] = p0.x;
+  t->y0[i] = p0.y;
+  t->z0[i] = p0.z;
+  t->e0[i] = p0.w;
+  t->x1[i] = p1.x;
+  t->y1[i] = p1.y;
+  t->z1[i] = p1.z;
+  t->e1[i] = p1.w;
+  t->ai[i] = t->aj[i] = 0;
+  t->kind[i] = kind;
+  t->axes[i] = axes;
+  t->line[i] = line;
+}
+
+void segments_copy(segments *dst, const segments *src, size_t i, size_t n) {
+  segments_resize(dst, n);
+  char *d[NCOLS], *s[NCOLS];
+  size_t size[NCOLS];
+  columns(dst, d, size);
+  columns(src, s, size);
+  for (int k = 0; k < NCOLS && n; k++)
+    memcpy(d[k], s[k] + i * size[k], n * size[k]);
+}
+
+void segments_splice(segments *t, size_t i, size_t nold, const segments *ins) {
+  size_t tail = t->n - i - nold;
+  segments_reserve(t, t->n - nold + ins->n);
+  char *d[NCOLS], *s[NCOLS];
+  size_t size[NCOLS];
+  columns(t, d, size);
+  columns(ins, s, size);
+  for (int k = 0; k < NCOLS; k++) {
+    if (tail)
+      memmove(d[k] + (i + ins->n) * size[k], d[k] + (i + nold) * size[k],
+              tail * size[k]);
+    if (ins->n)
+      memcpy(d[k] + i * size[k], s[k], ins->n * size[k]);
+  }
+  t->n = t->n - nold + ins->n;
+}
+
+Vector4 segments_start(const segments *t, size_t i) {
+  return (Vector4){t->x0[i], t->y0[i], t->z0[i], t->e0[i]};
+}
+
+Vector4 segments_end(const segments *t, size_t i) {
+  return (Vector4){t->x1[i], t->y1[i], t->z1[i], t->e1[i]};
+}
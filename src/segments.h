@@ -0,0 +1,55 @@
+#pragma once
+#include "raylib.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// the moves of a gcode file as a structure of arrays:
+/// segment i goes from (x0,y0,z0,e0)[i] to (x1,y1,z1,e1)[i]
+typedef struct {
+  size_t n, cap;
+  float *x0, *y0, *z0, *e0;
+  float *x1, *y1, *z1, *e1;
+  uint8_t *kind; // G number of the move
+  // G2/G3 arcs: I and J, the center relative to the start, or NaN and R
+  float *ai, *aj;
+  uint8_t *axes; // bit a: axis a (XYZE) was relative, bit 4 + a: it was given
+  size_t *line;  // byte offset of the source line from the start of the file
+  // when the columns point into a mapped file instead of the heap,
+  // they are copied out before they have to grow
+  void *map;
+  size_t maplen;
+} segments;
+
+void segments_init(segments *t);
+
+void segments_free(segments *t);
+
+void segments_reserve(segments *t, size_t cap);
+
+/// set the number of segments, leaving new ones uninitialized
+void segments_resize(segments *t, size_t n);
+
+/// append a move, with ai and aj 0
+void segments_push(segments *t, Vector4 p0, Vector4 p1, uint8_t kind,
+                   uint8_t axes, size_t line);
+
+/// replace dst with segments [i, i + n) of src
+void segments_copy(segments *dst, const segments *src, size_t i, size_t n);
+
+/// replace segments [i, i + nold) of t with all of ins
+void segments_splice(segments *t, size_t i, size_t nold, const segments *ins);
+
+Vector4 segments_start(const segments *t, size_t i);
+
+Vector4 segments_end(const segments *t, size_t i);
+
+/// G2 and G3 go around an arc from start to end, the others straight
+static inline bool segments_arc(const segments *t, size_t i) {
+  return t->kind[i] == 2 || t->kind[i] == 3;
+}
+
+/// extruding moves are drawn blue, everything else yellow
+static inline bool segments_extrudes(const segments *t, size_t i) {
+  return t->e0[i] < t->e1[i];
+}
@@ -1,93 +1,190 @@
 #include "selected.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-size_t selected[MAXSEL], *send, *s;
+// order[head..tail) holds the selection in insertion order, with
+// SELECTED_EMPTY where something was removed. The hash table maps a
+// segment to its place in order and how many times it was added.
+typedef struct {
+  size_t key, pos;
+  size_t count;
+} entry;
 
-void selected_init() {
-  for (int i = 0; i < MAXSEL; i++)
-    selected[i] = SELECTED_EMPTY;
-  send = selected + (MAXSEL - 1);
-  s = selected;
+static size_t *order, head, tail, order_cap;
+static entry *table;
+static size_t table_cap, live, total;
+
+static void *grow(void *p, size_t size) {
+  p = realloc(p, size);
+  if (!p) {
+    fprintf(stderr, "out of memory for %zu bytes of selection\n", size);
+    exit(-1);
+  }
+  return p;
 }
 
-int selected_count() {
-  int count = 0;
-  for (int i = 0; i < MAXSEL; i++) {
-    if (selected[i] != SELECTED_EMPTY)
-      count++;
+static size_t hash(size_t x) {
+  uint64_t z = x + 0x9E3779B97F4A7C15;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+  return z ^ (z >> 31);
+}
+
+// slot of x, or the empty slot where it would go
+static size_t slot(size_t x) {
+  size_t mask = table_cap - 1, i = hash(x) & mask;
+  while (table[i].key != SELECTED_EMPTY && table[i].key != x)
+    i = (i + 1) & mask;
+  return i;
+}
+
+static void table_resize(size_t cap) {
+  entry *old = table;
+  size_t old_cap = table_cap;
+  table = grow(NULL, cap * sizeof(entry));
+  table_cap = cap;
+  for (size_t i = 0; i < cap; i++)
+    table[i].key = SELECTED_EMPTY;
+  for (size_t i = 0; i < old_cap; i++)
+    if (old[i].key != SELECTED_EMPTY)
+      table[slot(old[i].key)] = old[i];
+  free(old);
+}
+
+// linear probing delete: move later entries of the cluster back
+static void table_delete(size_t i) {
+  size_t mask = table_cap - 1, j = i;
+  table[i].key = SELECTED_EMPTY;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (table[j].key == SELECTED_EMPTY)
+      return;
+    size_t home = hash(table[j].key) & mask;
+    // can table[j] move to the hole at i?
+    if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+      table[i] = table[j];
+      table[j].key = SELECTED_EMPTY;
+      i = j;
+    }
   }
-  return count;
+}
+
+// close the holes in order once there are more holes than selections
+static void compact() {
+  size_t k = 0;
+  for (size_t i = head; i < tail; i++) {
+    size_t x = order[i];
+    if (x == SELECTED_EMPTY)
+      continue;
+    order[k] = x;
+    table[slot(x)].pos = k++;
+  }
+  head = 0;
+  tail = k;
+}
+
+void selected_init() {
+  free(order);
+  free(table);
+  order = NULL;
+  table = NULL;
+  head = tail = order_cap = table_cap = live = total = 0;
+  table_resize(64);
+}
+
+int selected_count() { return total; }
+
+static void forget(size_t i) {
+  entry *e = &table[i];
+  total -= e->count;
+  order[e->pos] = SELECTED_EMPTY;
+  table_delete(i);
+  live--;
+  while (head < tail && order[head] == SELECTED_EMPTY)
+    head++;
+  if (tail - head > 2 * live + 64)
+    compact();
 }
 
 void selected_add(size_t x) {
-  *s++ = x;
-  if (s > send)
-    s = selected;
+  if (!table)
+    selected_init();
+  size_t i = slot(x);
+  if (table[i].key == x) {
+    table[i].count++;
+    total++;
+    return;
+  }
+
+  if (live == MAXSEL) {
+    // forget the oldest
+    forget(slot(order[head]));
+    i = slot(x);
+  }
+  if (2 * (live + 1) > table_cap) {
+    table_resize(2 * table_cap);
+    i = slot(x);
+  }
+  if (tail == order_cap) {
+    if (head > order_cap / 2) {
+      compact();
+    } else {
+      order_cap = order_cap ? 2 * order_cap : 64;
+      order = grow(order, order_cap * sizeof(size_t));
+    }
+    i = slot(x);
+  }
+  order[tail] = x;
+  table[i] = (entry){.key = x, .pos = tail++, .count = 1};
+  live++;
+  total++;
 }
 
 // pop isn't what I wanted though?
 // I wanted an iterator
 // or at least the index
 bool selected_pop(size_t *x) {
-  *x = *s;
-  if (s == selected)
-    s = send;
-  else
-    s--;
+  *x = SELECTED_EMPTY;
+  while (tail > head && order[tail - 1] == SELECTED_EMPTY)
+    tail--;
+  if (tail > head) {
+    *x = order[tail - 1];
+    forget(slot(*x));
+  }
   return *x == SELECTED_EMPTY;
 }
 
 void selected_remove(size_t x) {
-  int pos = -1;
-  for (int i = 0; i < MAXSEL; i++) {
-    if (selected[i] == x) {
-      pos = i;
-      break;
-    }
-  }
-  if (pos < 0)
+  if (!table)
+    return;
+  size_t i = slot(x);
+  if (table[i].key != x)
+    return;
+  if (--table[i].count > 0) {
+    total--;
     return;
-
-  int count = selected_count();
-  int j = pos;
-
-  if (count == MAXSEL) {
-    for (int k = 0; k < MAXSEL - 1; k++) {
-      int from = (j + 1) % MAXSEL;
-      selected[j] = selected[from];
-      j = from;
-    }
-    selected[j] = SELECTED_EMPTY;
-    s = selected + j;
-  } else {
-    int from = (j + 1) % MAXSEL;
-    while (selected[from] != SELECTED_EMPTY) {
-      selected[j] = selected[from];
-      j = from;
-      from = (from + 1) % MAXSEL;
-    }
-    selected[j] = SELECTED_EMPTY;
-    s = selected + j;
   }
+  table[i].count = 1;
+  forget(i);
 }
 
 size_t selected_index(size_t x) {
-  for (int i = 0; i < MAXSEL; i++) {
-    if (selected[i] == x)
-      return i;
-  }
-  return SELECTED_EMPTY;
+  if (!table)
+    return SELECTED_EMPTY;
+  size_t i = slot(x);
+  return table[i].key == x ? table[i].pos - head : SELECTED_EMPTY;
 }
 
 bool selected_find(size_t x) {
-  for (int i = 0; i < MAXSEL; i++) {
-    if (selected[i] == x)
-      return true;
-  }
-  return false;
+  return table && table[slot(x)].key == x;
 }
 
+size_t selected_nth(size_t i) { return order[head + i]; }
+
+size_t selected_end() { return tail - head; }
+
 #ifdef TESTING
 int main() {
   selected_init();
@@ -140,6 +237,40 @@ int main() {
   assert(selected_count() == 0);
   assert(!selected_find(v));
 
+  // no small cap: tens of thousands with O(1) lookups
+  selected_init();
+  const size_t N = 50000;
+  for (size_t i = 0; i < N; i++)
+    selected_add(7 * i);
+  assert(selected_count() == (int)N);
+  for (size_t i = 0; i < 7 * N; i++)
+    assert(selected_find(i) == (i % 7 == 0));
+
+  // insertion order survives removals and compaction
+  for (size_t i = 0; i < N; i += 2)
+    selected_remove(7 * i);
+  assert(selected_count() == (int)(N / 2));
+  size_t last = 0, seen = 0;
+  for (size_t k = 0; k < selected_end(); k++) {
+    size_t x = selected_nth(k);
+    if (x == SELECTED_EMPTY)
+      continue;
+    assert(selected_index(x) == k);
+    assert(seen == 0 || x > last);
+    last = x;
+    seen++;
+  }
+  assert(seen == N / 2);
+  assert(selected_index(7 * (N - 1)) < selected_end());
+  assert(selected_index(0) == SELECTED_EMPTY);
+
+  // pop takes the most recent
+  size_t y;
+  assert(!selected_pop(&y) && y == 7 * (N - 1));
+  assert(!selected_find(y));
+  selected_init();
+  assert(selected_pop(&y) && y == SELECTED_EMPTY);
+
   printf("ok\n");
 }
 #endif
@@ -4,11 +4,11 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define MAXSEL 100
+/// the most recent MAXSEL selected segments are kept
+#define MAXSEL (1 << 22)
 #define SELECTED_EMPTY SIZE_MAX
 
-/// circular buffer for the line segment selection
-extern size_t selected[MAXSEL], sselected[MAXSEL];
+/// the line segment selection: a hash set that remembers insertion order
 
 void selected_init();
 
@@ -20,6 +20,15 @@ void selected_remove(size_t x);
 
 bool selected_find(size_t x);
 
+/// position of x in insertion order, or SELECTED_EMPTY
+/// Removals leave holes until they're compacted away, so positions can
+/// skip; count the live ones of selected_nth() for a rank without gaps.
 size_t selected_index(size_t x);
 
 bool selected_pop(size_t *x);
+
+/// the selection at position i < selected_end() in insertion order,
+/// SELECTED_EMPTY where one was removed
+size_t selected_nth(size_t i);
+
+size_t selected_end();
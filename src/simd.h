@@ -0,0 +1,12 @@
+#pragma once
+
+/// marks a kernel written for the vectorizer: it gets a copy per instruction
+/// set, and the loader picks the best one the cpu has
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define VECTORIZED __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef VECTORIZED
+#define VECTORIZED
+#endif
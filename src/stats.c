@@ -0,0 +1,170 @@
+#include "stats.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void stats_sketch_init(stats_sketch *s) { memset(s, 0, sizeof(*s)); }
+
+void stats_sketch_free(stats_sketch *s) {
+  free(s->bins);
+  stats_sketch_init(s);
+}
+
+// floats as unsigned numbers in the same order
+static inline uint32_t ordered(float f) {
+  uint32_t u;
+  memcpy(&u, &f, 4);
+  return u >> 31 ? ~u : u | 0x80000000u;
+}
+
+static inline float unordered(uint32_t u) {
+  u = u >> 31 ? u & 0x7fffffffu : ~u;
+  float f;
+  memcpy(&f, &u, 4);
+  return f;
+}
+
+static void allocate(stats_sketch *s) {
+  if (s->bins)
+    return;
+  // zero pages: only the bins that get used cost memory
+  s->bins = calloc(4 * (size_t)STATS_BINS, sizeof(uint32_t));
+  if (!s->bins) {
+    fprintf(stderr, "out of memory for statistics\n");
+    exit(-1);
+  }
+  for (int a = 0; a < 4; a++) {
+    s->min[a] = INFINITY;
+    s->max[a] = -INFINITY;
+  }
+}
+
+void stats_sketch_add(stats_sketch *s, const float *x, const float *y,
+                      const float *z, const float *e, size_t n) {
+  if (!n)
+    return;
+  allocate(s);
+  const float *vs[4] = {x, y, z, e};
+  for (int a = 0; a < 4; a++) {
+    const float *v = vs[a];
+    uint32_t *bins = s->bins + a * (size_t)STATS_BINS;
+    float lo = s->min[a], hi = s->max[a];
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+      lo = v[i] < lo ? v[i] : lo;
+      hi = v[i] > hi ? v[i] : hi;
+      sum += v[i];
+      bins[ordered(v[i]) >> 16]++;
+    }
+    s->min[a] = lo;
+    s->max[a] = hi;
+    s->sum[a] += sum;
+  }
+  s->n += n;
+}
+
+void stats_sketch_merge(stats_sketch *s, const stats_sketch *from) {
+  if (!from->n)
+    return;
+  allocate(s);
+  for (int a = 0; a < 4; a++) {
+    s->min[a] = from->min[a] < s->min[a] ? from->min[a] : s->min[a];
+    s->max[a] = from->max[a] > s->max[a] ? from->max[a] : s->max[a];
+    s->sum[a] += from->sum[a];
+  }
+  for (size_t i = 0; i < 4 * (size_t)STATS_BINS; i++)
+    s->bins[i] += from->bins[i];
+  s->n += from->n;
+}
+
+// the value with half the points below it, interpolated in its bin
+static float median(const stats_sketch *s, int a) {
+  const uint32_t *bins = s->bins + a * (size_t)STATS_BINS;
+  double half = s->n / 2.0, below = 0;
+  size_t k = 0;
+  while (below + bins[k] < half)
+    below += bins[k++];
+  float lo = unordered(k << 16), hi = unordered(k << 16 | 0xffff);
+  lo = lo < s->min[a] ? s->min[a] : lo;
+  hi = hi > s->max[a] ? s->max[a] : hi;
+  return lo + (hi - lo) * (float)((half - below) / bins[k]);
+}
+
+stats stats_of(const stats_sketch *s) {
+  stats r = {.n = s->n};
+  if (!s->n)
+    return r;
+  float *min = &r.min.x, *max = &r.max.x, *mean = &r.mean.x,
+        *center = &r.center.x;
+  for (int a = 0; a < 4; a++) {
+    min[a] = s->min[a];
+    max[a] = s->max[a];
+    mean[a] = s->sum[a] / s->n;
+    center[a] = median(s, a);
+  }
+  return r;
+}
+
+#ifdef TESTING
+#include <assert.h>
+
+static int by_value(const void *a, const void *b) {
+  float x = *(const float *)a, y = *(const float *)b;
+  return (x > y) - (x < y);
+}
+
+int main() {
+  enum { N = 100001 };
+  static float v[4][N], sorted[N];
+  srand(3);
+  for (int i = 0; i < N; i++) {
+    v[0][i] = 100 + 50 * (float)rand() / RAND_MAX;
+    v[1][i] = -20 + (float)rand() / RAND_MAX;
+    v[2][i] = (i / 1000) * 0.2f;
+    v[3][i] = i % 7 ? 0.001f * i : -1e6f; // a far away outlier every 7
+  }
+
+  // in one go, or in pieces merged together
+  stats_sketch one, all, part;
+  stats_sketch_init(&one);
+  stats_sketch_init(&all);
+  stats_sketch_add(&one, v[0], v[1], v[2], v[3], N);
+  for (size_t i = 0; i < N; i += 9999) {
+    size_t n = N - i < 9999 ? N - i : 9999;
+    stats_sketch_init(&part);
+    stats_sketch_add(&part, v[0] + i, v[1] + i, v[2] + i, v[3] + i, n);
+    stats_sketch_merge(&all, &part);
+    stats_sketch_free(&part);
+  }
+  stats s = stats_of(&one), t = stats_of(&all);
+  assert(s.n == N && t.n == N);
+  assert(0 == memcmp(&s.min, &t.min, sizeof(Vector4)));
+  assert(0 == memcmp(&s.max, &t.max, sizeof(Vector4)));
+  assert(0 == memcmp(&s.center, &t.center, sizeof(Vector4)));
+
+  float *min = &s.min.x, *max = &s.max.x, *mean = &s.mean.x,
+        *center = &s.center.x;
+  for (int a = 0; a < 4; a++) {
+    memcpy(sorted, v[a], sizeof(sorted));
+    qsort(sorted, N, sizeof(float), by_value);
+    double sum = 0;
+    for (int i = 0; i < N; i++)
+      sum += v[a][i];
+    assert(min[a] == sorted[0] && max[a] == sorted[N - 1]);
+    assert(fabs(mean[a] - sum / N) <= 1e-6 * fabs(sum / N) + 1e-6);
+    float m = sorted[N / 2];
+    assert(fabsf(center[a] - m) <= fabsf(m) / 128 + 1e-6f);
+  }
+
+  // nothing in, zeros out
+  stats_sketch_init(&part);
+  stats_sketch_merge(&all, &part);
+  stats e = stats_of(&part);
+  assert(e.n == 0 && e.center.x == 0 && e.min.w == 0);
+
+  stats_sketch_free(&one);
+  stats_sketch_free(&all);
+  printf("ok\n");
+}
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+#include "raylib.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/// bins per axis of stats_sketch, keyed on the top 16 bits of the float
+/// That's 7 bits of mantissa: a median is off by less than 1/128 of itself.
+#define STATS_BINS (1 << 16)
+
+/// where the points are: bounding box, mean and median of each axis
+/// The median keeps the odd park or purge move far from the part from
+/// dragging the center over to it.
+typedef struct {
+  size_t n;
+  Vector4 min, max, mean, center;
+} stats;
+
+/// what stats come from, in one pass over the points
+/// Sketches of parts of the points merge into the sketch of all of them, so
+/// every thread keeps its own.
+typedef struct {
+  size_t n;
+  float min[4], max[4];
+  double sum[4];
+  uint32_t *bins; // 4 * STATS_BINS, allocated on the first point
+} stats_sketch;
+
+void stats_sketch_init(stats_sketch *s);
+
+void stats_sketch_free(stats_sketch *s);
+
+/// add the n points (x[i], y[i], z[i], e[i])
+void stats_sketch_add(stats_sketch *s, const float *x, const float *y,
+                      const float *z, const float *e, size_t n);
+
+/// add everything in from to s
+void stats_sketch_merge(stats_sketch *s, const stats_sketch *from);
+
+stats stats_of(const stats_sketch *s);
@@ -0,0 +1,210 @@
+#include "synth.h"
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  char *b;
+  size_t n, cap;
+} text;
+
+static void put(text *t, const char *fmt, ...) {
+  for (;;) {
+    va_list ap;
+    va_start(ap, fmt);
+    int k = vsnprintf(t->b + t->n, t->cap - t->n, fmt, ap);
+    va_end(ap);
+    if (k >= 0 && t->n + k < t->cap) {
+      t->n += k;
+      return;
+    }
+    t->cap = 2 * t->cap + k + 1;
+    t->b = realloc(t->b, t->cap);
+    if (!t->b) {
+      fprintf(stderr, "out of memory for %zu bytes of gcode\n", t->cap);
+      exit(-1);
+    }
+  }
+}
+
+// xorshift, rather than rand(), so every libc makes the same file
+static uint32_t next(uint32_t *s) {
+  *s ^= *s << 13;
+  *s ^= *s >> 17;
+  *s ^= *s << 5;
+  return *s;
+}
+
+// uniform in [lo, hi]
+static long between(uint32_t *s, long lo, long hi) {
+  return lo + (long)(next(s) % (uint32_t)(hi - lo + 1));
+}
+
+// microns as millimeters, without going through a float
+static const char *mm(char *b, long um) {
+  sprintf(b, "%s%ld.%03ld", um < 0 ? "-" : "", labs(um) / 1000,
+          labs(um) % 1000);
+  return b;
+}
+
+char *synth_gcode(const synth_opts *o, size_t *len) {
+  text t = {malloc(1 << 16), 0, 1 << 16};
+  if (!t.b) {
+    fprintf(stderr, "out of memory for gcode\n");
+    exit(-1);
+  }
+  uint32_t s = o->seed ? o->seed : 1;
+  long size = (long)(o->size * 1000), x = size / 2, y = size / 2;
+  long e = 0;
+  size_t line = 0;
+  char bx[32], by[32], bz[32], be[32], bi[32], bj[32];
+  put(&t, "; synthetic gcode, %d layers of %zu moves, seed %u\n", o->layers,
+      o->per_layer, o->seed);
+  put(&t, "G90\nM82\nG28\nG0 X%s Y%s F6000\n", mm(bx, x), mm(by, y));
+
+  for (int l = 0; l < o->layers; l++) {
+    bool rel = between(&s, 0, 99) < o->relative;
+    long z = lround((l + 1) * o->height * 1000);
+    put(&t, ";LAYER:%d\n", l);
+    if (rel)
+      put(&t, "G91\nM83\nG0 Z%s\n", mm(bz, z - lround(l * o->height * 1000)));
+    else
+      put(&t, "G0 Z%s\n", mm(bz, z));
+
+    for (size_t i = 0; i < o->per_layer; i++) {
+      if (o->comments && ++line % o->comments == 0)
+        put(&t, "; move %zu of layer %d\n", i, l);
+      long nx, ny;
+      if (between(&s, 0, 24) == 0) {
+        // travel to the next island, mostly nearby
+        long far = between(&s, 0, 9) ? 20000 : size;
+        nx = x + between(&s, -far, far);
+        ny = y + between(&s, -far, far);
+        nx = nx < 0 ? 0 : nx > size ? size : nx;
+        ny = ny < 0 ? 0 : ny > size ? size : ny;
+        put(&t, "G0 X%s Y%s\n", mm(bx, rel ? nx - x : nx),
+            mm(by, rel ? ny - y : ny));
+        x = nx;
+        y = ny;
+        continue;
+      }
+      bool arc = between(&s, 0, 99) < o->arcs;
+      long ci = 0, cj = 0;
+      if (arc) {
+        // around a center up to 5 mm away, to an angle up to half a turn on
+        ci = between(&s, -5000, 5000);
+        cj = between(&s, -5000, 5000);
+        double r = hypot(ci, cj), a = atan2(-cj, -ci) + (next(&s) % 1000) *
+                                                          M_PI / 1000;
+        nx = x + ci + lround(r * cos(a));
+        ny = y + cj + lround(r * sin(a));
+      } else {
+        nx = x + between(&s, -3000, 3000);
+        ny = y + between(&s, -3000, 3000);
+      }
+      if (nx < 0 || nx > size || ny < 0 || ny > size) {
+        // back towards the middle
+        arc = false;
+        nx = (x + size / 2) / 2;
+        ny = (y + size / 2) / 2;
+      }
+      // about 0.033 mm of filament per mm, for 0.4 mm lines 0.2 mm high
+      long de = lround(0.033 * hypot(nx - x, ny - y));
+      const char *g = arc ? next(&s) % 2 ? "G2" : "G3" : "G1";
+      put(&t, "%s X%s Y%s", g, mm(bx, rel ? nx - x : nx),
+          mm(by, rel ? ny - y : ny));
+      if (arc)
+        put(&t, " I%s J%s", mm(bi, ci), mm(bj, cj));
+      e += de;
+      put(&t, " E%s\n", mm(be, rel ? de : e));
+      x = nx;
+      y = ny;
+    }
+    if (rel)
+      put(&t, "G90\nM82\n");
+  }
+  *len = t.n;
+  return t.b;
+}
+
+#ifdef SYNTH_MAIN
+// gcodegen [layers [per_layer [relative% [comments [arcs% [seed]]]]]]
+int main(int argc, char **argv) {
+  synth_opts o = SYNTH_DEFAULTS;
+  if (argc > 1 && argv[1][0] == '-') {
+    fprintf(stderr,
+            "usage: %s [layers [moves_per_layer [relative_percent "
+            "[comment_every [arc_percent [seed]]]]]] > file.gcode\n",
+            argv[0]);
+    return 1;
+  }
+  if (argc > 1)
+    o.layers = atoi(argv[1]);
+  if (argc > 2)
+    o.per_layer = strtoul(argv[2], NULL, 10);
+  if (argc > 3)
+    o.relative = atoi(argv[3]);
+  if (argc > 4)
+    o.comments = atoi(argv[4]);
+  if (argc > 5)
+    o.arcs = atoi(argv[5]);
+  if (argc > 6)
+    o.seed = strtoul(argv[6], NULL, 10);
+  size_t n;
+  char *g = synth_gcode(&o, &n);
+  fwrite(g, 1, n, stdout);
+  free(g);
+}
+#endif
+
+#ifdef TESTING
+#include "gcode.h"
+#include "layers.h"
+#include <assert.h>
+
+int main() {
+  synth_opts o = SYNTH_DEFAULTS;
+  o.layers = 20;
+  o.per_layer = 500;
+  o.arcs = 10;
+  size_t n, n2;
+  char *g = synth_gcode(&o, &n), *g2 = synth_gcode(&o, &n2);
+  assert(n == strlen(g) && n == n2 && 0 == memcmp(g, g2, n));
+
+  // a move per line that moves, and a layer per layer
+  segments t;
+  segments_init(&t);
+  gcode_parse(&t, g, g + n, NULL, 0);
+  assert(t.n == 1 + o.layers * (o.per_layer + 1));
+  layers ls = {0};
+  layers_build(&ls, &t);
+  assert(ls.n == (size_t)o.layers);
+  for (size_t i = 0; i < t.n; i++)
+    assert(t.x1[i] >= 0 && t.x1[i] <= o.size && t.y1[i] <= o.size);
+
+  // relative layers end up in the same places as absolute ones
+  o.relative = 100;
+  free(g2);
+  g2 = synth_gcode(&o, &n2);
+  segments u;
+  segments_init(&u);
+  gcode_parse(&u, g2, g2 + n2, NULL, 0);
+  assert(u.n == t.n);
+  for (size_t i = 0; i < t.n; i++)
+    assert(fabsf(t.x1[i] - u.x1[i]) < 1e-3f &&
+           fabsf(t.y1[i] - u.y1[i]) < 1e-3f &&
+           fabsf(t.z1[i] - u.z1[i]) < 1e-3f &&
+           fabsf(t.e1[i] - u.e1[i]) < 1e-2f && t.kind[i] == u.kind[i]);
+
+  segments_free(&t);
+  segments_free(&u);
+  layers_free(&ls);
+  free(g);
+  free(g2);
+  printf("ok\n");
+}
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+#include <stddef.h>
+
+/// what synth_gcode() writes
+typedef struct {
+  int layers;
+  size_t per_layer;   // moves per layer
+  float size, height; // mm across the bed, mm per layer
+  int relative;       // percent of layers in G91/M83
+  int comments;       // a comment every this many lines, or 0 for none
+  int arcs;           // percent of extrusions that are G2/G3
+  unsigned seed;
+} synth_opts;
+
+#define SYNTH_DEFAULTS                                                        \
+  (synth_opts) {                                                              \
+    .layers = 100, .per_layer = 2000, .size = 100, .height = 0.2f,           \
+    .relative = 10, .comments = 50, .arcs = 0, .seed = 1                      \
+  }
+
+/// G-code that looks like a slicer's, the same for the same o on any machine
+/// Each layer goes up, then wanders around the bed extruding, with a travel
+/// every so often. Coordinates are whole microns, so relative layers don't
+/// drift from where absolute ones would have been. Returns malloc()ed
+/// text, nul terminated, and its length in len.
+char *synth_gcode(const synth_opts *o, size_t *len);
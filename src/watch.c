@@ -0,0 +1,77 @@
+#include "watch.h"
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+static int fd = -1;
+static char name[NAME_MAX + 1];
+static int debounce;
+static void (*on_change)(void);
+static atomic_bool changed;
+
+// read the pending events, true if one of them was for the watched file
+static bool read_events() {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool ours = false;
+  ssize_t len = read(fd, buf, sizeof(buf));
+  for (char *p = buf; len > 0 && p < buf + len;) {
+    struct inotify_event *ev = (struct inotify_event *)p;
+    if (ev->len && 0 == strcmp(ev->name, name))
+      ours = true;
+    p += sizeof(struct inotify_event) + ev->len;
+  }
+  return ours;
+}
+
+static void *watcher(void *arg) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  for (;;) {
+    // sleep until the file is written or replaced
+    if (poll(&pfd, 1, -1) <= 0 || !read_events())
+      continue;
+    // then until it has been quiet for a while
+    while (poll(&pfd, 1, debounce) > 0)
+      read_events();
+    atomic_store(&changed, true);
+    if (on_change)
+      on_change();
+  }
+  return NULL;
+}
+
+bool watch_start(const char *file, int debounce_ms, void (*notify)(void)) {
+  char *a = strdup(file), *b = strdup(file);
+  snprintf(name, sizeof(name), "%s", basename(a));
+  // watch the directory, slicers often write elsewhere and rename
+  fd = inotify_init1(IN_CLOEXEC);
+  bool ok = fd >= 0 && inotify_add_watch(fd, dirname(b),
+                                         IN_CLOSE_WRITE | IN_MOVED_TO) >= 0;
+  free(a);
+  free(b);
+  if (!ok) {
+    if (fd >= 0)
+      close(fd);
+    fd = -1;
+    return false;
+  }
+
+  debounce = debounce_ms;
+  on_change = notify;
+  pthread_t th;
+  if (pthread_create(&th, NULL, watcher, NULL)) {
+    close(fd);
+    fd = -1;
+    return false;
+  }
+  pthread_detach(th);
+  return true;
+}
+
+bool watch_changed() { return atomic_exchange(&changed, false); }
@@ -0,0 +1,12 @@
+#pragma once
+#include <stdbool.h>
+
+/// watch file from a thread with inotify
+/// A change is a write that was closed, or another file renamed over it,
+/// followed by debounce_ms without further events, so a half-written file
+/// isn't reported. notify() is called from the watcher thread after each
+/// change. Returns false when inotify can't be used.
+bool watch_start(const char *file, int debounce_ms, void (*notify)(void));
+
+/// true once after each change
+bool watch_changed();